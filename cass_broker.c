@@ -0,0 +1,1331 @@
+/*-------------------------------------------------------------------------
+ *
+ * cass_broker.c
+ *
+ * Optional background workers, "brokers", that run the queries of plain
+ * foreign scans on behalf of all backends.  Without them, every backend
+ * that reads a foreign table has a session of its own, with the driver's
+ * I/O threads and connections to every node; with them, only the brokers
+ * do, and the number of connections follows the number of brokers rather
+ * than the number of backends.
+ *
+ * A scan creates a dynamic shared memory segment holding two queues, one
+ * for its requests and one for the broker's answers, and posts its handle
+ * to the inbox of the least busy broker.  Each request carries everything
+ * needed to run the query: the server's and user mapping's options, the
+ * CQL text, the values to bind and the types of the columns to return, so
+ * that brokers need no catalog access.  The broker answers with one
+ * message per result page, values decoded to Datums where possible and
+ * sent as text otherwise.  Requests are numbered; a rescan sends a new one,
+ * and answers to earlier ones are skipped.
+ *
+ * Brokers are started when the library is in shared_preload_libraries and
+ * cassandra2_fdw.broker_workers is set.
+ *
+ * IDENTIFICATION
+ *		  contrib/cassandra2_fdw/cass_broker.c
+ *
+ *-------------------------------------------------------------------------
+ */
+#include "postgres.h"
+
+#include <arpa/inet.h>
+
+#include "cassandra2_fdw.h"
+
+#include "commands/defrem.h"
+#include "libpq/pqformat.h"
+#include "miscadmin.h"
+#include "nodes/makefuncs.h"
+#include "postmaster/bgworker.h"
+#include "storage/dsm.h"
+#include "storage/ipc.h"
+#include "storage/latch.h"
+#include "storage/lwlock.h"
+#include "storage/proc.h"
+#include "storage/shm_mq.h"
+#include "storage/shm_toc.h"
+#include "storage/shmem.h"
+#include "storage/spin.h"
+#include "utils/catcache.h"
+#include "utils/datum.h"
+#include "utils/guc.h"
+#include "utils/memutils.h"
+#include "utils/resowner.h"
+
+/* Largest number of brokers */
+#define CASS_BROKER_MAX_WORKERS		64
+
+/* Number of new scans that may wait for a broker to pick them up */
+#define CASS_BROKER_INBOX_SIZE		64
+
+/* Layout of the dynamic shared memory of a scan served by a broker */
+#define CASS_BROKER_MAGIC			0x43425253
+#define CASS_BROKER_KEY_REQUESTS	1
+#define CASS_BROKER_KEY_ANSWERS		2
+#define CASS_BROKER_REQUEST_QUEUE_SIZE	16384
+#define CASS_BROKER_ANSWER_QUEUE_SIZE	65536
+
+/* Kinds of answer messages */
+#define CASS_BROKER_PAGE		'p'	/* a page of rows, more to come */
+#define CASS_BROKER_LAST_PAGE	'l'	/* the last page of rows */
+#define CASS_BROKER_ERROR		'e'	/* the request failed */
+
+/* Tags of the values in a row */
+#define CASS_BROKER_NULL		'n'
+#define CASS_BROKER_DATUM		'd'
+#define CASS_BROKER_TEXT		't'
+
+/*
+ * A broker's entry in shared memory.
+ */
+typedef struct CassBrokerSlot
+{
+  PGPROC *proc; /* the broker, or NULL if it isn't running */
+  uint32 generation; /* bumped each time a broker starts in this slot */
+  int nscans; /* # of scans it serves or has in its inbox */
+  int ninbox; /* # of entries in inbox */
+  dsm_handle inbox[CASS_BROKER_INBOX_SIZE]; /* segments of new scans */
+} CassBrokerSlot;
+
+typedef struct CassBrokerShared
+{
+  slock_t mutex; /* protects all the slots */
+  CassBrokerSlot slots[FLEXIBLE_ARRAY_MEMBER];
+} CassBrokerShared;
+
+/*
+ * Backend side of a scan served by a broker.
+ */
+struct CassBrokerScan
+{
+  int slot; /* broker serving the scan */
+  uint32 generation; /* and the generation it was started in */
+  dsm_segment *seg;
+  shm_mq_handle *requests;
+  shm_mq_handle *answers;
+  uint32 seq; /* number of the current request */
+  StringInfoData request; /* its constant part, built once */
+  int ncolumns; /* # of entries in the arrays below */
+  int *attnums; /* attribute numbers of the columns retrieved */
+  int16 *typlens;
+  bool *typbyvals;
+  StringInfoData page; /* current page, positioned at the next row */
+  int rows_left; /* rows of the page not read yet */
+  bool eof; /* the current page is the last one */
+};
+
+/*
+ * Broker side of a scan.
+ */
+typedef struct BrokerChannel
+{
+  dsm_segment *seg;
+  shm_mq_handle *requests;
+  shm_mq_handle *answers;
+  MemoryContext cxt; /* holds the current request's data */
+  MemoryContext row_cxt; /* for values decoded from one row */
+  uint32 seq; /* number of the current request */
+  bool active; /* its answer isn't complete yet */
+  Oid dbid; /* database of the backend */
+  ForeignServer *server; /* server and user mapping to connect with */
+  UserMapping *user;
+  CassSession *session; /* NULL until connected */
+  char *query; /* CQL text of the current request */
+  CassFuture *prepare_future; /* preparing query, if in flight */
+  int fetch_size;
+  int nparams; /* # of values to bind */
+  Datum *params;
+  Oid *paramtypes;
+  CassStatement *statement; /* carries paging state between pages */
+  CassFuture *future; /* request for the next page, if in flight */
+  int ncolumns;
+  Oid *types;
+  int32 *typmods;
+  int16 *typlens;
+  bool *typbyvals;
+  CassValueDecoder *decoders; /* chosen on the first page */
+  bool decoders_valid;
+  StringInfoData out; /* answer being sent */
+  bool sending; /* out hasn't been sent in full yet */
+  bool out_final; /* out completes the answer */
+} BrokerChannel;
+
+/* GUC variables */
+static int broker_workers = 0;
+static bool use_broker = true;
+
+static CassBrokerShared *broker_shared = NULL;
+static shmem_startup_hook_type prev_shmem_startup_hook = NULL;
+
+/* Broker state */
+static volatile sig_atomic_t got_sigterm = false;
+static int my_slot = -1;
+
+/*
+ * Background worker entry point
+ */
+extern void cassandra2_fdw_broker_main (Datum main_arg);
+
+/* prototypes of private functions */
+static Size broker_shmem_size (void);
+static void broker_shmem_startup (void);
+static void broker_sigterm (SIGNAL_ARGS);
+static void broker_release_slot (int code, Datum arg);
+static void broker_future_callback (CassFuture *future, void *data);
+static void broker_claim_inbox (BrokerChannel ***channels, int *nchannels,
+                                int *maxchannels);
+static bool broker_serve_channel (BrokerChannel *ch);
+static void broker_start_request (BrokerChannel *ch, char *data, Size nbytes);
+static bool broker_start_fetch (BrokerChannel *ch);
+static void broker_finish_request (BrokerChannel *ch);
+static void broker_build_page (BrokerChannel *ch);
+static void broker_send_error (BrokerChannel *ch, const char *message,
+                               int len);
+static void broker_close_channel (BrokerChannel *ch);
+static bool broker_is_running (CassBrokerScan *scan);
+static void broker_send_request (CassBrokerScan *scan, StringInfo msg);
+static void broker_receive_page (CassBrokerScan *scan);
+static void send_text (StringInfo buf, const char *str, int len);
+static char *get_text (StringInfo buf);
+static void send_datum (StringInfo buf, Datum value, int16 typlen,
+                        bool typbyval);
+static Datum get_datum (StringInfo buf, int16 typlen, bool typbyval);
+static void send_options (StringInfo buf, List *options);
+static List *get_options (StringInfo buf);
+
+/*
+ * Define the broker's GUCs, and when the library is being preloaded,
+ * reserve its shared memory and register the brokers.  Called from
+ * _PG_init.
+ */
+void
+pgcass_InitBroker (void)
+{
+  int i;
+
+  DefineCustomBoolVariable ("cassandra2_fdw.use_broker",
+                            "Run plain foreign scans through the broker workers, if there are any.",
+                            NULL,
+                            &use_broker,
+                            true,
+                            PGC_USERSET,
+                            0,
+                            NULL, NULL, NULL);
+
+  if (!process_shared_preload_libraries_in_progress)
+    return;
+
+  DefineCustomIntVariable ("cassandra2_fdw.broker_workers",
+                           "Number of background workers holding Cassandra sessions for all backends.",
+                           NULL,
+                           &broker_workers,
+                           0,
+                           0, CASS_BROKER_MAX_WORKERS,
+                           PGC_POSTMASTER,
+                           0,
+                           NULL, NULL, NULL);
+
+  if (broker_workers == 0)
+    return;
+
+  RequestAddinShmemSpace (broker_shmem_size ());
+  prev_shmem_startup_hook = shmem_startup_hook;
+  shmem_startup_hook = broker_shmem_startup;
+
+  for (i = 0; i < broker_workers; i++)
+    {
+      BackgroundWorker worker;
+
+      MemSet (&worker, 0, sizeof (worker));
+      snprintf (worker.bgw_name, BGW_MAXLEN, "cassandra2_fdw broker %d", i);
+      worker.bgw_flags = BGWORKER_SHMEM_ACCESS;
+      worker.bgw_start_time = BgWorkerStart_ConsistentState;
+      worker.bgw_restart_time = 10;
+      worker.bgw_main = NULL;
+      snprintf (worker.bgw_library_name, BGW_MAXLEN, "cassandra2_fdw");
+      snprintf (worker.bgw_function_name, BGW_MAXLEN,
+                "cassandra2_fdw_broker_main");
+      worker.bgw_main_arg = Int32GetDatum (i);
+      RegisterBackgroundWorker (&worker);
+    }
+}
+
+static Size
+broker_shmem_size (void)
+{
+  return add_size (offsetof (CassBrokerShared, slots),
+                   mul_size (broker_workers, sizeof (CassBrokerSlot)));
+}
+
+static void
+broker_shmem_startup (void)
+{
+  bool found;
+
+  if (prev_shmem_startup_hook)
+    prev_shmem_startup_hook ();
+
+  LWLockAcquire (AddinShmemInitLock, LW_EXCLUSIVE);
+  broker_shared = ShmemInitStruct ("cassandra2_fdw brokers",
+                                   broker_shmem_size (), &found);
+  if (!found)
+    {
+      MemSet (broker_shared, 0, broker_shmem_size ());
+      SpinLockInit (&broker_shared->mutex);
+    }
+  LWLockRelease (AddinShmemInitLock);
+}
+
+/*
+ * Check whether this session's scans are sent to brokers, and at least one
+ * is running to take them.
+ */
+bool
+pgcass_BrokerAvailable (void)
+{
+  bool running = false;
+  int i;
+
+  if (broker_shared == NULL || !use_broker)
+    return false;
+
+  SpinLockAcquire (&broker_shared->mutex);
+  for (i = 0; i < broker_workers; i++)
+    {
+      if (broker_shared->slots[i].proc != NULL)
+        running = true;
+    }
+  SpinLockRelease (&broker_shared->mutex);
+
+  return running;
+}
+
+/*
+ * Set up a scan to be run by a broker.  Returns NULL if there is no broker
+ * to run it, or none with room for another scan; the caller then connects
+ * by itself.
+ */
+CassBrokerScan *
+pgcass_BrokerBeginScan (ForeignServer *server, UserMapping *user,
+                        Relation rel, const char *query,
+                        List *retrieved_attrs, int fetch_size)
+{
+  TupleDesc tupdesc = RelationGetDescr (rel);
+  CassBrokerScan *scan;
+  CassBrokerSlot *slot;
+  PGPROC *proc;
+  shm_toc_estimator e;
+  shm_toc *toc;
+  shm_mq *mq;
+  int best = -1;
+  uint32 generation = 0;
+  ListCell *lc;
+  int i;
+
+  if (broker_shared == NULL || !use_broker)
+    return NULL;
+
+  /* Pick the running broker with the fewest scans. */
+  SpinLockAcquire (&broker_shared->mutex);
+  for (i = 0; i < broker_workers; i++)
+    {
+      slot = &broker_shared->slots[i];
+
+      if (slot->proc != NULL && slot->ninbox < CASS_BROKER_INBOX_SIZE &&
+          (best < 0 || slot->nscans < broker_shared->slots[best].nscans))
+        best = i;
+    }
+  if (best >= 0)
+    generation = broker_shared->slots[best].generation;
+  SpinLockRelease (&broker_shared->mutex);
+
+  if (best < 0)
+    return NULL;
+
+  scan = (CassBrokerScan *) palloc0 (sizeof (CassBrokerScan));
+  scan->slot = best;
+  scan->generation = generation;
+
+  /* Describe the columns to return. */
+  scan->ncolumns = list_length (retrieved_attrs);
+  scan->attnums = (int *) palloc (scan->ncolumns * sizeof (int));
+  scan->typlens = (int16 *) palloc (scan->ncolumns * sizeof (int16));
+  scan->typbyvals = (bool *) palloc (scan->ncolumns * sizeof (bool));
+
+  /*
+   * The part of the request that is the same for every execution: where
+   * and how to connect, the query and the columns it returns.
+   */
+  initStringInfo (&scan->request);
+  pq_sendint (&scan->request, MyDatabaseId, 4);
+  pq_sendint (&scan->request, server->serverid, 4);
+  pq_sendint (&scan->request, user->userid, 4);
+  send_text (&scan->request, server->servername, -1);
+  send_options (&scan->request, server->options);
+  send_options (&scan->request, user->options);
+  send_text (&scan->request, query, -1);
+  pq_sendint (&scan->request, fetch_size, 4);
+  pq_sendint (&scan->request, scan->ncolumns, 4);
+  i = 0;
+  foreach (lc, retrieved_attrs)
+  {
+    int attnum = lfirst_int (lc);
+    Oid type = InvalidOid;
+    int32 typmod = -1;
+
+    scan->attnums[i] = attnum;
+    scan->typlens[i] = -1;
+    scan->typbyvals[i] = false;
+    if (attnum > 0)
+      {
+        Form_pg_attribute attr = tupdesc->attrs[attnum - 1];
+
+        type = attr->atttypid;
+        typmod = attr->atttypmod;
+        scan->typlens[i] = attr->attlen;
+        scan->typbyvals[i] = attr->attbyval;
+      }
+    pq_sendint (&scan->request, type, 4);
+    pq_sendint (&scan->request, typmod, 4);
+    pq_sendint (&scan->request, scan->typlens[i], 2);
+    pq_sendbyte (&scan->request, scan->typbyvals[i]);
+    i++;
+  }
+
+  /* Create the queues, and post them to the broker. */
+  shm_toc_initialize_estimator (&e);
+  shm_toc_estimate_chunk (&e, CASS_BROKER_REQUEST_QUEUE_SIZE);
+  shm_toc_estimate_chunk (&e, CASS_BROKER_ANSWER_QUEUE_SIZE);
+  shm_toc_estimate_keys (&e, 2);
+  scan->seg = dsm_create (shm_toc_estimate (&e));
+  toc = shm_toc_create (CASS_BROKER_MAGIC, dsm_segment_address (scan->seg),
+                        shm_toc_estimate (&e));
+
+  mq = shm_mq_create (shm_toc_allocate (toc, CASS_BROKER_REQUEST_QUEUE_SIZE),
+                      CASS_BROKER_REQUEST_QUEUE_SIZE);
+  shm_toc_insert (toc, CASS_BROKER_KEY_REQUESTS, mq);
+  shm_mq_set_sender (mq, MyProc);
+  scan->requests = shm_mq_attach (mq, scan->seg, NULL);
+
+  mq = shm_mq_create (shm_toc_allocate (toc, CASS_BROKER_ANSWER_QUEUE_SIZE),
+                      CASS_BROKER_ANSWER_QUEUE_SIZE);
+  shm_toc_insert (toc, CASS_BROKER_KEY_ANSWERS, mq);
+  shm_mq_set_receiver (mq, MyProc);
+  scan->answers = shm_mq_attach (mq, scan->seg, NULL);
+
+  SpinLockAcquire (&broker_shared->mutex);
+  slot = &broker_shared->slots[best];
+  proc = slot->proc;
+  if (proc != NULL && slot->generation == generation &&
+      slot->ninbox < CASS_BROKER_INBOX_SIZE)
+    {
+      slot->inbox[slot->ninbox++] = dsm_segment_handle (scan->seg);
+      slot->nscans++;
+    }
+  else
+    proc = NULL;
+  SpinLockRelease (&broker_shared->mutex);
+
+  /* The broker may have exited, or its inbox filled up, meanwhile. */
+  if (proc == NULL)
+    {
+      pgcass_BrokerEndScan (scan);
+      return NULL;
+    }
+
+  SetLatch (&proc->procLatch);
+  return scan;
+}
+
+/*
+ * Send the query of a scan to its broker, with the given parameter values,
+ * none of which may be null.
+ */
+void
+pgcass_BrokerExecute (CassBrokerScan *scan, int nparams, Datum *values,
+                      Oid *types, int16 *typlens, bool *typbyvals)
+{
+  StringInfoData msg;
+  int i;
+
+  scan->seq++;
+  scan->rows_left = 0;
+  scan->eof = false;
+
+  initStringInfo (&msg);
+  pq_sendint (&msg, scan->seq, 4);
+  appendBinaryStringInfo (&msg, scan->request.data, scan->request.len);
+  pq_sendint (&msg, nparams, 4);
+  for (i = 0; i < nparams; i++)
+    {
+      pq_sendint (&msg, types[i], 4);
+      pq_sendint (&msg, typlens[i], 2);
+      pq_sendbyte (&msg, typbyvals[i]);
+      send_datum (&msg, values[i], typlens[i], typbyvals[i]);
+    }
+
+  broker_send_request (scan, &msg);
+  pfree (msg.data);
+}
+
+/*
+ * Store the next row of a scan's result in the slot, as a virtual tuple
+ * whose values live in temp_context.  Returns false at the end of the
+ * result.
+ */
+bool
+pgcass_BrokerNextRow (CassBrokerScan *scan, TupleTableSlot *slot,
+                      AttInMetadata *attinmeta, MemoryContext temp_context)
+{
+  TupleDesc tupdesc = slot->tts_tupleDescriptor;
+  Datum *values = slot->tts_values;
+  bool *nulls = slot->tts_isnull;
+  MemoryContext oldcontext;
+  int j;
+
+  while (scan->rows_left == 0)
+    {
+      if (scan->eof)
+        return false;
+      broker_receive_page (scan);
+    }
+  scan->rows_left--;
+
+  ExecClearTuple (slot);
+  MemoryContextReset (temp_context);
+  oldcontext = MemoryContextSwitchTo (temp_context);
+
+  memset (values, 0, tupdesc->natts * sizeof (Datum));
+  memset (nulls, true, tupdesc->natts * sizeof (bool));
+
+  for (j = 0; j < scan->ncolumns; j++)
+    {
+      int i = scan->attnums[j];
+      int tag = pq_getmsgbyte (&scan->page);
+      Datum value = (Datum) 0;
+      char *valstr = NULL;
+
+      if (tag == CASS_BROKER_DATUM)
+        value = get_datum (&scan->page, scan->typlens[j], scan->typbyvals[j]);
+      else if (tag == CASS_BROKER_TEXT)
+        valstr = get_text (&scan->page);
+      else if (tag != CASS_BROKER_NULL)
+        elog (ERROR, "invalid value tag %d from cassandra2_fdw broker", tag);
+
+      if (i <= 0)
+        continue;
+
+      nulls[i - 1] = (tag == CASS_BROKER_NULL);
+      if (tag == CASS_BROKER_DATUM)
+        values[i - 1] = value;
+      else
+        {
+          /* Apply the input function even to nulls, to support domains */
+          values[i - 1] = InputFunctionCall (&attinmeta->attinfuncs[i - 1],
+                                             valstr,
+                                             attinmeta->attioparams[i - 1],
+                                             attinmeta->atttypmods[i - 1]);
+        }
+    }
+
+  MemoryContextSwitchTo (oldcontext);
+
+  ExecStoreVirtualTuple (slot);
+  return true;
+}
+
+/*
+ * End a scan run by a broker.  Detaching from the segment tells the broker
+ * to drop the scan.
+ */
+void
+pgcass_BrokerEndScan (CassBrokerScan *scan)
+{
+  dsm_detach (scan->seg);
+}
+
+/*
+ * Check that the broker a scan was posted to is still the one running.
+ */
+static bool
+broker_is_running (CassBrokerScan *scan)
+{
+  CassBrokerSlot *slot = &broker_shared->slots[scan->slot];
+  bool running;
+
+  SpinLockAcquire (&broker_shared->mutex);
+  running = slot->proc != NULL && slot->generation == scan->generation;
+  SpinLockRelease (&broker_shared->mutex);
+
+  return running;
+}
+
+/*
+ * Send a request to a scan's broker, waiting for room in the queue.  The
+ * broker takes no request while it is sending an answer, so what is left
+ * of the answer to the previous request is read and dropped meanwhile.
+ */
+static void
+broker_send_request (CassBrokerScan *scan, StringInfo msg)
+{
+  for (;;)
+    {
+      shm_mq_result res;
+      Size nbytes;
+      void *data;
+
+      res = shm_mq_send (scan->requests, msg->len, msg->data, true);
+      if (res == SHM_MQ_SUCCESS)
+        return;
+      if (res == SHM_MQ_WOULD_BLOCK)
+        {
+          res = shm_mq_receive (scan->answers, &nbytes, &data, true);
+          if (res == SHM_MQ_SUCCESS)
+            continue;
+        }
+      if (res == SHM_MQ_DETACHED || !broker_is_running (scan))
+        ereport (ERROR,
+                 (errcode (ERRCODE_FDW_UNABLE_TO_ESTABLISH_CONNECTION),
+                  errmsg ("cassandra2_fdw broker has exited")));
+
+      WaitLatch (&MyProc->procLatch,
+                 WL_LATCH_SET | WL_TIMEOUT | WL_POSTMASTER_DEATH, 1000L);
+      ResetLatch (&MyProc->procLatch);
+      CHECK_FOR_INTERRUPTS ();
+    }
+}
+
+/*
+ * Wait for the next page of the current request's answer.  The message
+ * stays valid until the next receive, which only happens once its rows
+ * have all been read.
+ */
+static void
+broker_receive_page (CassBrokerScan *scan)
+{
+  for (;;)
+    {
+      shm_mq_result res;
+      Size nbytes;
+      void *data;
+
+      res = shm_mq_receive (scan->answers, &nbytes, &data, true);
+      if (res == SHM_MQ_SUCCESS)
+        {
+          int kind;
+
+          scan->page.data = (char *) data;
+          scan->page.len = nbytes;
+          scan->page.maxlen = nbytes;
+          scan->page.cursor = 0;
+
+          /* Skip what is left of the answers to earlier requests. */
+          if ((uint32) pq_getmsgint (&scan->page, 4) != scan->seq)
+            continue;
+
+          kind = pq_getmsgbyte (&scan->page);
+          if (kind == CASS_BROKER_ERROR)
+            {
+              char *message = get_text (&scan->page);
+
+              scan->eof = true;
+              ereport (ERROR,
+                       (errcode (ERRCODE_FDW_UNABLE_TO_CREATE_EXECUTION),
+                        errmsg ("Unable to run query: '%s'", message)));
+            }
+
+          scan->rows_left = pq_getmsgint (&scan->page, 4);
+          scan->eof = (kind == CASS_BROKER_LAST_PAGE);
+          return;
+        }
+      if (res == SHM_MQ_DETACHED || !broker_is_running (scan))
+        ereport (ERROR,
+                 (errcode (ERRCODE_FDW_UNABLE_TO_ESTABLISH_CONNECTION),
+                  errmsg ("cassandra2_fdw broker has exited")));
+
+      WaitLatch (&MyProc->procLatch,
+                 WL_LATCH_SET | WL_TIMEOUT | WL_POSTMASTER_DEATH, 1000L);
+      ResetLatch (&MyProc->procLatch);
+      CHECK_FOR_INTERRUPTS ();
+    }
+}
+
+/*
+ * Main loop of a broker: pick up new scans, start their requests, and
+ * stream pages back as they arrive.  The driver sets our latch when a
+ * connection, prepared statement or page is ready; the queues set it when
+ * a backend sends or receives.
+ */
+void
+cassandra2_fdw_broker_main (Datum main_arg)
+{
+  BrokerChannel **channels = NULL;
+  int nchannels = 0;
+  int maxchannels = 0;
+
+  my_slot = DatumGetInt32 (main_arg);
+
+  /* Establish signal handlers; once that's done, unblock signals. */
+  pqsignal (SIGTERM, broker_sigterm);
+  BackgroundWorkerUnblockSignals ();
+
+  CurrentResourceOwner = ResourceOwnerCreate (NULL, "cassandra2_fdw broker");
+
+  /* The connection cache lives there; we never connect to a database. */
+  if (CacheMemoryContext == NULL)
+    CreateCacheMemoryContext ();
+
+  /* Take our slot, dropping scans posted to our predecessor. */
+  SpinLockAcquire (&broker_shared->mutex);
+  broker_shared->slots[my_slot].proc = MyProc;
+  broker_shared->slots[my_slot].generation++;
+  broker_shared->slots[my_slot].nscans = 0;
+  broker_shared->slots[my_slot].ninbox = 0;
+  SpinLockRelease (&broker_shared->mutex);
+  on_shmem_exit (broker_release_slot, 0);
+
+  while (!got_sigterm)
+    {
+      bool busy = false;
+      int rc;
+      int n;
+
+      ResetLatch (&MyProc->procLatch);
+
+      broker_claim_inbox (&channels, &nchannels, &maxchannels);
+
+      for (n = 0; n < nchannels; n++)
+        {
+          if (broker_serve_channel (channels[n]))
+            {
+              busy |= channels[n]->active;
+              continue;
+            }
+
+          /* The backend has gone; forget the scan. */
+          broker_close_channel (channels[n]);
+          channels[n--] = channels[--nchannels];
+
+          SpinLockAcquire (&broker_shared->mutex);
+          broker_shared->slots[my_slot].nscans--;
+          SpinLockRelease (&broker_shared->mutex);
+        }
+
+      /*
+       * Poll now and then while requests are in flight, in case the
+       * driver's callback came before the latch was reset.
+       */
+      rc = WaitLatch (&MyProc->procLatch,
+                      WL_LATCH_SET | WL_TIMEOUT | WL_POSTMASTER_DEATH,
+                      busy ? 100L : 1000L);
+      if (rc & WL_POSTMASTER_DEATH)
+        proc_exit (1);
+    }
+
+  proc_exit (0);
+}
+
+static void
+broker_sigterm (SIGNAL_ARGS)
+{
+  int save_errno = errno;
+
+  got_sigterm = true;
+  if (MyProc)
+    SetLatch (&MyProc->procLatch);
+
+  errno = save_errno;
+}
+
+static void
+broker_release_slot (int code, Datum arg)
+{
+  SpinLockAcquire (&broker_shared->mutex);
+  broker_shared->slots[my_slot].proc = NULL;
+  SpinLockRelease (&broker_shared->mutex);
+}
+
+/*
+ * Called by a driver thread when a connection has been made, a query
+ * prepared or a page has arrived.
+ */
+static void
+broker_future_callback (CassFuture *future, void *data)
+{
+  SetLatch (&((PGPROC *) data)->procLatch);
+}
+
+/*
+ * Attach to the segments of the scans posted to our inbox.
+ */
+static void
+broker_claim_inbox (BrokerChannel ***channels, int *nchannels,
+                    int *maxchannels)
+{
+  CassBrokerSlot *slot = &broker_shared->slots[my_slot];
+  dsm_handle handles[CASS_BROKER_INBOX_SIZE];
+  int nhandles;
+  int i;
+
+  SpinLockAcquire (&broker_shared->mutex);
+  nhandles = slot->ninbox;
+  memcpy (handles, slot->inbox, nhandles * sizeof (dsm_handle));
+  slot->ninbox = 0;
+  SpinLockRelease (&broker_shared->mutex);
+
+  for (i = 0; i < nhandles; i++)
+    {
+      MemoryContext oldcontext = MemoryContextSwitchTo (TopMemoryContext);
+      BrokerChannel *ch;
+      dsm_segment *seg;
+      shm_toc *toc;
+      shm_mq *mq;
+
+      /* The scan may have ended already. */
+      seg = dsm_attach (handles[i]);
+      toc = seg ? shm_toc_attach (CASS_BROKER_MAGIC,
+                                  dsm_segment_address (seg)) : NULL;
+      if (toc == NULL)
+        {
+          if (seg)
+            dsm_detach (seg);
+          SpinLockAcquire (&broker_shared->mutex);
+          slot->nscans--;
+          SpinLockRelease (&broker_shared->mutex);
+          MemoryContextSwitchTo (oldcontext);
+          continue;
+        }
+
+      ch = (BrokerChannel *) palloc0 (sizeof (BrokerChannel));
+      ch->seg = seg;
+
+      mq = (shm_mq *) shm_toc_lookup (toc, CASS_BROKER_KEY_REQUESTS);
+      shm_mq_set_receiver (mq, MyProc);
+      ch->requests = shm_mq_attach (mq, seg, NULL);
+
+      mq = (shm_mq *) shm_toc_lookup (toc, CASS_BROKER_KEY_ANSWERS);
+      shm_mq_set_sender (mq, MyProc);
+      ch->answers = shm_mq_attach (mq, seg, NULL);
+
+      ch->cxt = AllocSetContextCreate (TopMemoryContext,
+                                       "cassandra2_fdw broker request",
+                                       ALLOCSET_SMALL_MINSIZE,
+                                       ALLOCSET_SMALL_INITSIZE,
+                                       ALLOCSET_DEFAULT_MAXSIZE);
+      ch->row_cxt = AllocSetContextCreate (TopMemoryContext,
+                                           "cassandra2_fdw broker row",
+                                           ALLOCSET_SMALL_MINSIZE,
+                                           ALLOCSET_SMALL_INITSIZE,
+                                           ALLOCSET_SMALL_MAXSIZE);
+      initStringInfo (&ch->out);
+
+      if (*nchannels >= *maxchannels)
+        {
+          *maxchannels = Max (16, *maxchannels * 2);
+          if (*channels == NULL)
+            *channels = palloc (*maxchannels * sizeof (BrokerChannel *));
+          else
+            *channels = repalloc (*channels,
+                                  *maxchannels * sizeof (BrokerChannel *));
+        }
+      (*channels)[(*nchannels)++] = ch;
+
+      MemoryContextSwitchTo (oldcontext);
+    }
+}
+
+/*
+ * Make what progress we can on a scan without waiting: finish sending an
+ * answer, take new requests, carry them on as their connection and
+ * prepared statement become ready, and turn an arrived page into an
+ * answer.  Returns false once the backend has detached.
+ */
+static bool
+broker_serve_channel (BrokerChannel *ch)
+{
+  for (;;)
+    {
+      shm_mq_result res;
+      Size nbytes;
+      void *data;
+
+      /* A message started must be sent in full before anything else. */
+      if (ch->sending)
+        {
+          res = shm_mq_send (ch->answers, ch->out.len, ch->out.data, true);
+          if (res == SHM_MQ_DETACHED)
+            return false;
+          if (res == SHM_MQ_WOULD_BLOCK)
+            return true;
+          ch->sending = false;
+          if (ch->out_final)
+            broker_finish_request (ch);
+        }
+
+      /* A new request replaces the one being answered. */
+      res = shm_mq_receive (ch->requests, &nbytes, &data, true);
+      if (res == SHM_MQ_DETACHED)
+        return false;
+      if (res == SHM_MQ_SUCCESS)
+        {
+          broker_start_request (ch, (char *) data, nbytes);
+          continue;
+        }
+
+      /* Ask for the first page once connected and prepared. */
+      if (ch->active && ch->statement == NULL && !ch->sending &&
+          broker_start_fetch (ch))
+        continue;
+
+      /* Pass on the next page once it has arrived. */
+      if (ch->active && ch->future != NULL && cass_future_ready (ch->future))
+        {
+          broker_build_page (ch);
+          continue;
+        }
+
+      return true;
+    }
+}
+
+/*
+ * Start answering a request: take in its parameters, and let
+ * broker_start_fetch carry it on.  A failure is sent back as an error
+ * answer.
+ */
+static void
+broker_start_request (BrokerChannel *ch, char *data, Size nbytes)
+{
+  MemoryContext oldcontext;
+  StringInfoData msg;
+
+  broker_finish_request (ch);
+  MemoryContextReset (ch->cxt);
+  oldcontext = MemoryContextSwitchTo (ch->cxt);
+
+  msg.data = data;
+  msg.len = nbytes;
+  msg.maxlen = nbytes;
+  msg.cursor = 0;
+
+  ch->seq = pq_getmsgint (&msg, 4);
+  ch->active = true;
+
+  PG_TRY ();
+  {
+    ForeignServer *server = (ForeignServer *) palloc0 (sizeof (ForeignServer));
+    UserMapping *user = (UserMapping *) palloc0 (sizeof (UserMapping));
+    int i;
+
+    ch->dbid = pq_getmsgint (&msg, 4);
+    server->serverid = pq_getmsgint (&msg, 4);
+    user->userid = pq_getmsgint (&msg, 4);
+    user->serverid = server->serverid;
+    server->servername = get_text (&msg);
+    server->options = get_options (&msg);
+    user->options = get_options (&msg);
+    ch->server = server;
+    ch->user = user;
+    ch->query = get_text (&msg);
+    ch->fetch_size = pq_getmsgint (&msg, 4);
+
+    ch->ncolumns = pq_getmsgint (&msg, 4);
+    ch->types = (Oid *) palloc (ch->ncolumns * sizeof (Oid));
+    ch->typmods = (int32 *) palloc (ch->ncolumns * sizeof (int32));
+    ch->typlens = (int16 *) palloc (ch->ncolumns * sizeof (int16));
+    ch->typbyvals = (bool *) palloc (ch->ncolumns * sizeof (bool));
+    ch->decoders = (CassValueDecoder *)
+            palloc0 ((ch->ncolumns + 1) * sizeof (CassValueDecoder));
+    ch->decoders_valid = false;
+    for (i = 0; i < ch->ncolumns; i++)
+      {
+        ch->types[i] = pq_getmsgint (&msg, 4);
+        ch->typmods[i] = pq_getmsgint (&msg, 4);
+        ch->typlens[i] = pq_getmsgint (&msg, 2);
+        ch->typbyvals[i] = pq_getmsgbyte (&msg);
+      }
+
+    ch->nparams = pq_getmsgint (&msg, 4);
+    ch->params = (Datum *) palloc (ch->nparams * sizeof (Datum));
+    ch->paramtypes = (Oid *) palloc (ch->nparams * sizeof (Oid));
+    for (i = 0; i < ch->nparams; i++)
+      {
+        int16 typlen;
+        bool typbyval;
+
+        ch->paramtypes[i] = pq_getmsgint (&msg, 4);
+        typlen = pq_getmsgint (&msg, 2);
+        typbyval = pq_getmsgbyte (&msg);
+        ch->params[i] = get_datum (&msg, typlen, typbyval);
+      }
+  }
+  PG_CATCH ();
+  {
+    ErrorData *edata;
+
+    MemoryContextSwitchTo (ch->cxt);
+    edata = CopyErrorData ();
+    FlushErrorState ();
+    broker_send_error (ch, edata->message, -1);
+  }
+  PG_END_TRY ();
+
+  MemoryContextSwitchTo (oldcontext);
+}
+
+/*
+ * Carry the current request as far as we can without waiting: connect,
+ * prepare the query, and once both are done, bind the parameters and ask
+ * for the first page.  The driver calls broker_future_callback when the
+ * connection or prepared statement we wait for is ready, so that one slow
+ * server doesn't hold up the scans of the others.  A failure is sent back
+ * as an error answer.  Returns true if the request moved on.
+ */
+static bool
+broker_start_fetch (BrokerChannel *ch)
+{
+  volatile bool progress = false;
+  MemoryContext oldcontext = MemoryContextSwitchTo (ch->cxt);
+
+  PG_TRY ();
+  {
+    const CassPrepared *prepared = NULL;
+    int i;
+
+    if (ch->session == NULL)
+      ch->session = pgcass_GetConnectionNoWait (ch->dbid, ch->server,
+                                                ch->user,
+                                                broker_future_callback,
+                                                MyProc);
+
+    if (ch->session == NULL)
+      ; /* still connecting */
+    else if (ch->prepare_future == NULL)
+      {
+        prepared = pgcass_FindPrepared (ch->session, ch->query);
+        if (prepared == NULL)
+          {
+            ch->prepare_future = cass_session_prepare (ch->session, ch->query);
+            cass_future_set_callback (ch->prepare_future,
+                                      broker_future_callback, MyProc);
+          }
+      }
+    else if (cass_future_ready (ch->prepare_future))
+      {
+        CassFuture *future = ch->prepare_future;
+
+        /* pgcass_AddPrepared frees it, whatever happens. */
+        ch->prepare_future = NULL;
+        prepared = pgcass_AddPrepared (ch->session, ch->query, future);
+      }
+
+    if (prepared != NULL)
+      {
+        ch->statement = cass_prepared_bind (prepared);
+        for (i = 0; i < ch->nparams; i++)
+          pgcass_bind_param (ch->statement, prepared, i, ch->params[i],
+                             ch->paramtypes[i]);
+
+        cass_statement_set_paging_size (ch->statement, ch->fetch_size);
+        ch->future = cass_session_execute (ch->session, ch->statement);
+        cass_future_set_callback (ch->future, broker_future_callback, MyProc);
+        progress = true;
+      }
+  }
+  PG_CATCH ();
+  {
+    ErrorData *edata;
+
+    MemoryContextSwitchTo (ch->cxt);
+    edata = CopyErrorData ();
+    FlushErrorState ();
+    broker_send_error (ch, edata->message, -1);
+    progress = true;
+  }
+  PG_END_TRY ();
+
+  MemoryContextSwitchTo (oldcontext);
+  return progress;
+}
+
+/*
+ * Drop what is left of the current request.
+ */
+static void
+broker_finish_request (BrokerChannel *ch)
+{
+  if (ch->prepare_future)
+    cass_future_free (ch->prepare_future);
+  ch->prepare_future = NULL;
+  ch->session = NULL;
+  if (ch->future)
+    cass_future_free (ch->future);
+  ch->future = NULL;
+  if (ch->statement)
+    cass_statement_free (ch->statement);
+  ch->statement = NULL;
+  ch->active = false;
+}
+
+/*
+ * Turn the page that has arrived into an answer, after asking for the
+ * following one, so that fetching it overlaps with the backend reading
+ * this one.
+ */
+static void
+broker_build_page (BrokerChannel *ch)
+{
+  CassFuture *future = ch->future;
+  const CassResult *res;
+  CassIterator *volatile rows = NULL;
+  bool more;
+  int nrows_pos;
+  int nrows = 0;
+  int j;
+
+  ch->future = NULL;
+
+  if (cass_future_error_code (future) != CASS_OK)
+    {
+      const char *message;
+      size_t message_length;
+      CassError rc = cass_future_error_code (future);
+
+      /*
+       * The table may have changed since the statement was prepared;
+       * prepare it again next time.
+       */
+      if (rc == CASS_ERROR_SERVER_UNPREPARED ||
+          rc == CASS_ERROR_SERVER_INVALID_QUERY)
+        pgcass_ForgetPrepared (ch->session, ch->query);
+
+      cass_future_error_message (future, &message, &message_length);
+      broker_send_error (ch, message, (int) message_length);
+      cass_future_free (future);
+      return;
+    }
+
+  res = cass_future_get_result (future);
+  cass_future_free (future);
+
+  if (ch->ncolumns > 0 && cass_result_row_count (res) > 0 &&
+      cass_result_column_count (res) != ch->ncolumns)
+    {
+      broker_send_error (ch, "remote query result does not match the foreign table", -1);
+      cass_result_free (res);
+      return;
+    }
+
+  more = cass_result_has_more_pages (res);
+  if (more)
+    {
+      cass_statement_set_paging_state (ch->statement, res);
+      ch->future = cass_session_execute (ch->session, ch->statement);
+      cass_future_set_callback (ch->future, broker_future_callback, MyProc);
+    }
+
+  if (!ch->decoders_valid)
+    {
+      for (j = 0; j < ch->ncolumns && j < cass_result_column_count (res); j++)
+        {
+          if (OidIsValid (ch->types[j]))
+            ch->decoders[j] = pgcass_get_decoder (cass_result_column_type (res, j),
+                                                  ch->types[j],
+                                                  ch->typmods[j]);
+        }
+      ch->decoders_valid = true;
+    }
+
+  resetStringInfo (&ch->out);
+  pq_sendint (&ch->out, ch->seq, 4);
+  pq_sendbyte (&ch->out, more ? CASS_BROKER_PAGE : CASS_BROKER_LAST_PAGE);
+  nrows_pos = ch->out.len;
+  pq_sendint (&ch->out, 0, 4);
+
+  /* A value the decoders reject fails the request, not the broker. */
+  PG_TRY ();
+  {
+    rows = cass_iterator_from_result (res);
+    while (cass_iterator_next (rows))
+      {
+        const CassRow *row = cass_iterator_get_row (rows);
+        MemoryContext oldcontext;
+
+        MemoryContextReset (ch->row_cxt);
+        oldcontext = MemoryContextSwitchTo (ch->row_cxt);
+
+        for (j = 0; j < ch->ncolumns; j++)
+          {
+            const CassValue *value = cass_row_get_column (row, j);
+
+            if (value == NULL || cass_value_is_null (value))
+              pq_sendbyte (&ch->out, CASS_BROKER_NULL);
+            else if (ch->decoders[j] != NULL)
+              {
+                pq_sendbyte (&ch->out, CASS_BROKER_DATUM);
+                send_datum (&ch->out, ch->decoders[j](value),
+                            ch->typlens[j], ch->typbyvals[j]);
+              }
+            else
+              {
+                char buf[265];
+
+                pq_sendbyte (&ch->out, CASS_BROKER_TEXT);
+                send_text (&ch->out, pgcass_transferValue (buf, value), -1);
+              }
+          }
+
+        MemoryContextSwitchTo (oldcontext);
+        nrows++;
+      }
+  }
+  PG_CATCH ();
+  {
+    ErrorData *edata;
+
+    MemoryContextSwitchTo (ch->cxt);
+    edata = CopyErrorData ();
+    FlushErrorState ();
+
+    cass_iterator_free (rows);
+    cass_result_free (res);
+    broker_send_error (ch, edata->message, -1);
+    return;
+  }
+  PG_END_TRY ();
+
+  cass_iterator_free (rows);
+  cass_result_free (res);
+
+  /* Fill in the row count. */
+  nrows = htonl (nrows);
+  memcpy (ch->out.data + nrows_pos, &nrows, 4);
+
+  ch->sending = true;
+  ch->out_final = !more;
+}
+
+/*
+ * Answer the current request with an error, ending it.  A negative len
+ * means the message is null-terminated.
+ */
+static void
+broker_send_error (BrokerChannel *ch, const char *message, int len)
+{
+  resetStringInfo (&ch->out);
+  pq_sendint (&ch->out, ch->seq, 4);
+  pq_sendbyte (&ch->out, CASS_BROKER_ERROR);
+  send_text (&ch->out, message, len);
+  ch->sending = true;
+  ch->out_final = true;
+}
+
+/*
+ * Release a scan whose backend has detached.
+ */
+static void
+broker_close_channel (BrokerChannel *ch)
+{
+  broker_finish_request (ch);
+  dsm_detach (ch->seg);
+  MemoryContextDelete (ch->cxt);
+  MemoryContextDelete (ch->row_cxt);
+  pfree (ch->out.data);
+  pfree (ch);
+}
+
+/*
+ * Message encoding.  Strings are sent as counted bytes, without the
+ * encoding conversion pq_sendstring would apply: brokers aren't connected
+ * to a database, and the text goes to Cassandra as it is.  A negative len
+ * means the string is null-terminated.
+ */
+static void
+send_text (StringInfo buf, const char *str, int len)
+{
+  if (len < 0)
+    len = strlen (str);
+  pq_sendint (buf, len, 4);
+  pq_sendbytes (buf, str, len);
+}
+
+static char *
+get_text (StringInfo buf)
+{
+  int len = pq_getmsgint (buf, 4);
+  char *str = palloc (len + 1);
+
+  pq_copymsgbytes (buf, str, len);
+  str[len] = '\0';
+  return str;
+}
+
+/*
+ * Values are sent in their in-memory form: a by-value Datum as it is, and
+ * the bytes of anything else, detoasted.
+ */
+static void
+send_datum (StringInfo buf, Datum value, int16 typlen, bool typbyval)
+{
+  Size size;
+
+  if (typbyval)
+    {
+      pq_sendint64 (buf, (int64) value);
+      return;
+    }
+
+  if (typlen == -1)
+    value = PointerGetDatum (PG_DETOAST_DATUM (value));
+  size = datumGetSize (value, false, typlen);
+  pq_sendint (buf, size, 4);
+  pq_sendbytes (buf, DatumGetPointer (value), size);
+}
+
+static Datum
+get_datum (StringInfo buf, int16 typlen, bool typbyval)
+{
+  Size size;
+  char *data;
+
+  if (typbyval)
+    return (Datum) pq_getmsgint64 (buf);
+
+  size = pq_getmsgint (buf, 4);
+  data = palloc (size);
+  pq_copymsgbytes (buf, data, size);
+  return PointerGetDatum (data);
+}
+
+static void
+send_options (StringInfo buf, List *options)
+{
+  ListCell *lc;
+
+  pq_sendint (buf, list_length (options), 4);
+  foreach (lc, options)
+  {
+    DefElem *def = (DefElem *) lfirst (lc);
+
+    send_text (buf, def->defname, -1);
+    send_text (buf, defGetString (def), -1);
+  }
+}
+
+static List *
+get_options (StringInfo buf)
+{
+  List *options = NIL;
+  int n = pq_getmsgint (buf, 4);
+
+  while (n-- > 0)
+    {
+      char *name = get_text (buf);
+      char *value = get_text (buf);
+
+      options = lappend (options, makeDefElem (name, (Node *) makeString (value)));
+    }
+
+  return options;
+}
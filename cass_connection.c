@@ -12,28 +12,58 @@
  */
 #include "postgres.h"
 
+#include <limits.h>
+
 #include "cassandra2_fdw.h"
 
+#include "access/hash.h"
 #include "access/xact.h"
+#include "commands/defrem.h"
 #include "mb/pg_wchar.h"
 #include "miscadmin.h"
 #include "utils/hsearch.h"
 #include "utils/memutils.h"
 
+/* Number of prepared statements kept per connection */
+#define PREPARED_CACHE_SIZE 64
+
 typedef struct ConnCacheKey
 {
+  Oid dbid; /* OID of the database the server is defined in */
   Oid serverid; /* OID of foreign server */
   Oid userid; /* OID of local user whose mapping we use */
 } ConnCacheKey;
 
+/*
+ * A statement prepared on a connection, by CQL text.
+ */
+typedef struct PreparedCacheEntry
+{
+  char *query; /* CQL text (in CacheMemoryContext), or NULL if unused */
+  uint32 hash; /* hash of query */
+  const CassPrepared *prepared;
+  uint64 last_used; /* for evicting the least recently used entry */
+} PreparedCacheEntry;
+
+/*
+ * Each entry has a cluster object of its own, configured from the server
+ * and user mapping options, and a session connected through it.  The
+ * driver gives every cluster its own I/O threads and connection pools, so
+ * sessions to different servers don't share settings or queues.
+ */
 typedef struct ConnCacheEntry
 {
   ConnCacheKey key; /* hash key (must be first) */
+  CassCluster *cluster; /* configuration conn was connected with, or NULL */
   CassSession *conn; /* connection to foreign server, or NULL */
+  CassSession *connecting; /* session still being connected, or NULL */
+  CassFuture *connect_future; /* its connect request */
   int xact_depth; /* 0 = no xact open, 1 = main xact open, 2 =
 								 * one level of subxact open, etc */
   bool have_prep_stmt; /* have we prepared any stmts in this xact? */
   bool have_error; /* have any subxacts aborted in this xact? */
+  PreparedCacheEntry *prepared; /* array of PREPARED_CACHE_SIZE, or NULL */
+  uint64 prepared_clock; /* bumped on every use of a prepared statement */
 } ConnCacheEntry;
 
 /*
@@ -45,19 +75,106 @@ static HTAB *ConnectionHash = NULL;
 static bool xact_got_connection = false;
 
 /* prototypes of private functions */
-static CassSession *connect_cass_server (ForeignServer *server, UserMapping *user);
-
-
-static CassCluster* cluster;
+static ConnCacheEntry *get_conn_entry (Oid dbid, ForeignServer *server,
+                                       UserMapping *user);
+static void start_connect (ConnCacheEntry *entry, ForeignServer *server,
+                           UserMapping *user);
+static void finish_connect (ConnCacheEntry *entry, ForeignServer *server);
+static ConnCacheEntry *find_conn_entry (CassSession *session);
+static PreparedCacheEntry *find_prepared (ConnCacheEntry *entry,
+                                          const char *query, uint32 hash,
+                                          PreparedCacheEntry **victim);
+static void set_cluster_options (CassCluster *cluster, ForeignServer *server);
+static void set_water_marks (CassCluster *cluster, ForeignServer *server,
+                             unsigned high, unsigned low,
+                             CassError (*set_high) (CassCluster *, unsigned),
+                             CassError (*set_low) (CassCluster *, unsigned),
+                             const char *high_name, const char *low_name);
+static void check_cluster_option (CassError rc, const char *name,
+                                  ForeignServer *server);
+static void pgcass_close (int code, Datum arg);
 
 /*
  * Cass Connection Initialization function
  */
-static void pgcass_close (int code, Datum arg);
-
 CassSession *
 pgcass_GetConnection (ForeignServer *server, UserMapping *user,
                       bool will_prep_stmt)
+{
+  return pgcass_GetConnectionInDatabase (MyDatabaseId, server, user);
+}
+
+/*
+ * Get a connection for a server and user mapping of the given database.
+ * A broker worker serves backends of every database, whose servers' OIDs
+ * may coincide; it passes the database of the backend it runs a query for.
+ */
+CassSession *
+pgcass_GetConnectionInDatabase (Oid dbid, ForeignServer *server,
+                                UserMapping *user)
+{
+  ConnCacheEntry *entry = get_conn_entry (dbid, server, user);
+
+  /*
+   * We don't check the health of cached connection here, because it would
+   * require some overhead.  Broken connection will be detected when the
+   * connection is actually used.
+   */
+
+  /*
+   * If cache entry doesn't have a connection, we have to establish a new
+   * connection.  (If finish_connect throws an error, the cache entry will
+   * be left in a valid empty state.)
+   */
+  if (entry->conn == NULL)
+    {
+      if (entry->connect_future == NULL)
+        start_connect (entry, server, user);
+      finish_connect (entry, server);
+    }
+
+  /*
+   * do nothing for connection pre-cmd execute till now.
+   */
+
+  return entry->conn;
+}
+
+/*
+ * Like pgcass_GetConnectionInDatabase, but without waiting for a new
+ * connection to be made: that returns NULL, and callback is called with
+ * data once the connection is up or has failed.  Calling again then
+ * returns the connection, or raises the error.  The callback is the one
+ * given by the call that started connecting; later calls' are ignored.
+ */
+CassSession *
+pgcass_GetConnectionNoWait (Oid dbid, ForeignServer *server,
+                            UserMapping *user, CassFutureCallback callback,
+                            void *data)
+{
+  ConnCacheEntry *entry = get_conn_entry (dbid, server, user);
+
+  if (entry->conn != NULL)
+    return entry->conn;
+
+  if (entry->connect_future == NULL)
+    {
+      start_connect (entry, server, user);
+      cass_future_set_callback (entry->connect_future, callback, data);
+    }
+
+  if (!cass_future_ready (entry->connect_future))
+    return NULL;
+
+  finish_connect (entry, server);
+  return entry->conn;
+}
+
+/*
+ * Find or create the connection cache entry of a server and user mapping.
+ */
+static ConnCacheEntry *
+get_conn_entry (Oid dbid, ForeignServer *server, UserMapping *user)
 {
   bool found;
   ConnCacheEntry *entry;
@@ -78,6 +195,9 @@ pgcass_GetConnection (ForeignServer *server, UserMapping *user,
                                     &ctl,
                                     HASH_ELEM | HASH_FUNCTION | HASH_CONTEXT);
 
+      /* Close the sessions and free their clusters at backend exit. */
+      on_proc_exit (pgcass_close, 0);
+
       /*
        * Register some callback functions that manage connection cleanup.
        * This should be done just once in each backend.
@@ -90,6 +210,7 @@ pgcass_GetConnection (ForeignServer *server, UserMapping *user,
   xact_got_connection = true;
 
   /* Create hash key for the entry.  Assume no pad bytes in key struct */
+  key.dbid = dbid;
   key.serverid = server->serverid;
   key.userid = user->userid;
 
@@ -100,41 +221,18 @@ pgcass_GetConnection (ForeignServer *server, UserMapping *user,
   if (!found)
     {
       /* initialize new hashtable entry (key is already filled in) */
+      entry->cluster = NULL;
       entry->conn = NULL;
+      entry->connecting = NULL;
+      entry->connect_future = NULL;
       entry->xact_depth = 0;
       entry->have_prep_stmt = false;
       entry->have_error = false;
+      entry->prepared = NULL;
+      entry->prepared_clock = 0;
     }
 
-  /*
-   * We don't check the health of cached connection here, because it would
-   * require some overhead.  Broken connection will be detected when the
-   * connection is actually used.
-   */
-
-  /*
-   * If cache entry doesn't have a connection, we have to establish a new
-   * connection.  (If connect_pg_server throws an error, the cache entry
-   * will be left in a valid empty state.)
-   */
-  if (entry->conn == NULL)
-    {
-      entry->xact_depth = 0; /* just to be sure */
-      entry->have_prep_stmt = false;
-      entry->have_error = false;
-      entry->conn = connect_cass_server (server, user);
-      elog (DEBUG3, "new cassandra2_fdw connection %p for server \"%s\"",
-            entry->conn, server->servername);
-    }
-
-  /*
-   * do nothing for connection pre-cmd execute till now.
-   */
-
-  /* Remember if caller will prepare statements */
-  entry->have_prep_stmt |= will_prep_stmt;
-
-  return entry->conn;
+  return entry;
 }
 
 /*
@@ -159,29 +257,211 @@ pgcass_ReleaseConnection (CassSession *session)
 }
 
 /*
- * Connect to remote server using specified server and user mapping properties.
+ * Return the statement prepared from query on a connection, preparing it
+ * first if it isn't among the connection's most recently used ones.  This
+ * saves Cassandra parsing the query on every execution, and gives the
+ * driver what it needs to route requests to the nodes owning the data.
+ *
+ * The result is only good until the next call; statements bound from it
+ * remain valid, though.
  */
-static CassSession *
-connect_cass_server (ForeignServer *server, UserMapping *user)
+const CassPrepared *
+pgcass_GetPrepared (CassSession *session, const char *query)
 {
-  ListCell *lc;
-  List *list;
-  DefElem *def;
-  char *dbserver = NULL, *dbuser = NULL, *password = NULL;
-  CassFuture* conn_future = NULL;
-  CassSession* session = NULL;
+  const CassPrepared *prepared = pgcass_FindPrepared (session, query);
+
+  if (prepared != NULL)
+    return prepared;
+
+  return pgcass_AddPrepared (session, query,
+                             cass_session_prepare (session, query));
+}
+
+/*
+ * Return the statement prepared from query on a connection if it is
+ * cached, or NULL.  Like pgcass_GetPrepared's, the result is only good
+ * until the next call.
+ */
+const CassPrepared *
+pgcass_FindPrepared (CassSession *session, const char *query)
+{
+  ConnCacheEntry *entry = find_conn_entry (session);
+  PreparedCacheEntry *pentry;
+  PreparedCacheEntry *victim;
+
+  pentry = find_prepared (entry, query,
+                          DatumGetUInt32 (hash_any ((const unsigned char *) query,
+                                                    strlen (query))),
+                          &victim);
+  if (pentry == NULL)
+    return NULL;
+
+  pentry->last_used = ++entry->prepared_clock;
+  return pentry->prepared;
+}
+
+/*
+ * Cache the statement prepare_future prepares from query on a connection,
+ * waiting for it if need be, and return it as pgcass_GetPrepared does.
+ * The future is freed, whether preparing succeeded or not.
+ */
+const CassPrepared *
+pgcass_AddPrepared (CassSession *session, const char *query,
+                    CassFuture *prepare_future)
+{
+  ConnCacheEntry *entry = find_conn_entry (session);
+  PreparedCacheEntry *slot;
+  PreparedCacheEntry *pentry;
+  uint32 hash;
 
-  if (!cluster)
+  if (cass_future_error_code (prepare_future) != CASS_OK)
     {
-      cluster = cass_cluster_new ();
-      on_proc_exit (pgcass_close, 0);
+      const char *message;
+      size_t message_length;
+      char *detail;
+
+      cass_future_error_message (prepare_future, &message, &message_length);
+      detail = pnstrdup (message, message_length);
+      cass_future_free (prepare_future);
+
+      ereport (ERROR,
+               (errcode (ERRCODE_FDW_UNABLE_TO_CREATE_EXECUTION),
+                errmsg ("could not prepare query: %s", query),
+                errdetail_internal ("%s", detail)));
     }
 
-  session = cass_session_new ();
+  /*
+   * Another caller may have prepared the same query meanwhile; keep the
+   * statement cached already.
+   */
+  hash = DatumGetUInt32 (hash_any ((const unsigned char *) query,
+                                   strlen (query)));
+  pentry = find_prepared (entry, query, hash, &slot);
+  if (pentry != NULL)
+    {
+      cass_future_free (prepare_future);
+      pentry->last_used = ++entry->prepared_clock;
+      return pentry->prepared;
+    }
+
+  /* Evict the entry's previous statement, if any. */
+  if (slot->query != NULL)
+    {
+      cass_prepared_free (slot->prepared);
+      pfree (slot->query);
+    }
+
+  slot->prepared = cass_future_get_prepared (prepare_future);
+  cass_future_free (prepare_future);
+  slot->query = MemoryContextStrdup (CacheMemoryContext, query);
+  slot->hash = hash;
+  slot->last_used = ++entry->prepared_clock;
+
+  return slot->prepared;
+}
+
+/*
+ * Look query up among the statements prepared on a connection.  If it
+ * isn't there, *victim is set to a free or the least recently used entry.
+ */
+static PreparedCacheEntry *
+find_prepared (ConnCacheEntry *entry, const char *query, uint32 hash,
+               PreparedCacheEntry **victim)
+{
+  int i;
+
+  if (entry->prepared == NULL)
+    entry->prepared = MemoryContextAllocZero (CacheMemoryContext,
+                                              sizeof (PreparedCacheEntry) *
+                                              PREPARED_CACHE_SIZE);
+
+  *victim = NULL;
+  for (i = 0; i < PREPARED_CACHE_SIZE; i++)
+    {
+      PreparedCacheEntry *pentry = &entry->prepared[i];
+
+      if (pentry->query != NULL && pentry->hash == hash &&
+          strcmp (pentry->query, query) == 0)
+        return pentry;
+
+      if (*victim == NULL ||
+          ((*victim)->query != NULL &&
+           (pentry->query == NULL || pentry->last_used < (*victim)->last_used)))
+        *victim = pentry;
+    }
+
+  return NULL;
+}
+
+/*
+ * Drop the statement prepared from query on a connection, if any, so that
+ * it is prepared afresh the next time.  Used when executing it failed in a
+ * way that may be due to a schema change since it was prepared.
+ */
+void
+pgcass_ForgetPrepared (CassSession *session, const char *query)
+{
+  ConnCacheEntry *entry = find_conn_entry (session);
+  int i;
+
+  if (entry->prepared == NULL)
+    return;
+
+  for (i = 0; i < PREPARED_CACHE_SIZE; i++)
+    {
+      PreparedCacheEntry *pentry = &entry->prepared[i];
+
+      if (pentry->query != NULL && strcmp (pentry->query, query) == 0)
+        {
+          cass_prepared_free (pentry->prepared);
+          pfree (pentry->query);
+          pentry->query = NULL;
+          pentry->prepared = NULL;
+        }
+    }
+}
+
+/*
+ * Find the connection cache entry of a session.
+ */
+static ConnCacheEntry *
+find_conn_entry (CassSession *session)
+{
+  HASH_SEQ_STATUS scan;
+  ConnCacheEntry *entry;
+
+  hash_seq_init (&scan, ConnectionHash);
+  while ((entry = (ConnCacheEntry *) hash_seq_search (&scan)))
+    {
+      if (entry->conn == session)
+        {
+          hash_seq_term (&scan);
+          return entry;
+        }
+    }
+
+  elog (ERROR, "cassandra2_fdw connection %p not found", session);
+  return NULL; /* keep compiler quiet */
+}
+
+/*
+ * Start connecting to remote server using specified server and user
+ * mapping properties, through a cluster object of the entry's own, without
+ * waiting.  finish_connect completes it.
+ */
+static void
+start_connect (ConnCacheEntry *entry, ForeignServer *server,
+               UserMapping *user)
+{
+  ListCell *lc;
+  List *list;
+  DefElem *def;
+  char *dbserver = NULL, *dbuser = NULL, *password = NULL;
+  CassCluster* cluster = NULL;
 
   /* TODO Add contact points */
-  list = server->options;
-  list = list_concat (list, user->options);
+  list = list_concat (list_copy (server->options),
+                      list_copy (user->options));
 
   foreach (lc, list)
   {
@@ -209,16 +489,37 @@ connect_cass_server (ForeignServer *server, UserMapping *user)
       password = "cassandra";
     }
 
-  ereport (WARNING,
-           (errcode (ERRCODE_WARNING),
-            errmsg ("Server: %s, user: %s, password: %s", dbserver, dbuser, password)));
-
-
-  cass_cluster_set_contact_points (cluster, dbserver);
+  cluster = cass_cluster_new ();
   cass_cluster_set_credentials (cluster, dbuser, password);
+  PG_TRY ();
+  {
+    check_cluster_option (cass_cluster_set_contact_points (cluster, dbserver),
+                          "url", server);
+    set_cluster_options (cluster, server);
+  }
+  PG_CATCH ();
+  {
+    cass_cluster_free (cluster);
+    PG_RE_THROW ();
+  }
+  PG_END_TRY ();
 
   /* Provide the cluster object as configuration to connect the session */
-  conn_future = cass_session_connect (session, cluster);
+  entry->cluster = cluster;
+  entry->connecting = cass_session_new ();
+  entry->connect_future = cass_session_connect (entry->connecting, cluster);
+}
+
+/*
+ * Wait for the connection start_connect began.  On success, it becomes the
+ * entry's connection; on failure, the entry is left without a connection
+ * or cluster, and the error is raised.
+ */
+static void
+finish_connect (ConnCacheEntry *entry, ForeignServer *server)
+{
+  CassFuture *conn_future = entry->connect_future;
+
   if (cass_future_error_code (conn_future) != CASS_OK)
     {
       /* Handle error */
@@ -230,6 +531,11 @@ connect_cass_server (ForeignServer *server, UserMapping *user)
 
       snprintf (buf, 255, "%.*s", (int) message_length, message);
       cass_future_free (conn_future);
+      cass_session_free (entry->connecting);
+      cass_cluster_free (entry->cluster);
+      entry->connect_future = NULL;
+      entry->connecting = NULL;
+      entry->cluster = NULL;
 
       ereport (ERROR,
                (errcode (ERRCODE_SQLCLIENT_UNABLE_TO_ESTABLISH_SQLCONNECTION),
@@ -237,17 +543,240 @@ connect_cass_server (ForeignServer *server, UserMapping *user)
                         server->servername),
                 errdetail_internal ("%s", buf)));
     }
+  cass_future_free (conn_future);
+
+  entry->conn = entry->connecting;
+  entry->connecting = NULL;
+  entry->connect_future = NULL;
+  entry->xact_depth = 0;
+  entry->have_prep_stmt = false;
+  entry->have_error = false;
+  elog (DEBUG3, "new cassandra2_fdw connection %p for server \"%s\"",
+        entry->conn, server->servername);
+}
+
+/*
+ * Apply the server's port, driver tuning and load balancing options to a
+ * cluster.  Values have been checked by the validator; the driver rejects
+ * some combinations, such as a low water mark above the high one, which
+ * are reported with the name of the option.
+ *
+ * Token-aware routing, on by default, sends each request to a replica of
+ * the partition it reads.  It needs no routing keys set on statements, as
+ * all of ours are prepared, and the driver takes the partition key
+ * columns from the metadata it gets back from preparing them.  With
+ * local_dc, replicas in that data center are tried first.
+ */
+static void
+set_cluster_options (CassCluster *cluster, ForeignServer *server)
+{
+  unsigned write_high = 0, write_low = 0;
+  unsigned pending_high = 0, pending_low = 0;
+  char *local_dc = NULL;
+  unsigned remote_hosts = 0;
+  bool allow_remote_local_cl = false;
+  bool latency_aware = false;
+  double exclusion_threshold = 2.0;
+  cass_uint64_t scale_ms = 100;
+  cass_uint64_t retry_period_ms = 10000;
+  cass_uint64_t update_rate_ms = 100;
+  cass_uint64_t min_measured = 50;
+  ListCell *lc;
+
+  foreach (lc, server->options)
+  {
+    DefElem *def = (DefElem *) lfirst (lc);
+    const char *name = def->defname;
+    CassError rc = CASS_OK;
+    unsigned value;
+
+    if (strcmp (name, "tcp_nodelay") == 0)
+      {
+        cass_cluster_set_tcp_nodelay (cluster,
+                                      defGetBoolean (def) ? cass_true : cass_false);
+        continue;
+      }
+    else if (strcmp (name, "token_aware_routing") == 0)
+      {
+        cass_cluster_set_token_aware_routing (cluster,
+                                              defGetBoolean (def) ? cass_true : cass_false);
+        continue;
+      }
+    else if (strcmp (name, "allow_remote_dcs_for_local_cl") == 0)
+      {
+        allow_remote_local_cl = defGetBoolean (def);
+        continue;
+      }
+    else if (strcmp (name, "latency_aware_routing") == 0)
+      {
+        latency_aware = defGetBoolean (def);
+        continue;
+      }
+    else if (strcmp (name, "local_dc") == 0)
+      {
+        local_dc = defGetString (def);
+        continue;
+      }
+    else if (strcmp (name, "latency_exclusion_threshold") == 0)
+      {
+        exclusion_threshold = strtod (defGetString (def), NULL);
+        continue;
+      }
+
+    if (strcmp (name, "url") == 0 || strcmp (name, "fetch_size") == 0 ||
+        strcmp (name, "use_remote_estimate") == 0)
+      continue;
+
+    value = (unsigned) atoi (defGetString (def));
+
+    if (strcmp (name, "portNumber") == 0)
+      rc = cass_cluster_set_port (cluster, (int) value);
+    else if (strcmp (name, "querytimeout") == 0 ||
+             strcmp (name, "request_timeout") == 0)
+      cass_cluster_set_request_timeout (cluster, value);
+    else if (strcmp (name, "connect_timeout") == 0)
+      cass_cluster_set_connect_timeout (cluster, value);
+    else if (strcmp (name, "num_threads_io") == 0)
+      rc = cass_cluster_set_num_threads_io (cluster, value);
+    else if (strcmp (name, "core_connections_per_host") == 0)
+      rc = cass_cluster_set_core_connections_per_host (cluster, value);
+    else if (strcmp (name, "max_connections_per_host") == 0)
+      rc = cass_cluster_set_max_connections_per_host (cluster, value);
+    else if (strcmp (name, "queue_size_io") == 0)
+      rc = cass_cluster_set_queue_size_io (cluster, value);
+    else if (strcmp (name, "max_requests_per_flush") == 0)
+      rc = cass_cluster_set_max_requests_per_flush (cluster, value);
+    else if (strcmp (name, "pending_requests_high_water_mark") == 0)
+      pending_high = value;
+    else if (strcmp (name, "pending_requests_low_water_mark") == 0)
+      pending_low = value;
+    else if (strcmp (name, "write_bytes_high_water_mark") == 0)
+      write_high = value;
+    else if (strcmp (name, "write_bytes_low_water_mark") == 0)
+      write_low = value;
+    else if (strcmp (name, "tcp_keepalive") == 0)
+      cass_cluster_set_tcp_keepalive (cluster,
+                                      value > 0 ? cass_true : cass_false,
+                                      value);
+    else if (strcmp (name, "used_hosts_per_remote_dc") == 0)
+      remote_hosts = value;
+    else if (strcmp (name, "latency_scale_ms") == 0)
+      scale_ms = value;
+    else if (strcmp (name, "latency_retry_period_ms") == 0)
+      retry_period_ms = value;
+    else if (strcmp (name, "latency_update_rate_ms") == 0)
+      update_rate_ms = value;
+    else if (strcmp (name, "latency_min_measured") == 0)
+      min_measured = value;
+
+    check_cluster_option (rc, name, server);
+  }
+
+  set_water_marks (cluster, server, pending_high, pending_low,
+                   cass_cluster_set_pending_requests_high_water_mark,
+                   cass_cluster_set_pending_requests_low_water_mark,
+                   "pending_requests_high_water_mark",
+                   "pending_requests_low_water_mark");
+  set_water_marks (cluster, server, write_high, write_low,
+                   cass_cluster_set_write_bytes_high_water_mark,
+                   cass_cluster_set_write_bytes_low_water_mark,
+                   "write_bytes_high_water_mark",
+                   "write_bytes_low_water_mark");
+
+  if (local_dc)
+    check_cluster_option (cass_cluster_set_load_balance_dc_aware (cluster,
+                                                                  local_dc,
+                                                                  remote_hosts,
+                                                                  allow_remote_local_cl ? cass_true : cass_false),
+                          "local_dc", server);
+
+  if (latency_aware)
+    {
+      cass_cluster_set_latency_aware_routing (cluster, cass_true);
+      cass_cluster_set_latency_aware_routing_settings (cluster,
+                                                       exclusion_threshold,
+                                                       scale_ms,
+                                                       retry_period_ms,
+                                                       update_rate_ms,
+                                                       min_measured);
+    }
+}
+
+/*
+ * Set a pair of high and low water marks, either of which may be 0 for the
+ * driver's default.  Each is checked against the other one in effect when
+ * it is set.  When both are given, the high mark is raised out of the way
+ * first, so that the new low one is only checked against the new high one.
+ */
+static void
+set_water_marks (CassCluster *cluster, ForeignServer *server,
+                 unsigned high, unsigned low,
+                 CassError (*set_high) (CassCluster *, unsigned),
+                 CassError (*set_low) (CassCluster *, unsigned),
+                 const char *high_name, const char *low_name)
+{
+  if (high && low)
+    {
+      if (low > high)
+        ereport (ERROR,
+                 (errcode (ERRCODE_INVALID_PARAMETER_VALUE),
+                  errmsg ("option \"%s\" of server \"%s\" exceeds option \"%s\"",
+                          low_name, server->servername, high_name)));
+      check_cluster_option (set_high (cluster, UINT_MAX), high_name, server);
+    }
+  if (low)
+    check_cluster_option (set_low (cluster, low), low_name, server);
+  if (high)
+    check_cluster_option (set_high (cluster, high), high_name, server);
+}
 
-  return session;
+/*
+ * Report a server option the driver refused to apply.
+ */
+static void
+check_cluster_option (CassError rc, const char *name, ForeignServer *server)
+{
+  if (rc != CASS_OK)
+    ereport (ERROR,
+             (errcode (ERRCODE_INVALID_PARAMETER_VALUE),
+              errmsg ("invalid value for option \"%s\" of server \"%s\"",
+                      name, server->servername),
+              errdetail_internal ("%s", cass_error_desc (rc))));
 }
 
 /*
  * pgcass_close
- * Shuts down the Connection.
+ * Shuts down the connections, and frees the clusters they were made with.
  */
 static void
 pgcass_close (int code, Datum arg)
 {
-  cass_cluster_free (cluster);
-}
+  HASH_SEQ_STATUS scan;
+  ConnCacheEntry *entry;
 
+  hash_seq_init (&scan, ConnectionHash);
+  while ((entry = (ConnCacheEntry *) hash_seq_search (&scan)))
+    {
+      if (entry->connect_future != NULL)
+        {
+          cass_future_free (entry->connect_future);
+          cass_session_free (entry->connecting);
+          entry->connect_future = NULL;
+          entry->connecting = NULL;
+        }
+      if (entry->conn != NULL)
+        {
+          CassFuture *close_future = cass_session_close (entry->conn);
+
+          cass_future_wait (close_future);
+          cass_future_free (close_future);
+          cass_session_free (entry->conn);
+          entry->conn = NULL;
+        }
+      if (entry->cluster != NULL)
+        {
+          cass_cluster_free (entry->cluster);
+          entry->cluster = NULL;
+        }
+    }
+}
@@ -0,0 +1,579 @@
+/*-------------------------------------------------------------------------
+ *
+ * cass_metadata.c
+ *
+ * Backend-local cache of what planning needs to know about foreign
+ * tables: the Cassandra table and column names, the key columns as read
+ * from the schema metadata the driver keeps for each session, and the
+ * size estimates Cassandra keeps in system.size_estimates.
+ *
+ * IDENTIFICATION
+ *		  contrib/cassandra2_fdw/cass_metadata.c
+ *
+ *-------------------------------------------------------------------------
+ */
+#include "postgres.h"
+
+#include "cassandra2_fdw.h"
+
+#include "commands/defrem.h"
+#include "miscadmin.h"
+#include "parser/scansup.h"
+#include "utils/hsearch.h"
+#include "utils/inval.h"
+#include "utils/lsyscache.h"
+#include "utils/memutils.h"
+#include "utils/syscache.h"
+#include "utils/timestamp.h"
+
+/* Seconds for which size estimates are reused before reading them again */
+#define SIZE_ESTIMATES_LIFETIME 60
+
+typedef struct TableMetadataCacheEntry
+{
+  Oid relid; /* OID of the foreign table (hash key, must be first) */
+  bool valid; /* false once invalidated, until rebuilt */
+  MemoryContext cxt; /* holds everything below, or NULL */
+  uint32 table_hash; /* hash of the table's pg_foreign_table entry */
+  uint32 server_hash; /* hash of its server's pg_foreign_server entry */
+  CassTableMetadata metadata;
+  bool keys_read; /* the schema has been consulted */
+  bool keys_found; /* and the table found in it */
+  CassTableKeys keys; /* its key columns, if found */
+  TimestampTz sizes_read; /* when the size estimates were read, or 0 */
+  bool sizes_found; /* and whether there were any */
+  double partitions; /* estimated number of partitions */
+  double partition_size; /* their estimated mean size in bytes */
+} TableMetadataCacheEntry;
+
+/*
+ * Metadata cache (initialized on first use)
+ */
+static HTAB *TableMetadataHash = NULL;
+
+/* prototypes of private functions */
+static TableMetadataCacheEntry *get_cache_entry (Oid relid);
+static void build_table_metadata (TableMetadataCacheEntry *entry);
+static void table_metadata_inval_callback (Datum arg, int cacheid,
+                                           uint32 hashvalue);
+static char *cass_meta_string (const CassSchemaMeta *meta, const char *name);
+static int cass_meta_int (const CassSchemaMeta *meta, const char *name);
+static char *cass_identifier (const char *name, int len);
+static bool read_table_keys (Oid relid, const char *tablename,
+                             CassTableKeys *keys);
+static bool read_size_estimates (Oid relid, const char *tablename,
+                                 double *partitions, double *partition_size);
+
+/*
+ * Return the Cassandra table and column names of a foreign table.  The
+ * result is only good until the next invalidation of the cache, so
+ * callers keep copies of whatever they need for longer.
+ */
+CassTableMetadata *
+pgcass_GetTableMetadata (Oid relid)
+{
+  return &get_cache_entry (relid)->metadata;
+}
+
+/*
+ * Return the key columns of the Cassandra table a foreign table reads, or
+ * NULL if the table can't be found in the schema, as when the table option
+ * doesn't name a keyspace.  The schema is only consulted the first time;
+ * the result is good until the next invalidation of the cache, and must
+ * not be modified.
+ */
+CassTableKeys *
+pgcass_GetTableKeys (Oid relid)
+{
+  TableMetadataCacheEntry *entry = get_cache_entry (relid);
+
+  if (!entry->keys_read)
+    {
+      CassTableKeys keys;
+      bool found;
+      MemoryContext oldcontext;
+
+      /*
+       * Read the schema before changing the entry, so that an error
+       * doesn't leave it half done.
+       */
+      MemSet (&keys, 0, sizeof (keys));
+      found = read_table_keys (relid, entry->metadata.table, &keys);
+
+      oldcontext = MemoryContextSwitchTo (entry->cxt);
+      entry->keys.partition_key = copyObject (keys.partition_key);
+      entry->keys.clustering_columns = copyObject (keys.clustering_columns);
+      entry->keys.clustering_desc = list_copy (keys.clustering_desc);
+      MemoryContextSwitchTo (oldcontext);
+
+      entry->keys_found = found;
+      entry->keys_read = true;
+    }
+
+  return entry->keys_found ? &entry->keys : NULL;
+}
+
+/*
+ * Get Cassandra's estimates of the number of partitions of the table a
+ * foreign table reads, and of their mean size in bytes.  Returns false if
+ * there are none, as for a table without a keyspace in its table option,
+ * or from Cassandra versions before 2.1.5.  The estimates are reread once
+ * they are a minute old, as they change as the table grows.
+ */
+bool
+pgcass_GetSizeEstimates (Oid relid, double *partitions, double *partition_size)
+{
+  TableMetadataCacheEntry *entry = get_cache_entry (relid);
+  TimestampTz now = GetCurrentTimestamp ();
+
+  if (entry->sizes_read == 0 ||
+      TimestampDifferenceExceeds (entry->sizes_read, now,
+                                  SIZE_ESTIMATES_LIFETIME * 1000))
+    {
+      entry->sizes_found = read_size_estimates (relid, entry->metadata.table,
+                                                &entry->partitions,
+                                                &entry->partition_size);
+      entry->sizes_read = now;
+    }
+
+  *partitions = entry->partitions;
+  *partition_size = entry->partition_size;
+  return entry->sizes_found;
+}
+
+/*
+ * Find the cache entry of a foreign table, (re)building it if need be.
+ */
+static TableMetadataCacheEntry *
+get_cache_entry (Oid relid)
+{
+  TableMetadataCacheEntry *entry;
+  bool found;
+
+  /* First time through, initialize the cache hashtable */
+  if (TableMetadataHash == NULL)
+    {
+      HASHCTL ctl;
+
+      MemSet (&ctl, 0, sizeof (ctl));
+      ctl.keysize = sizeof (Oid);
+      ctl.entrysize = sizeof (TableMetadataCacheEntry);
+      ctl.hash = oid_hash;
+      ctl.hcxt = CacheMemoryContext;
+      TableMetadataHash = hash_create ("cassandra2_fdw table metadata", 64,
+                                       &ctl,
+                                       HASH_ELEM | HASH_FUNCTION | HASH_CONTEXT);
+
+      /*
+       * Changes to the foreign table, its columns or its server may change
+       * any of the entries' contents.  This should be done just once in
+       * each backend.
+       */
+      CacheRegisterSyscacheCallback (FOREIGNTABLEREL,
+                                     table_metadata_inval_callback,
+                                     (Datum) 0);
+      CacheRegisterSyscacheCallback (ATTNUM,
+                                     table_metadata_inval_callback,
+                                     (Datum) 0);
+      CacheRegisterSyscacheCallback (FOREIGNSERVEROID,
+                                     table_metadata_inval_callback,
+                                     (Datum) 0);
+    }
+
+  entry = hash_search (TableMetadataHash, &relid, HASH_ENTER, &found);
+  if (!found)
+    {
+      entry->valid = false;
+      entry->cxt = NULL;
+    }
+
+  if (!entry->valid)
+    build_table_metadata (entry);
+
+  return entry;
+}
+
+/*
+ * Fill in a cache entry from the catalogs.  The schema is left for
+ * pgcass_GetTableKeys to read when it is needed.
+ */
+static void
+build_table_metadata (TableMetadataCacheEntry *entry)
+{
+  ForeignTable *table = GetForeignTable (entry->relid);
+  MemoryContext cxt;
+  CassTableMetadata *metadata = &entry->metadata;
+  char *old_table = entry->cxt ? metadata->table : NULL;
+  AttrNumber attnum;
+  ListCell *lc;
+
+  /*
+   * Build the new contents in a context of their own, and only swap them
+   * in once done, so that an error leaves the entry invalid but intact.
+   */
+  cxt = AllocSetContextCreate (CacheMemoryContext,
+                               "cassandra2_fdw table metadata",
+                               ALLOCSET_SMALL_MINSIZE,
+                               ALLOCSET_SMALL_INITSIZE,
+                               ALLOCSET_SMALL_MAXSIZE);
+
+  PG_TRY ();
+  {
+    char *tablename = NULL;
+    int natts = get_relnatts (entry->relid);
+    char **column_names;
+
+    foreach (lc, table->options)
+    {
+      DefElem *def = (DefElem *) lfirst (lc);
+
+      if (strcmp (def->defname, "table") == 0)
+        tablename = MemoryContextStrdup (cxt, defGetString (def));
+    }
+
+    /*
+     * A column is known to Cassandra by its column_name option if it has
+     * one, by its attribute name otherwise.
+     */
+    column_names = MemoryContextAllocZero (cxt, sizeof (char *) * Max (natts, 1));
+    for (attnum = 1; attnum <= natts; attnum++)
+      {
+        char *colname = NULL;
+
+        foreach (lc, GetForeignColumnOptions (entry->relid, attnum))
+        {
+          DefElem *def = (DefElem *) lfirst (lc);
+
+          if (strcmp (def->defname, "column_name") == 0)
+            {
+              colname = defGetString (def);
+              break;
+            }
+        }
+        if (colname == NULL)
+          colname = get_relid_attribute_name (entry->relid, attnum);
+        column_names[attnum - 1] = MemoryContextStrdup (cxt, colname);
+      }
+
+    metadata->table = tablename;
+    metadata->natts = natts;
+    metadata->column_names = column_names;
+  }
+  PG_CATCH ();
+  {
+    MemoryContextDelete (cxt);
+    PG_RE_THROW ();
+  }
+  PG_END_TRY ();
+
+  /* Remember the catalog entries to watch for changes. */
+  entry->table_hash = GetSysCacheHashValue1 (FOREIGNTABLEREL,
+                                             ObjectIdGetDatum (entry->relid));
+  entry->server_hash = GetSysCacheHashValue1 (FOREIGNSERVEROID,
+                                              ObjectIdGetDatum (table->serverid));
+
+  /*
+   * The size estimates only depend on the Cassandra table, and the
+   * invalidations that got us here are mostly for other catalog changes,
+   * such as any column of any table: keep them unless the table changed.
+   */
+  if (old_table == NULL || metadata->table == NULL ||
+      strcmp (old_table, metadata->table) != 0)
+    {
+      entry->sizes_read = 0;
+      entry->sizes_found = false;
+    }
+
+  if (entry->cxt != NULL)
+    MemoryContextDelete (entry->cxt);
+  entry->cxt = cxt;
+  entry->keys_read = false;
+  entry->keys_found = false;
+  MemSet (&entry->keys, 0, sizeof (entry->keys));
+  entry->valid = true;
+}
+
+/*
+ * Syscache invalidation callback: mark the entries of changed foreign
+ * tables and servers invalid.  Column changes are not traced back to their
+ * table; they invalidate every entry.  The entries are rebuilt when next
+ * used, as the callback may not access the catalogs.
+ */
+static void
+table_metadata_inval_callback (Datum arg, int cacheid, uint32 hashvalue)
+{
+  HASH_SEQ_STATUS scan;
+  TableMetadataCacheEntry *entry;
+
+  hash_seq_init (&scan, TableMetadataHash);
+  while ((entry = (TableMetadataCacheEntry *) hash_seq_search (&scan)))
+    {
+      if (hashvalue == 0 || cacheid == ATTNUM ||
+          (cacheid == FOREIGNTABLEREL && entry->table_hash == hashvalue) ||
+          (cacheid == FOREIGNSERVEROID && entry->server_hash == hashvalue))
+        entry->valid = false;
+    }
+}
+
+/*
+ * Look up the table named by the foreign table's table option in the
+ * schema of its server, and fill in its key columns.  Returns false if
+ * there is no such table.
+ */
+static bool
+read_table_keys (Oid relid, const char *tablename, CassTableKeys *keys)
+{
+  ForeignTable *table = GetForeignTable (relid);
+  ForeignServer *server = GetForeignServer (table->serverid);
+  UserMapping *user = GetUserMapping (GetUserId (), server->serverid);
+  const char *dot;
+  char *keyspace;
+  char *name;
+  CassSession *session;
+  const CassSchema *schema;
+  const CassSchemaMeta *keyspace_meta;
+  const CassSchemaMeta *table_meta;
+  CassIterator *columns;
+  char **partition_key;
+  char **clustering_columns;
+  bool *clustering_desc;
+  int ncolumns = 0;
+  int npartition = 0;
+  int nclustering = 0;
+  int i;
+
+  if (tablename == NULL || (dot = strchr (tablename, '.')) == NULL)
+    return false;
+
+  keyspace = cass_identifier (tablename, dot - tablename);
+  name = cass_identifier (dot + 1, strlen (dot + 1));
+
+  session = pgcass_GetConnection (server, user, false);
+  schema = cass_session_get_schema (session);
+
+  keyspace_meta = cass_schema_get_keyspace (schema, keyspace);
+  table_meta = keyspace_meta ? cass_schema_meta_get_entry (keyspace_meta, name) : NULL;
+  if (table_meta == NULL)
+    {
+      cass_schema_free (schema);
+      return false;
+    }
+
+  /* Count the columns to size the arrays below. */
+  columns = cass_iterator_from_schema_meta (table_meta);
+  while (cass_iterator_next (columns))
+    ncolumns++;
+  cass_iterator_free (columns);
+
+  partition_key = palloc0 (sizeof (char *) * (ncolumns + 1));
+  clustering_columns = palloc0 (sizeof (char *) * (ncolumns + 1));
+  clustering_desc = palloc0 (sizeof (bool) * (ncolumns + 1));
+
+  /*
+   * Key columns are listed in no particular order; their component_index
+   * gives their position in the key.  It is null for the only column of a
+   * single column partition key.  Descending clustering columns have their
+   * type wrapped in a ReversedType.
+   */
+  columns = cass_iterator_from_schema_meta (table_meta);
+  while (cass_iterator_next (columns))
+    {
+      const CassSchemaMeta *column = cass_iterator_get_schema_meta (columns);
+      char *kind = cass_meta_string (column, "type");
+      char *colname = cass_meta_string (column, "column_name");
+      int index = cass_meta_int (column, "component_index");
+
+      if (kind == NULL || colname == NULL || index < 0 || index >= ncolumns)
+        continue;
+
+      if (strcmp (kind, "partition_key") == 0)
+        {
+          partition_key[index] = colname;
+          npartition = Max (npartition, index + 1);
+        }
+      else if (strcmp (kind, "clustering_key") == 0)
+        {
+          char *validator = cass_meta_string (column, "validator");
+
+          clustering_columns[index] = colname;
+          clustering_desc[index] = validator != NULL &&
+                  strstr (validator, "ReversedType") != NULL;
+          nclustering = Max (nclustering, index + 1);
+        }
+    }
+  cass_iterator_free (columns);
+  cass_schema_free (schema);
+
+  /* A gap means the schema is not what we expect; stop at it. */
+  for (i = 0; i < npartition && partition_key[i] != NULL; i++)
+    keys->partition_key = lappend (keys->partition_key,
+                                   makeString (partition_key[i]));
+  if (i < npartition)
+    {
+      keys->partition_key = NIL;
+      return false;
+    }
+
+  for (i = 0; i < nclustering && clustering_columns[i] != NULL; i++)
+    {
+      keys->clustering_columns = lappend (keys->clustering_columns,
+                                          makeString (clustering_columns[i]));
+      keys->clustering_desc = lappend_int (keys->clustering_desc,
+                                           clustering_desc[i] ? 1 : 0);
+    }
+
+  return true;
+}
+
+/*
+ * Read the size estimates of the table named by the foreign table's table
+ * option.  Each node records the number of partitions and their mean size
+ * for the token ranges it owns; those of the node that answers are scaled
+ * up by the share of the token ring they cover.  Returns false if there
+ * are no estimates.
+ */
+static bool
+read_size_estimates (Oid relid, const char *tablename,
+                     double *partitions, double *partition_size)
+{
+  ForeignTable *table = GetForeignTable (relid);
+  ForeignServer *server = GetForeignServer (table->serverid);
+  UserMapping *user = GetUserMapping (GetUserId (), server->serverid);
+  const char *dot;
+  char *keyspace;
+  char *name;
+  CassSession *session;
+  CassStatement *statement;
+  CassFuture *result_future;
+  const CassResult *res;
+  CassIterator *rows;
+  double ring_share = 0;
+  double count = 0;
+  double bytes = 0;
+
+  if (tablename == NULL || (dot = strchr (tablename, '.')) == NULL)
+    return false;
+
+  keyspace = cass_identifier (tablename, dot - tablename);
+  name = cass_identifier (dot + 1, strlen (dot + 1));
+
+  session = pgcass_GetConnection (server, user, false);
+  statement = cass_statement_new ("SELECT range_start, range_end, "
+                                  "mean_partition_size, partitions_count "
+                                  "FROM system.size_estimates "
+                                  "WHERE keyspace_name = ? AND table_name = ?",
+                                  2);
+  cass_statement_bind_string (statement, 0, keyspace);
+  cass_statement_bind_string (statement, 1, name);
+  result_future = cass_session_execute (session, statement);
+  cass_statement_free (statement);
+
+  if (cass_future_error_code (result_future) != CASS_OK)
+    {
+      const char *message;
+      size_t message_length;
+
+      cass_future_error_message (result_future, &message, &message_length);
+      elog (DEBUG1, "could not read size estimates of \"%s\": %.*s",
+            tablename, (int) message_length, message);
+      cass_future_free (result_future);
+      return false;
+    }
+
+  res = cass_future_get_result (result_future);
+  rows = cass_iterator_from_result (res);
+  while (cass_iterator_next (rows))
+    {
+      const CassRow *row = cass_iterator_get_row (rows);
+      const char *str;
+      size_t len;
+      char *start;
+      char *end;
+      cass_int64_t mean_size;
+      cass_int64_t nparts;
+
+      if (cass_value_get_string (cass_row_get_column (row, 0), &str, &len) != CASS_OK)
+        continue;
+      start = pnstrdup (str, len);
+      if (cass_value_get_string (cass_row_get_column (row, 1), &str, &len) != CASS_OK)
+        continue;
+      end = pnstrdup (str, len);
+      if (cass_value_get_int64 (cass_row_get_column (row, 2), &mean_size) != CASS_OK ||
+          cass_value_get_int64 (cass_row_get_column (row, 3), &nparts) != CASS_OK)
+        continue;
+
+      /* Ranges may wrap around the end of the ring. */
+      ring_share += (double) ((uint64) strtoll (end, NULL, 10) -
+                              (uint64) strtoll (start, NULL, 10)) /
+              18446744073709551616.0;
+      count += nparts;
+      bytes += (double) nparts * mean_size;
+    }
+  cass_iterator_free (rows);
+  cass_result_free (res);
+  cass_future_free (result_future);
+
+  if (ring_share <= 0 || count <= 0)
+    return false;
+
+  *partitions = count / Min (ring_share, 1.0);
+  *partition_size = bytes / count;
+  return true;
+}
+
+/*
+ * Return the text value of a schema metadata field, or NULL if it is
+ * missing or null.
+ */
+static char *
+cass_meta_string (const CassSchemaMeta *meta, const char *name)
+{
+  const CassSchemaMetaField *field = cass_schema_meta_get_field (meta, name);
+  const CassValue *value;
+  const char *str;
+  size_t len;
+
+  if (field == NULL)
+    return NULL;
+  value = cass_schema_meta_field_value (field);
+  if (value == NULL || cass_value_is_null (value) ||
+      cass_value_get_string (value, &str, &len) != CASS_OK)
+    return NULL;
+
+  return pnstrdup (str, len);
+}
+
+/*
+ * Return the integer value of a schema metadata field, or 0 if it is
+ * missing or null.
+ */
+static int
+cass_meta_int (const CassSchemaMeta *meta, const char *name)
+{
+  const CassSchemaMetaField *field = cass_schema_meta_get_field (meta, name);
+  const CassValue *value;
+  cass_int32_t result;
+
+  if (field == NULL)
+    return 0;
+  value = cass_schema_meta_field_value (field);
+  if (value == NULL || cass_value_is_null (value) ||
+      cass_value_get_int32 (value, &result) != CASS_OK)
+    return 0;
+
+  return result;
+}
+
+/*
+ * Convert a keyspace or table name, as written in CQL, to the name the
+ * schema knows it by: quoted names keep their case, others are folded to
+ * lower case.
+ */
+static char *
+cass_identifier (const char *name, int len)
+{
+  if (len >= 2 && name[0] == '"' && name[len - 1] == '"')
+    return pnstrdup (name + 1, len - 2);
+
+  return downcase_truncate_identifier (name, len, false);
+}
@@ -0,0 +1,11 @@
+/*-------------------------------------------------------------------------
+ *
+ * Copyright (c) 2014, Open Source Consulting Group
+ *
+ *-------------------------------------------------------------------------
+ */
+
+CREATE FUNCTION cassandra2_fdw_prewarm(server text)
+RETURNS void
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT;
@@ -18,3 +18,8 @@ LANGUAGE C STRICT;
 CREATE FOREIGN DATA WRAPPER cassandra2_fdw
   HANDLER cassandra2_fdw_handler
   VALIDATOR cassandra2_fdw_validator;
+
+CREATE FUNCTION cassandra2_fdw_prewarm(server text)
+RETURNS void
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT;
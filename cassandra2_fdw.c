@@ -19,13 +19,17 @@
 
 #include "postgres.h"
 
+#include <limits.h>
+#include <math.h>
 #include <cassandra.h>
 
 #include "cassandra2_fdw.h"
 
+#include "access/hash.h"
 #include "access/htup_details.h"
 #include "access/reloptions.h"
 #include "access/sysattr.h"
+#include "executor/executor.h"
 #include "executor/spi.h"
 #include "foreign/fdwapi.h"
 #include "foreign/foreign.h"
@@ -57,9 +61,11 @@
 #include "utils/lsyscache.h"
 #include "utils/memutils.h"
 #include "access/reloptions.h"
+#include "access/skey.h"
 #include "access/sysattr.h"
 #include "access/xact.h"
 #include "catalog/indexing.h"
+#include "catalog/pg_am.h"
 #include "catalog/pg_attribute.h"
 #include "catalog/pg_cast.h"
 #include "catalog/pg_collation.h"
@@ -71,6 +77,7 @@
 #include "catalog/pg_proc.h"
 #include "catalog/pg_user_mapping.h"
 #include "catalog/pg_type.h"
+#include "commands/dbcommands.h"
 #include "commands/explain.h"
 #include "commands/vacuum.h"
 #include "foreign/fdwapi.h"
@@ -81,16 +88,28 @@
 #include "nodes/makefuncs.h"
 #include "nodes/nodeFuncs.h"
 #include "nodes/pg_list.h"
+#include "optimizer/clauses.h"
 #include "optimizer/cost.h"
 #include "optimizer/pathnode.h"
+#include "optimizer/paths.h"
+#include "optimizer/plancat.h"
 #include "optimizer/planmain.h"
 #include "optimizer/restrictinfo.h"
 #include "optimizer/var.h"
+#include "parser/analyze.h"
 #include "parser/parse_relation.h"
 #include "parser/parsetree.h"
 #include "port.h"
+#include "postmaster/bgworker.h"
+#include "storage/dsm.h"
 #include "storage/ipc.h"
+#include "storage/latch.h"
 #include "storage/lock.h"
+#include "storage/proc.h"
+#include "storage/shm_mq.h"
+#include "storage/shm_toc.h"
+#include "storage/spin.h"
+#include "tcop/tcopprot.h"
 #include "utils/array.h"
 #include "utils/builtins.h"
 #include "utils/date.h"
@@ -105,6 +124,8 @@
 #include "utils/resowner.h"
 #include "utils/timestamp.h"
 #include "utils/tqual.h"
+#include "utils/typcache.h"
+#include "utils/uuid.h"
 #include "utils/snapmgr.h"
 #include "utils/syscache.h"
 #include "utils/timestamp.h"
@@ -118,6 +139,51 @@ PG_MODULE_MAGIC;
 /* Default CPU cost to process 1 row (above and beyond cpu_tuple_cost). */
 #define DEFAULT_FDW_TUPLE_COST		0.01
 
+/* Default number of rows requested per result page. */
+#define DEFAULT_FDW_FETCH_SIZE		1000
+
+/* Bounds of the Murmur3Partitioner token ring. */
+#define CASS_MIN_TOKEN	(-INT64CONST(0x7FFFFFFFFFFFFFFF) - 1)
+#define CASS_MAX_TOKEN	INT64CONST(0x7FFFFFFFFFFFFFFF)
+
+/* Layout of the dynamic shared memory used by parallel scans. */
+#define CASS_PSCAN_MAGIC			0x43415353
+#define CASS_PSCAN_KEY_SHARED		1
+#define CASS_PSCAN_KEY_QUERY		2
+#define CASS_PSCAN_KEY_QUEUES		3
+
+/* Size of each worker's tuple queue. */
+#define CASS_PSCAN_QUEUE_SIZE		65536
+
+/*
+ * Number of lookups a parameterized scan remembers the rows of, and the
+ * largest number of rows a lookup may return to be remembered.
+ */
+#define CASS_LOOKUP_CACHE_ENTRIES	256
+#define CASS_LOOKUP_CACHE_ROWS		100
+
+/*
+ * Largest number of per-partition queries of a partition key list to have
+ * in flight at once; more would only wait in the driver's request queue.
+ */
+#define CASS_MAX_KEY_STREAMS		256
+
+/*
+ * Bytes Cassandra stores per row beyond the column values, for turning its
+ * mean partition size into a number of rows.
+ */
+#define CASS_ROW_OVERHEAD		32
+
+/* Number of partitions assumed for a key list whose length is unknown. */
+#define CASS_KEY_LIST_GUESS		10
+
+/*
+ * ANALYZE samples a table by reading the first few rows of many token
+ * ranges, this many rows from each, with this many queries in flight.
+ */
+#define CASS_SAMPLE_ROWS_PER_RANGE	20
+#define CASS_SAMPLE_CONCURRENCY		64
+
 /*
  * Describes the valid options for objects that use this wrapper.
  */
@@ -135,19 +201,92 @@ static struct CassFdwOption valid_options[] = {
   { "url", ForeignServerRelationId},
   { "querytimeout", ForeignServerRelationId},
   { "portNumber", ForeignServerRelationId},
+  /* Driver tuning options */
+  { "num_threads_io", ForeignServerRelationId},
+  { "core_connections_per_host", ForeignServerRelationId},
+  { "max_connections_per_host", ForeignServerRelationId},
+  { "queue_size_io", ForeignServerRelationId},
+  { "max_requests_per_flush", ForeignServerRelationId},
+  { "pending_requests_high_water_mark", ForeignServerRelationId},
+  { "pending_requests_low_water_mark", ForeignServerRelationId},
+  { "write_bytes_high_water_mark", ForeignServerRelationId},
+  { "write_bytes_low_water_mark", ForeignServerRelationId},
+  { "request_timeout", ForeignServerRelationId},
+  { "connect_timeout", ForeignServerRelationId},
+  { "tcp_nodelay", ForeignServerRelationId},
+  { "tcp_keepalive", ForeignServerRelationId},
+  /* Load balancing options */
+  { "token_aware_routing", ForeignServerRelationId},
+  { "local_dc", ForeignServerRelationId},
+  { "used_hosts_per_remote_dc", ForeignServerRelationId},
+  { "allow_remote_dcs_for_local_cl", ForeignServerRelationId},
+  { "latency_aware_routing", ForeignServerRelationId},
+  { "latency_exclusion_threshold", ForeignServerRelationId},
+  { "latency_scale_ms", ForeignServerRelationId},
+  { "latency_retry_period_ms", ForeignServerRelationId},
+  { "latency_update_rate_ms", ForeignServerRelationId},
+  { "latency_min_measured", ForeignServerRelationId},
   { "username", UserMappingRelationId},
   { "password", UserMappingRelationId},
+  { "fetch_size", ForeignServerRelationId},
+  { "use_remote_estimate", ForeignServerRelationId},
   { "table", ForeignTableRelationId},
   { "queryable_columns", ForeignTableRelationId},
+  { "partition_key", ForeignTableRelationId},
+  { "clustering_columns", ForeignTableRelationId},
+  { "clustering_order", ForeignTableRelationId},
+  { "scan_parallelism", ForeignTableRelationId},
+  { "parallel_workers", ForeignTableRelationId},
+  { "fetch_size", ForeignTableRelationId},
+  { "use_remote_estimate", ForeignTableRelationId},
   /* Sentinel */
   { NULL, InvalidOid}
 };
 
+/*
+ * Driver options taking a positive integer; cass_connection.c applies them
+ * to the cluster a connection is made with.
+ */
+static const char *const cluster_int_options[] = {
+  "num_threads_io",
+  "core_connections_per_host",
+  "max_connections_per_host",
+  "queue_size_io",
+  "max_requests_per_flush",
+  "pending_requests_high_water_mark",
+  "pending_requests_low_water_mark",
+  "write_bytes_high_water_mark",
+  "write_bytes_low_water_mark",
+  "request_timeout",
+  "connect_timeout",
+  "tcp_keepalive",
+  "used_hosts_per_remote_dc",
+  "latency_scale_ms",
+  "latency_retry_period_ms",
+  "latency_update_rate_ms",
+  "latency_min_measured",
+  NULL
+};
+
+/*
+ * Driver options taking a boolean.
+ */
+static const char *const cluster_bool_options[] = {
+  "tcp_nodelay",
+  "token_aware_routing",
+  "allow_remote_dcs_for_local_cl",
+  "latency_aware_routing",
+  NULL
+};
+
 /*
  * FDW-specific information for RelOptInfo.fdw_private.
  */
 typedef struct CassFdwPlanState
 {
+  /* OID of the foreign table. */
+  Oid relid;
+
   /* Bitmap of attr numbers we need to fetch from the remote server. */
   Bitmapset *attrs_used;
 
@@ -156,38 +295,185 @@ typedef struct CassFdwPlanState
   int width;
   Cost startup_cost;
   Cost total_cost;
+
+  /* Number of rows to request per result page. */
+  int fetch_size;
+
+  /* Partition key columns (String nodes), from the partition_key option. */
+  List *partition_key;
+  /* Attribute numbers of the partition key columns, 0 if not mapped. */
+  List *partition_key_attrs;
+  /* Clustering columns (String nodes) in order, and their attribute numbers. */
+  List *clustering_columns;
+  List *clustering_attrs;
+  /* For each clustering column, true (1) if it is in descending order. */
+  List *clustering_desc;
+  /* Columns whose = conditions may be sent (String nodes). */
+  List *queryable_columns;
+  /* Number of token ranges to split a full scan into. */
+  int scan_parallelism;
+  /* Number of background workers to hand token ranges to. */
+  int parallel_workers;
+
+  /* Whether to use the size estimates Cassandra keeps of the table. */
+  bool use_remote_estimate;
+  /* If so, and there are any, its number of partitions and their rows. */
+  bool have_remote_estimate;
+  double rows_per_partition;
 } CassFdwPlanState;
 
+/*
+ * One remote query feeding rows into a scan.  A plain scan has a single
+ * stream; a scan split into token ranges has one per range, all of them
+ * paging through their results concurrently.
+ */
+typedef struct CassScanStream
+{
+  CassStatement *statement; /* carries paging state between pages */
+  CassFuture *pending_future; /* request for the next page, if in flight */
+} CassScanStream;
+
+/*
+ * The driver objects of a batch of ANALYZE's range queries, kept out of
+ * the sampling function's locals so that they can be freed on error.
+ */
+typedef struct CassSampleBatch
+{
+  CassStatement *statements[CASS_SAMPLE_CONCURRENCY];
+  CassFuture *futures[CASS_SAMPLE_CONCURRENCY];
+  const CassResult *result; /* page being read, if any */
+  CassIterator *iterator; /* and its rows */
+} CassSampleBatch;
+
+/*
+ * State shared between a scan and the background workers it hands token
+ * ranges to.  Workers claim ranges and tuple queues from the counters, and
+ * send every row of a claimed range to the scan as a heap tuple.
+ */
+typedef struct CassParallelScan
+{
+  slock_t mutex; /* protects the three counters below */
+  int next_range; /* next token range to be claimed */
+  int ranges_done; /* # of token ranges sent in full */
+  int next_queue; /* next tuple queue to be claimed */
+
+  int num_ranges; /* # of token ranges the query is split into */
+  int num_queues; /* # of tuple queues, one per worker asked for */
+  int fetch_size; /* number of rows per result page */
+  Oid relid; /* OID of the foreign table */
+  Oid userid; /* OID of the user whose mapping is used */
+  char dbname[NAMEDATALEN]; /* database to connect workers to */
+  char username[NAMEDATALEN]; /* role to connect workers as */
+  int nattrs; /* # of entries in attrs */
+  int attrs[FLEXIBLE_ARRAY_MEMBER]; /* retrieved attribute numbers */
+} CassParallelScan;
+
+/*
+ * The rows a parameterized scan returned for one set of parameter values.
+ * The key is the values serialized by lookup_cache_key.
+ */
+typedef struct CassLookupCacheEntry
+{
+  MemoryContext cxt; /* holds key and tuples, or NULL if never used */
+  bool valid; /* holds every row of a completed lookup */
+  uint32 hash; /* hash of key */
+  char *key;
+  int keylen;
+  MinimalTuple *tuples; /* the lookup's rows */
+  int ntuples;
+  uint64 last_used; /* for evicting the least recently used entry */
+} CassLookupCacheEntry;
+
+/*
+ * An element of a partition key list, while duplicates are weeded out.
+ */
+typedef struct CassKeyItem
+{
+  uint32 hash; /* hash of data */
+  char *data; /* bytes of the value, as of pgcass_datum_bytes */
+  int len;
+  Datum value;
+} CassKeyItem;
+
 /*
  * FDW-specific information for ForeignScanState.fdw_state.
  */
 typedef struct CassFdwScanState
 {
+  MemoryContext scan_cxt; /* holds this struct and the streams */
+  ResourceOwner owner; /* scan's driver objects are freed along with it */
   Relation rel; /* relcache entry for the foreign table */
   AttInMetadata *attinmeta; /* attribute datatype conversion metadata */
+  CassValueDecoder *decoders; /* per result column; NULL entry = text input */
+  bool decoders_valid; /* decoders have been chosen */
 
   /* extracted fdw_private data */
   char *query; /* text of SELECT command */
   List *retrieved_attrs; /* list of retrieved attribute numbers */
 
   int NumberOfColumns;
+  int fetch_size; /* number of rows per result page */
+  int token_ranges; /* # of token ranges query is split into, or 0 */
+  int parallel_workers; /* # of workers to hand ranges to, or 0 */
+  Oid userid; /* user whose mapping is used */
 
   /* for remote query execution */
-  CassSession *cass_conn; /* connection for the scan */
+  List *param_exprs; /* executable expressions for param values */
+  Oid *param_types; /* types of the param values */
+  Oid *param_coltypes; /* types of the columns they must equal, if any */
+  Datum *param_values; /* param values for the current scan */
+  bool *param_isnull;
+  int16 *param_typlen;
+  bool *param_typbyval;
+  int numParams; /* number of parameters passed to query */
+
+  /* for parameterized scans: rows of recent lookups, by parameter values */
+  CassLookupCacheEntry *lookup_cache; /* array, NULL if not parameterized */
+  MemoryContext lookup_cxt; /* parent of the entries' contexts */
+  StringInfoData lookup_key; /* key of the current parameter values */
+  uint32 lookup_hash; /* hash of lookup_key */
+  uint64 lookup_clock; /* bumped on every use of an entry */
+  CassLookupCacheEntry *filling; /* entry the current lookup is saved to */
+  CassLookupCacheEntry *replaying; /* entry the current rows come from */
+  int replay_pos; /* next row of replaying to return */
+  ForeignServer *server; /* server and user mapping to connect with */
+  UserMapping *user;
+  CassSession *cass_conn; /* connection for the scan, once made */
+  CassBrokerScan *broker; /* broker running the scan instead, or NULL */
   bool sql_sended;
-  CassStatement *statement;
-
-  /* for storing result tuples */
-  HeapTuple *tuples; /* array of currently-retrieved tuples */
-  int num_tuples; /* # of tuples in array */
-  int next_tuple; /* index of next one to return */
+  CassScanStream *streams; /* remote queries feeding the scan */
+  int num_streams; /* # of entries in streams */
+  int streams_started; /* # of streams whose query has been sent */
+  int cur_stream; /* stream the current page came from */
+
+  /* for scans reading a list of partitions, one stream per partition key */
+  bool has_key_list; /* key_param holds a partition key list */
+  int key_param; /* index of the array parameter */
+  Oid key_type; /* type of the keys */
+  Datum *key_values; /* distinct non-null keys of the current list */
+  MemoryContext key_cxt; /* holds key_values and their streams */
+
+  /* current page of results */
+  const CassResult *result; /* page rows are being returned from */
+  CassIterator *rows; /* position within result */
+
+  /* for scans that have Cassandra count the rows instead of sending them */
+  bool count_only; /* the query returns row counts */
+  int64 pending_count; /* # of empty rows still to be returned */
+
+  /* for scans whose token ranges are read by background workers */
+  dsm_segment *pscan_seg; /* segment holding CassParallelScan and queues */
+  CassParallelScan *pscan; /* shared state in pscan_seg */
+  shm_mq_handle **worker_queues; /* tuple queues; NULL once finished */
+  BackgroundWorkerHandle **worker_handles;
+  int nworkers_launched; /* # of entries in the two arrays above */
+  int next_queue; /* queue to read from next */
 
   /* batch-level state, for optimizing rewinds and avoiding useless fetch */
   int fetch_ct_2; /* Min(# of fetches done, 2) */
   bool eof_reached; /* true if last fetch reached EOF */
 
-  /* working memory contexts */
-  MemoryContext batch_cxt; /* context holding current batch of tuples */
+  /* working memory context */
   MemoryContext temp_cxt; /* context for per-tuple temporary data */
 } CassFdwScanState;
 
@@ -196,18 +482,63 @@ enum CassFdwScanPrivateIndex
   /* SQL statement to execute remotely (as a String node) */
   CassFdwScanPrivateSelectSql,
   /* Integer list of attribute numbers retrieved by the SELECT */
-  CassFdwScanPrivateRetrievedAttrs
+  CassFdwScanPrivateRetrievedAttrs,
+  /* Number of rows per result page (as an Integer node) */
+  CassFdwScanPrivateFetchSize,
+  /* Number of token ranges to split the query into, or 0 (Integer node) */
+  CassFdwScanPrivateTokenRanges,
+  /* Number of background workers to read token ranges, or 0 (Integer) */
+  CassFdwScanPrivateParallelWorkers,
+  /* Index of the parameter holding a partition key list, or -1 (Integer) */
+  CassFdwScanPrivateKeyListParam,
+  /* Nonzero if the query only counts the rows to return (Integer) */
+  CassFdwScanPrivateCountOnly,
+  /* Nonzero if outer rows of a join supply parameters (Integer) */
+  CassFdwScanPrivateParameterized,
+  /*
+   * OID list with, for each parameter, the type of the column it must be
+   * equal to, or InvalidOid
+   */
+  CassFdwScanPrivateParamColumnTypes
 };
 
 
+/*
+ * Module initialization
+ */
+extern void _PG_init (void);
+
 /*
  * SQL functions
  */
 extern Datum cassandra2_fdw_handler (PG_FUNCTION_ARGS);
 extern Datum cassandra2_fdw_validator (PG_FUNCTION_ARGS);
+extern Datum cassandra2_fdw_prewarm (PG_FUNCTION_ARGS);
+
+/*
+ * Background worker entry point
+ */
+extern void cassandra2_fdw_scan_worker_main (Datum main_arg);
 
 PG_FUNCTION_INFO_V1 (cassandra2_fdw_handler);
 PG_FUNCTION_INFO_V1 (cassandra2_fdw_validator);
+PG_FUNCTION_INFO_V1 (cassandra2_fdw_prewarm);
+
+/* GUC variables */
+static char *prewarm_servers = NULL;
+
+/* Whether this backend has connected to prewarm_servers yet */
+static bool prewarm_done = false;
+
+static post_parse_analyze_hook_type prev_post_parse_analyze_hook = NULL;
+
+/*
+ * Scans begun and not yet ended.  The driver's objects aren't palloc'd, so
+ * those of a scan that an error cuts short are freed when the resource
+ * owner it was begun under is released.
+ */
+static List *open_scans = NIL;
+static bool scan_callback_registered = false;
 
 
 /*
@@ -227,6 +558,13 @@ static void cassBeginForeignScan (ForeignScanState *node, int eflags);
 static TupleTableSlot *cassIterateForeignScan (ForeignScanState *node);
 static void cassReScanForeignScan (ForeignScanState *node);
 static void cassEndForeignScan (ForeignScanState *node);
+static bool cassAnalyzeForeignTable (Relation relation,
+                                     AcquireSampleRowsFunc *func,
+                                     BlockNumber *totalpages);
+static int cassAcquireSampleRows (Relation relation, int elevel,
+                                  HeapTuple *rows, int targrows,
+                                  double *totalrows,
+                                  double *totaldeadrows);
 
 /*
  * Helper functions
@@ -237,26 +575,99 @@ static void estimate_path_cost_size (PlannerInfo *root,
                                      double *p_rows, int *p_width,
                                      Cost *p_startup_cost, Cost *p_total_cost);
 static bool cassIsValidOption (const char *option, Oid context);
-static void cassGetOptions (Oid foreigntableid,
-                            char **url, int *querytimeout,
-                            int* portNumber, char **username, char **password,
-                            char **query, char **tablename);
+static int cassGetFetchSize (ForeignTable *table, ForeignServer *server);
+static bool cassGetUseRemoteEstimate (ForeignTable *table,
+                                      ForeignServer *server);
+static double cassCountKeyPartitions (RelOptInfo *baserel,
+                                      CassFdwPlanState *fpinfo,
+                                      List *join_conds);
+static int cassGetPositiveIntOption (DefElem *def);
+static int cassGetNonNegativeIntOption (DefElem *def);
+static bool cassIsClusterOption (const char *const *options,
+                                 const char *option);
+static char *cassGetTableOption (ForeignTable *table, const char *optname);
+static List *cassParseColumnList (const char *str, const char *optname);
+static List *cassParseClusteringOrder (const char *str);
+static bool cassCheckPrewarmServers (char **newval, void **extra,
+                                     GucSource source);
+static void cassPrewarmPostParseAnalyze (ParseState *pstate, Query *query);
+static void cassPrewarmConfiguredServers (void);
+static void cassPrewarmServer (const char *servername, bool missing_ok);
+static List *cassGetColumnAttrs (Oid relid, List *names);
+static char *cassGetColumnName (Oid relid, int attnum);
+static bool cassIsKeyEqualityClause (RelOptInfo *baserel,
+                                     CassFdwPlanState *fpinfo,
+                                     Expr *clause,
+                                     AttrNumber *attnum, Expr **value);
+static bool cassKeyIsCovered (RelOptInfo *baserel,
+                              CassFdwPlanState *fpinfo,
+                              List *join_clauses);
+static bool ec_member_matches_key_column (PlannerInfo *root,
+                                          RelOptInfo *rel,
+                                          EquivalenceClass *ec,
+                                          EquivalenceMember *em,
+                                          void *arg);
 
 static void create_cursor (ForeignScanState *node);
-static void fetch_more_data (ForeignScanState *node);
-static const char *pgcass_transferValue (char* buf, const CassValue* value);
-static HeapTuple make_tuple_from_result_row (const CassRow* row,
-                                             int ncolumn,
-                                             Relation rel,
-                                             AttInMetadata *attinmeta,
-                                             List *retrieved_attrs,
-                                             MemoryContext temp_context);
+static void cassRegisterScan (CassFdwScanState *fsstate);
+static void cassUnregisterScan (CassFdwScanState *fsstate);
+static void cassReleaseScans (ResourceReleasePhase phase, bool isCommit,
+                              bool isTopLevel, void *arg);
+static void cassReleaseScanHandles (CassFdwScanState *fsstate);
+static void start_stream (CassFdwScanState *fsstate, CassScanStream *stream,
+                          int range);
+static void close_cursor (CassFdwScanState *fsstate);
+static bool next_result_row (CassFdwScanState *fsstate, TupleTableSlot *slot);
+static bool next_counted_row (CassFdwScanState *fsstate, TupleTableSlot *slot);
+static char *pgcass_datum_bytes (Datum *value, int16 typlen, bool typbyval,
+                                 int *len);
+static int pgcass_key_cmp (const void *a, const void *b);
+static void build_key_list (CassFdwScanState *fsstate);
+static void lookup_cache_key (CassFdwScanState *fsstate);
+static CassLookupCacheEntry *lookup_cache_find (CassFdwScanState *fsstate);
+static CassLookupCacheEntry *lookup_cache_start (CassFdwScanState *fsstate);
+static void lookup_cache_add (CassFdwScanState *fsstate, TupleTableSlot *slot);
+static bool launch_scan_workers (CassFdwScanState *fsstate);
+static bool receive_worker_tuple (CassFdwScanState *fsstate,
+                                  TupleTableSlot *slot);
+static void shutdown_scan_workers (CassFdwScanState *fsstate);
+static void fetch_more_data (CassFdwScanState *fsstate);
+static void pgcass_init_decoders (CassFdwScanState *fsstate,
+                                  const CassResult *res);
+static bool pgcass_is_bindable_type (Oid pgtype);
+static bool cassIsKeyValueType (Oid valtype, Oid coltype);
+static bool cassValueFitsType (Datum value, Oid valtype, Oid coltype);
+static bool pgcass_get_int64 (Datum value, Oid pgtype, int64 *result);
+static void pgcass_int_out_of_range (int64 v, size_t index);
+static CassError pgcass_bind_as (CassStatement *statement, size_t index,
+                                 Datum value, Oid pgtype,
+                                 CassValueType cass_type);
+static CassError pgcass_bind_native (CassStatement *statement, size_t index,
+                                     Datum value, Oid pgtype);
+static void store_result_row_in_slot (const CassRow* row,
+                                      int ncolumn,
+                                      TupleTableSlot *slot,
+                                      AttInMetadata *attinmeta,
+                                      CassValueDecoder *decoders,
+                                      List *retrieved_attrs,
+                                      MemoryContext temp_context);
 
 void deparseSelectSql (StringInfo buf,
                        PlannerInfo *root,
                        RelOptInfo *baserel,
                        Bitmapset *attrs_used,
-                       List **retrieved_attrs);
+                       List **retrieved_attrs,
+                       bool count_only);
+
+static void deparseTokenRange (StringInfo buf, List *partition_key);
+static void deparseWhereClause (StringInfo buf,
+                                PlannerInfo *root,
+                                RelOptInfo *baserel,
+                                bool key_complete,
+                                bool *has_where,
+                                List **remote_conds,
+                                List **params,
+                                List **param_coltypes);
 
 
 static void deparseTargetList (StringInfo buf,
@@ -269,10 +680,74 @@ static void deparseTargetList (StringInfo buf,
 static void deparseColumnRef (StringInfo buf, int varno, int varattno,
                               PlannerInfo *root);
 
-static char* processWhereClause (Expr *expr, RelOptInfo *baserel, PlannerInfo *root, char ** columns, int columns_count);
+static char* processWhereClause (Expr *expr, RelOptInfo *baserel, PlannerInfo *root, List *columns,
+                                 List **params);
+
+static char *processInList (ScalarArrayOpExpr *saop, RelOptInfo *baserel,
+                            PlannerInfo *root, AttrNumber in_attnum,
+                            List **params);
+
+static bool cassIsRuntimeValue (Expr *expr);
+static bool cassGetValueRestriction (Expr *clause, RelOptInfo *baserel,
+                                     AttrNumber *attnum, const char **opname,
+                                     Expr **value);
+static AttrNumber cassGetSliceColumn (CassFdwPlanState *fpinfo,
+                                      Bitmapset *eq_attrs);
+static bool cassIsQueryableColumn (CassFdwPlanState *fpinfo,
+                                   AttrNumber attnum);
+static Bitmapset *cassGetFixedKeyAttrs (RelOptInfo *baserel,
+                                        CassFdwPlanState *fpinfo);
+static Bitmapset *cassGetFixedAttrs (RelOptInfo *baserel,
+                                     CassFdwPlanState *fpinfo);
+static bool cassIsOrderedType (Oid type);
+static bool cassMatchClusteringOrder (RelOptInfo *baserel,
+                                      CassFdwPlanState *fpinfo,
+                                      List *pathkeys, bool *reversed);
+static bool cassIsKeyListClause (RelOptInfo *baserel,
+                                 CassFdwPlanState *fpinfo,
+                                 Expr *clause,
+                                 AttrNumber *attnum, Expr **array);
+static bool deparseRangeBound (StringInfo buf, Expr *value, bool upper,
+                               List **params);
+static bool cassIsExactType (Oid type);
 
 static char* datumToString (Datum datum, Oid type);
 
+/*
+ * Module load callback
+ */
+void
+_PG_init (void)
+{
+  DefineCustomStringVariable ("cassandra2_fdw.prewarm_servers",
+                              "Foreign servers to connect to as soon as a session starts.",
+                              "A comma-separated list of names of servers; those the session's database doesn't have are skipped.",
+                              &prewarm_servers,
+                              "",
+                              PGC_USERSET,
+                              GUC_LIST_INPUT | GUC_LIST_QUOTE,
+                              cassCheckPrewarmServers, NULL, NULL);
+
+  pgcass_InitBroker ();
+
+  /*
+   * The postmaster mustn't connect: the driver's I/O threads don't survive
+   * fork.  A backend started from it connects while analyzing its first
+   * statement instead, which for a pooled connection is usually the
+   * pooler's check or connect query.  Loaded through
+   * session_preload_libraries, before the session's first transaction,
+   * connect right away.  Loaded on first use, we are in the middle of
+   * planning a query, which will connect to what it needs anyway.
+   */
+  if (process_shared_preload_libraries_in_progress)
+    {
+      prev_post_parse_analyze_hook = post_parse_analyze_hook;
+      post_parse_analyze_hook = cassPrewarmPostParseAnalyze;
+    }
+  else if (OidIsValid (MyDatabaseId) && !IsTransactionState ())
+    cassPrewarmConfiguredServers ();
+}
+
 /*
  * Foreign-data wrapper handler function: return a struct with pointers
  * to my callback routines.
@@ -291,11 +766,170 @@ cassandra2_fdw_handler (PG_FUNCTION_ARGS)
   fdwroutine->IterateForeignScan = cassIterateForeignScan;
   fdwroutine->ReScanForeignScan = cassReScanForeignScan;
   fdwroutine->EndForeignScan = cassEndForeignScan;
-  fdwroutine->AnalyzeForeignTable = NULL;
+  fdwroutine->AnalyzeForeignTable = cassAnalyzeForeignTable;
 
   PG_RETURN_POINTER (fdwroutine);
 }
 
+/*
+ * Connect to a foreign server now, with the current user's mapping, so
+ * that the session's first query doesn't pay for it.  Does nothing if
+ * there is a connection already.
+ */
+Datum
+cassandra2_fdw_prewarm (PG_FUNCTION_ARGS)
+{
+  cassPrewarmServer (text_to_cstring (PG_GETARG_TEXT_PP (0)), false);
+
+  PG_RETURN_VOID ();
+}
+
+/*
+ * Check that cassandra2_fdw.prewarm_servers is a list of names.
+ */
+static bool
+cassCheckPrewarmServers (char **newval, void **extra, GucSource source)
+{
+  char *rawstring = pstrdup (*newval);
+  List *names;
+  bool ok;
+
+  ok = SplitIdentifierString (rawstring, ',', &names);
+  if (!ok)
+    GUC_check_errdetail ("List syntax is invalid.");
+
+  list_free (names);
+  pfree (rawstring);
+  return ok;
+}
+
+static void
+cassPrewarmPostParseAnalyze (ParseState *pstate, Query *query)
+{
+  if (prev_post_parse_analyze_hook)
+    prev_post_parse_analyze_hook (pstate, query);
+
+  if (!prewarm_done && IsTransactionState ())
+    cassPrewarmConfiguredServers ();
+}
+
+/*
+ * Connect to the servers named in cassandra2_fdw.prewarm_servers, once per
+ * backend.  Server names are looked up in the session's database, and a
+ * list set for all databases may name servers of others: a server that
+ * doesn't exist is skipped.  One that can't be connected to only draws a
+ * warning: the session may not even need it, and a query that does will
+ * report the problem again.  Each server gets a subtransaction of its own,
+ * so that a failure doesn't abort the transaction we run in, or need one.
+ */
+static void
+cassPrewarmConfiguredServers (void)
+{
+  MemoryContext oldcontext = CurrentMemoryContext;
+  bool own_xact = false;
+  char *rawstring;
+  List *names;
+  ListCell *lc;
+
+  prewarm_done = true;
+  if (prewarm_servers == NULL || prewarm_servers[0] == '\0')
+    return;
+
+  /* With brokers running the scans, our own sessions would sit idle. */
+  if (pgcass_BrokerAvailable ())
+    return;
+
+  /* The check hook has seen to it that this succeeds. */
+  rawstring = pstrdup (prewarm_servers);
+  if (!SplitIdentifierString (rawstring, ',', &names))
+    return;
+
+  if (!IsTransactionState ())
+    {
+      StartTransactionCommand ();
+      own_xact = true;
+    }
+
+  foreach (lc, names)
+  {
+    const char *servername = (const char *) lfirst (lc);
+    MemoryContext xactcontext = CurrentMemoryContext;
+    ResourceOwner oldowner = CurrentResourceOwner;
+
+    BeginInternalSubTransaction (NULL);
+    MemoryContextSwitchTo (xactcontext);
+
+    PG_TRY ();
+    {
+      cassPrewarmServer (servername, true);
+
+      ReleaseCurrentSubTransaction ();
+      MemoryContextSwitchTo (xactcontext);
+      CurrentResourceOwner = oldowner;
+    }
+    PG_CATCH ();
+    {
+      ErrorData *edata;
+
+      MemoryContextSwitchTo (xactcontext);
+      edata = CopyErrorData ();
+      FlushErrorState ();
+
+      RollbackAndReleaseCurrentSubTransaction ();
+      MemoryContextSwitchTo (xactcontext);
+      CurrentResourceOwner = oldowner;
+
+      ereport (WARNING,
+               (errcode (ERRCODE_WARNING),
+                errmsg ("could not prewarm connection to server \"%s\": %s",
+                        servername, edata->message)));
+      FreeErrorData (edata);
+    }
+    PG_END_TRY ();
+  }
+
+  if (own_xact)
+    CommitTransactionCommand ();
+
+  MemoryContextSwitchTo (oldcontext);
+  list_free (names);
+  pfree (rawstring);
+}
+
+/*
+ * Connect to a server by name, as the current user.  If missing_ok, a
+ * server that doesn't exist is skipped.
+ */
+static void
+cassPrewarmServer (const char *servername, bool missing_ok)
+{
+  ForeignServer *server = GetForeignServerByName (servername, missing_ok);
+  ForeignDataWrapper *fdw;
+  UserMapping *user;
+  AclResult aclresult;
+
+  if (server == NULL)
+    return;
+
+  fdw = GetForeignDataWrapper (server->fdwid);
+
+  /* Another wrapper's server has no business in our connection cache. */
+  if (!OidIsValid (fdw->fdwhandler) ||
+      GetFdwRoutine (fdw->fdwhandler)->BeginForeignScan != cassBeginForeignScan)
+    ereport (ERROR,
+             (errcode (ERRCODE_WRONG_OBJECT_TYPE),
+              errmsg ("server \"%s\" does not use cassandra2_fdw",
+                      servername)));
+
+  aclresult = pg_foreign_server_aclcheck (server->serverid, GetUserId (),
+                                          ACL_USAGE);
+  if (aclresult != ACLCHECK_OK)
+    aclcheck_error (aclresult, ACL_KIND_FOREIGN_SERVER, server->servername);
+
+  user = GetUserMapping (GetUserId (), server->serverid);
+  pgcass_GetConnection (server, user, false);
+}
+
 /*
  * Validate the generic options given to a FOREIGN DATA WRAPPER, SERVER,
  * USER MAPPING or FOREIGN TABLE that uses file_fdw.
@@ -314,6 +948,17 @@ cassandra2_fdw_validator (PG_FUNCTION_ARGS)
   char *svr_table = NULL;
   int svr_querytimeout = 0;
   int svr_portNumber = 0;
+  int svr_fetchSize = 0;
+  int svr_scanParallelism = 0;
+  int svr_parallelWorkers = 0;
+  bool svr_useRemoteEstimate = false;
+  List *svr_clusterOptions = NIL;
+  char *svr_localDc = NULL;
+  bool svr_remoteDcOptions = false;
+  double svr_latencyExclusionThreshold = 0;
+  char *svr_partitionKey = NULL;
+  char *svr_clusteringColumns = NULL;
+  char *svr_clusteringOrder = NULL;
   ListCell *cell;
 
   /*
@@ -364,7 +1009,7 @@ cassandra2_fdw_validator (PG_FUNCTION_ARGS)
           ereport (ERROR,
                    (errcode (ERRCODE_SYNTAX_ERROR),
                     errmsg ("conflicting or redundant options")));
-        svr_querytimeout = atoi (defGetString (def));
+        svr_querytimeout = cassGetPositiveIntOption (def);
       }
     else if (strcmp (def->defname, "portNumber") == 0)
       {
@@ -372,7 +1017,59 @@ cassandra2_fdw_validator (PG_FUNCTION_ARGS)
           ereport (ERROR,
                    (errcode (ERRCODE_SYNTAX_ERROR),
                     errmsg ("conflicting or redundant options")));
-        svr_portNumber = atoi (defGetString (def));
+        svr_portNumber = cassGetPositiveIntOption (def);
+      }
+    else if (cassIsClusterOption (cluster_int_options, def->defname) ||
+             cassIsClusterOption (cluster_bool_options, def->defname))
+      {
+        ListCell *lc;
+
+        foreach (lc, svr_clusterOptions)
+        {
+          if (strcmp (strVal (lfirst (lc)), def->defname) == 0)
+            ereport (ERROR,
+                     (errcode (ERRCODE_SYNTAX_ERROR),
+                      errmsg ("conflicting or redundant options")));
+        }
+
+        /* just check the value is valid; a keepalive delay of 0 disables it */
+        if (strcmp (def->defname, "tcp_keepalive") == 0)
+          (void) cassGetNonNegativeIntOption (def);
+        else if (cassIsClusterOption (cluster_int_options, def->defname))
+          (void) cassGetPositiveIntOption (def);
+        else
+          (void) defGetBoolean (def);
+        svr_clusterOptions = lappend (svr_clusterOptions,
+                                      makeString (def->defname));
+
+        if (strcmp (def->defname, "used_hosts_per_remote_dc") == 0 ||
+            strcmp (def->defname, "allow_remote_dcs_for_local_cl") == 0)
+          svr_remoteDcOptions = true;
+      }
+    else if (strcmp (def->defname, "local_dc") == 0)
+      {
+        if (svr_localDc)
+          ereport (ERROR,
+                   (errcode (ERRCODE_SYNTAX_ERROR),
+                    errmsg ("conflicting or redundant options")));
+
+        svr_localDc = defGetString (def);
+      }
+    else if (strcmp (def->defname, "latency_exclusion_threshold") == 0)
+      {
+        char *endptr;
+
+        if (svr_latencyExclusionThreshold)
+          ereport (ERROR,
+                   (errcode (ERRCODE_SYNTAX_ERROR),
+                    errmsg ("conflicting or redundant options")));
+
+        svr_latencyExclusionThreshold = strtod (defGetString (def), &endptr);
+        if (*endptr != '\0' || !(svr_latencyExclusionThreshold >= 1.0))
+          ereport (ERROR,
+                   (errcode (ERRCODE_INVALID_PARAMETER_VALUE),
+                    errmsg ("%s requires a numeric value of at least 1",
+                            def->defname)));
       }
     else if (strcmp (def->defname, "username") == 0)
       {
@@ -409,6 +1106,74 @@ cassandra2_fdw_validator (PG_FUNCTION_ARGS)
 
         svr_table = defGetString (def);
       }
+    else if (strcmp (def->defname, "fetch_size") == 0)
+      {
+        if (svr_fetchSize)
+          ereport (ERROR,
+                   (errcode (ERRCODE_SYNTAX_ERROR),
+                    errmsg ("conflicting or redundant options")));
+
+        svr_fetchSize = cassGetPositiveIntOption (def);
+      }
+    else if (strcmp (def->defname, "use_remote_estimate") == 0)
+      {
+        if (svr_useRemoteEstimate)
+          ereport (ERROR,
+                   (errcode (ERRCODE_SYNTAX_ERROR),
+                    errmsg ("conflicting or redundant options")));
+
+        /* just check the value is a valid boolean */
+        (void) defGetBoolean (def);
+        svr_useRemoteEstimate = true;
+      }
+    else if (strcmp (def->defname, "scan_parallelism") == 0)
+      {
+        if (svr_scanParallelism)
+          ereport (ERROR,
+                   (errcode (ERRCODE_SYNTAX_ERROR),
+                    errmsg ("conflicting or redundant options")));
+
+        svr_scanParallelism = cassGetPositiveIntOption (def);
+      }
+    else if (strcmp (def->defname, "parallel_workers") == 0)
+      {
+        if (svr_parallelWorkers)
+          ereport (ERROR,
+                   (errcode (ERRCODE_SYNTAX_ERROR),
+                    errmsg ("conflicting or redundant options")));
+
+        svr_parallelWorkers = cassGetPositiveIntOption (def);
+      }
+    else if (strcmp (def->defname, "partition_key") == 0)
+      {
+        if (svr_partitionKey)
+          ereport (ERROR,
+                   (errcode (ERRCODE_SYNTAX_ERROR),
+                    errmsg ("conflicting or redundant options")));
+
+        svr_partitionKey = defGetString (def);
+        (void) cassParseColumnList (svr_partitionKey, def->defname);
+      }
+    else if (strcmp (def->defname, "clustering_columns") == 0)
+      {
+        if (svr_clusteringColumns)
+          ereport (ERROR,
+                   (errcode (ERRCODE_SYNTAX_ERROR),
+                    errmsg ("conflicting or redundant options")));
+
+        svr_clusteringColumns = defGetString (def);
+        (void) cassParseColumnList (svr_clusteringColumns, def->defname);
+      }
+    else if (strcmp (def->defname, "clustering_order") == 0)
+      {
+        if (svr_clusteringOrder)
+          ereport (ERROR,
+                   (errcode (ERRCODE_SYNTAX_ERROR),
+                    errmsg ("conflicting or redundant options")));
+
+        svr_clusteringOrder = defGetString (def);
+        (void) cassParseClusteringOrder (svr_clusteringOrder);
+      }
   }
 
   if (catalog == ForeignServerRelationId && svr_url == NULL)
@@ -416,6 +1181,24 @@ cassandra2_fdw_validator (PG_FUNCTION_ARGS)
              (errcode (ERRCODE_SYNTAX_ERROR),
               errmsg ("URL must be specified")));
 
+  if (svr_remoteDcOptions && svr_localDc == NULL)
+    ereport (ERROR,
+             (errcode (ERRCODE_SYNTAX_ERROR),
+              errmsg ("local_dc must be specified to use remote data centers")));
+
+  /* querytimeout is the old name of request_timeout. */
+  if (svr_querytimeout)
+    {
+      foreach (cell, svr_clusterOptions)
+      {
+        if (strcmp (strVal (lfirst (cell)), "request_timeout") == 0)
+          ereport (ERROR,
+                   (errcode (ERRCODE_SYNTAX_ERROR),
+                    errmsg ("conflicting or redundant options"),
+                    errdetail ("querytimeout and request_timeout set the same timeout.")));
+      }
+    }
+
   if (catalog == ForeignTableRelationId &&
       svr_table == NULL)
     ereport (ERROR,
@@ -443,91 +1226,337 @@ cassIsValidOption (const char *option, Oid context)
 }
 
 /*
- * Fetch the options for a fdw foreign table.
+ * Parse the value of an option that must be a positive integer.
  */
-static void
-cassGetOptions (Oid foreigntableid, char **url, int *querytimeout, int *portNumber,
-                char **username, char **password, char **queryableColumns, char **tablename)
+static int
+cassGetPositiveIntOption (DefElem *def)
 {
-  ForeignTable *table;
-  ForeignServer *server;
-  UserMapping *user;
-  List *options;
-  ListCell *lc;
-
-  /*
-   * Extract options from FDW objects.
-   */
-  table = GetForeignTable (foreigntableid);
-  server = GetForeignServer (table->serverid);
-  user = GetUserMapping (GetUserId (), server->serverid);
-
-  options = NIL;
-  options = list_concat (options, table->options);
-  options = list_concat (options, server->options);
-  options = list_concat (options, user->options);
+  char *endptr;
+  long val;
 
-  /* Loop through the options, and get the server/port */
-  foreach (lc, options)
-  {
-    DefElem *def = (DefElem *) lfirst (lc);
+  val = strtol (defGetString (def), &endptr, 10);
+  if (*endptr != '\0' || val <= 0 || val > INT_MAX)
+    ereport (ERROR,
+             (errcode (ERRCODE_INVALID_PARAMETER_VALUE),
+              errmsg ("%s requires a positive integer value",
+                      def->defname)));
 
-    if (strcmp (def->defname, "username") == 0)
-      {
-        *username = defGetString (def);
-      }
-    else if (strcmp (def->defname, "querytimeout") == 0)
-      {
-        *querytimeout = atoi (defGetString (def));
-      }
-    else if (strcmp (def->defname, "portNumber") == 0)
-      {
-        *portNumber = atoi (defGetString (def));
-      }
-    else if (strcmp (def->defname, "password") == 0)
-      {
-        *password = defGetString (def);
-      }
-    else if (strcmp (def->defname, "queryable_columns") == 0)
-      {
-        *queryableColumns = defGetString (def);
-      }
-    else if (strcmp (def->defname, "table") == 0)
-      {
-        *tablename = defGetString (def);
-      }
-    else if (strcmp (def->defname, "url") == 0)
-      {
-        *url = defGetString (def);
-      }
-  }
+  return (int) val;
 }
 
-//#if (PG_VERSION_NUM >= 90200)
-
 /*
- * cassGetForeignRelSize
- *		Obtain relation size estimates for a foreign table
+ * Parse the value of an option that must be a non-negative integer.
  */
-static void
+static int
+cassGetNonNegativeIntOption (DefElem *def)
+{
+  char *endptr;
+  long val;
+
+  val = strtol (defGetString (def), &endptr, 10);
+  if (*endptr != '\0' || val < 0 || val > INT_MAX)
+    ereport (ERROR,
+             (errcode (ERRCODE_INVALID_PARAMETER_VALUE),
+              errmsg ("%s requires a non-negative integer value",
+                      def->defname)));
+
+  return (int) val;
+}
+
+/*
+ * Check if the option is one of the given driver options.
+ */
+static bool
+cassIsClusterOption (const char *const *options, const char *option)
+{
+  const char *const *opt;
+
+  for (opt = options; *opt; opt++)
+    {
+      if (strcmp (*opt, option) == 0)
+        return true;
+    }
+
+  return false;
+}
+
+/*
+ * Return the value of a foreign table option, or NULL if it is not set.
+ */
+static char *
+cassGetTableOption (ForeignTable *table, const char *optname)
+{
+  ListCell *lc;
+
+  foreach (lc, table->options)
+  {
+    DefElem *def = (DefElem *) lfirst (lc);
+
+    if (strcmp (def->defname, optname) == 0)
+      return defGetString (def);
+  }
+
+  return NULL;
+}
+
+/*
+ * Split a comma separated list of Cassandra column names into a List of
+ * String nodes.  Names follow identifier rules: unquoted names are folded
+ * to lower case, as Cassandra does.
+ */
+static List *
+cassParseColumnList (const char *str, const char *optname)
+{
+  List *names;
+  List *result = NIL;
+  ListCell *lc;
+
+  if (!SplitIdentifierString (pstrdup (str), ',', &names))
+    ereport (ERROR,
+             (errcode (ERRCODE_INVALID_PARAMETER_VALUE),
+              errmsg ("invalid list syntax in option \"%s\"", optname)));
+
+  foreach (lc, names)
+    result = lappend (result, makeString ((char *) lfirst (lc)));
+
+  return result;
+}
+
+/*
+ * Parse the clustering_order option, a comma separated list of ASC or DESC
+ * for each clustering column, into a List of booleans (1 for DESC).
+ */
+static List *
+cassParseClusteringOrder (const char *str)
+{
+  List *result = NIL;
+  ListCell *lc;
+
+  foreach (lc, cassParseColumnList (str, "clustering_order"))
+  {
+    char *dir = strVal (lfirst (lc));
+
+    if (strcmp (dir, "asc") == 0)
+      result = lappend_int (result, 0);
+    else if (strcmp (dir, "desc") == 0)
+      result = lappend_int (result, 1);
+    else
+      ereport (ERROR,
+               (errcode (ERRCODE_INVALID_PARAMETER_VALUE),
+                errmsg ("invalid value \"%s\" in option \"clustering_order\"",
+                        dir),
+                errhint ("Valid values are ASC and DESC.")));
+  }
+
+  return result;
+}
+
+/*
+ * Map a list of Cassandra column names to the attribute numbers of the
+ * foreign table columns they are stored in, or InvalidAttrNumber for
+ * columns the foreign table doesn't have.
+ */
+static List *
+cassGetColumnAttrs (Oid relid, List *names)
+{
+  Relation rel;
+  TupleDesc tupdesc;
+  List *result = NIL;
+  ListCell *lc;
+
+  /* The planner already holds a lock on the foreign table. */
+  rel = heap_open (relid, NoLock);
+  tupdesc = RelationGetDescr (rel);
+
+  foreach (lc, names)
+  {
+    AttrNumber attnum = InvalidAttrNumber;
+    int i;
+
+    for (i = 1; i <= tupdesc->natts; i++)
+      {
+        if (tupdesc->attrs[i - 1]->attisdropped)
+          continue;
+        if (strcmp (cassGetColumnName (relid, i), strVal (lfirst (lc))) == 0)
+          {
+            attnum = i;
+            break;
+          }
+      }
+    result = lappend_int (result, attnum);
+  }
+
+  heap_close (rel, NoLock);
+
+  return result;
+}
+
+/*
+ * Determine the page size to use for scans of a foreign table.  A table-level
+ * fetch_size overrides the server-level one.
+ */
+static int
+cassGetFetchSize (ForeignTable *table, ForeignServer *server)
+{
+  int fetch_size = DEFAULT_FDW_FETCH_SIZE;
+  ListCell *lc;
+
+  foreach (lc, server->options)
+  {
+    DefElem *def = (DefElem *) lfirst (lc);
+
+    if (strcmp (def->defname, "fetch_size") == 0)
+      fetch_size = atoi (defGetString (def));
+  }
+
+  foreach (lc, table->options)
+  {
+    DefElem *def = (DefElem *) lfirst (lc);
+
+    if (strcmp (def->defname, "fetch_size") == 0)
+      fetch_size = atoi (defGetString (def));
+  }
+
+  return fetch_size;
+}
+
+/*
+ * Determine whether to plan scans of a foreign table with Cassandra's own
+ * size estimates.  A table-level use_remote_estimate overrides the
+ * server-level one.
+ */
+static bool
+cassGetUseRemoteEstimate (ForeignTable *table, ForeignServer *server)
+{
+  bool use_remote_estimate = false;
+  ListCell *lc;
+
+  foreach (lc, server->options)
+  {
+    DefElem *def = (DefElem *) lfirst (lc);
+
+    if (strcmp (def->defname, "use_remote_estimate") == 0)
+      use_remote_estimate = defGetBoolean (def);
+  }
+
+  foreach (lc, table->options)
+  {
+    DefElem *def = (DefElem *) lfirst (lc);
+
+    if (strcmp (def->defname, "use_remote_estimate") == 0)
+      use_remote_estimate = defGetBoolean (def);
+  }
+
+  return use_remote_estimate;
+}
+
+//#if (PG_VERSION_NUM >= 90200)
+
+/*
+ * cassGetForeignRelSize
+ *		Obtain relation size estimates for a foreign table
+ */
+static void
 cassGetForeignRelSize (PlannerInfo *root,
                        RelOptInfo *baserel,
                        Oid foreigntableid)
 {
   CassFdwPlanState *fpinfo;
+  ForeignTable *table;
+  ForeignServer *server;
 
   fpinfo = (CassFdwPlanState *) palloc0 (sizeof (CassFdwPlanState));
   baserel->fdw_private = (void *) fpinfo;
+  fpinfo->relid = foreigntableid;
 
   fpinfo->attrs_used = NULL;
   pull_varattnos ((Node *) baserel->reltargetlist, baserel->relid,
                   &fpinfo->attrs_used);
 
-  //TODO
   /* Fetch options  */
+  table = GetForeignTable (foreigntableid);
+  server = GetForeignServer (table->serverid);
+  fpinfo->fetch_size = cassGetFetchSize (table, server);
+  fpinfo->use_remote_estimate = cassGetUseRemoteEstimate (table, server);
+
+  {
+    char *partition_key = cassGetTableOption (table, "partition_key");
+    char *clustering_columns = cassGetTableOption (table, "clustering_columns");
+    char *clustering_order = cassGetTableOption (table, "clustering_order");
+    char *queryable_columns = cassGetTableOption (table, "queryable_columns");
+    char *scan_parallelism = cassGetTableOption (table, "scan_parallelism");
+    char *parallel_workers = cassGetTableOption (table, "parallel_workers");
+    CassTableKeys *keys = NULL;
+
+    /*
+     * Key columns not given by options are read from the Cassandra table's
+     * schema, when the table option names its keyspace.  That takes a
+     * session of the backend's own, which brokers are there to spare it;
+     * with brokers running, only the options count.
+     */
+    if ((partition_key == NULL || clustering_columns == NULL) &&
+        !pgcass_BrokerAvailable ())
+      keys = pgcass_GetTableKeys (foreigntableid);
+
+    if (partition_key)
+      fpinfo->partition_key = cassParseColumnList (partition_key,
+                                                   "partition_key");
+    else if (keys)
+      fpinfo->partition_key = copyObject (keys->partition_key);
+    if (clustering_columns)
+      fpinfo->clustering_columns = cassParseColumnList (clustering_columns,
+                                                        "clustering_columns");
+    else if (keys)
+      fpinfo->clustering_columns = copyObject (keys->clustering_columns);
+    fpinfo->partition_key_attrs = cassGetColumnAttrs (foreigntableid,
+                                                      fpinfo->partition_key);
+    fpinfo->clustering_attrs = cassGetColumnAttrs (foreigntableid,
+                                                   fpinfo->clustering_columns);
+
+    /* Clustering columns not mentioned in clustering_order are ASC. */
+    if (clustering_order)
+      fpinfo->clustering_desc = cassParseClusteringOrder (clustering_order);
+    else if (keys && clustering_columns == NULL)
+      fpinfo->clustering_desc = list_copy (keys->clustering_desc);
+    while (list_length (fpinfo->clustering_desc) <
+           list_length (fpinfo->clustering_columns))
+      fpinfo->clustering_desc = lappend_int (fpinfo->clustering_desc, 0);
+    if (queryable_columns)
+      fpinfo->queryable_columns = cassParseColumnList (queryable_columns,
+                                                       "queryable_columns");
+    fpinfo->scan_parallelism = scan_parallelism ? atoi (scan_parallelism) : 1;
+    fpinfo->parallel_workers = parallel_workers ? atoi (parallel_workers) : 0;
+  }
 
   /* Estimate relation size */
   {
+    double partitions;
+    double partition_size;
+
+    /*
+     * If allowed, take the table's size from the estimates Cassandra keeps
+     * of it: the number of partitions, and their mean size, which divided
+     * by the width of a row gives the rows of a partition.  Like the keys,
+     * they aren't read when brokers run the scans.
+     */
+    if (fpinfo->use_remote_estimate && !pgcass_BrokerAvailable () &&
+        pgcass_GetSizeEstimates (foreigntableid, &partitions, &partition_size))
+      {
+        int32 row_size = get_relation_data_width (foreigntableid, NULL) +
+                CASS_ROW_OVERHEAD;
+
+        fpinfo->have_remote_estimate = true;
+        if (fpinfo->clustering_columns == NIL)
+          fpinfo->rows_per_partition = 1;
+        else
+          fpinfo->rows_per_partition = Max (1, rint (partition_size /
+                                                     row_size));
+
+        baserel->tuples = Max (1, rint (partitions *
+                                        fpinfo->rows_per_partition));
+        baserel->pages = Max (1, ceil (partitions * partition_size / BLCKSZ));
+      }
+
     /*
      * If the foreign table has never been ANALYZEd, it will have relpages
      * and reltuples equal to zero, which most likely has nothing to do
@@ -537,7 +1566,7 @@ cassGetForeignRelSize (PlannerInfo *root,
      * estimate of 10 pages, and divide by the column-datatype-based width
      * estimate to get the corresponding number of tuples.
      */
-    if (baserel->pages == 0 && baserel->tuples == 0)
+    else if (baserel->pages == 0 && baserel->tuples == 0)
       {
         baserel->pages = 10;
         baserel->tuples =
@@ -551,9 +1580,27 @@ cassGetForeignRelSize (PlannerInfo *root,
     estimate_path_cost_size (root, baserel, NIL,
                              &fpinfo->rows, &fpinfo->width,
                              &fpinfo->startup_cost, &fpinfo->total_cost);
+
+    /* The partitions a scan reads say more than local selectivities. */
+    if (fpinfo->have_remote_estimate)
+      baserel->rows = fpinfo->rows;
   }
 }
 
+/*
+ * estimate_path_cost_size
+ *		Get cost and size estimates for a foreign scan, restricted by the
+ *		given join clauses as well as the baserestrictinfo quals
+ *
+ * The scan costs a fixed round trip plus a share per row returned, so that
+ * a lookup by partition key that returns a few rows compares favourably
+ * with a scan of the whole table.
+ *
+ * With Cassandra's size estimates, a scan that names its partitions reads
+ * just those: one seek each, and the rows of the partitions that pass the
+ * other conditions.  Any other scan reads the whole table, whatever the
+ * conditions filter out of it.
+ */
 static void
 estimate_path_cost_size (PlannerInfo *root,
                          RelOptInfo *baserel,
@@ -561,11 +1608,132 @@ estimate_path_cost_size (PlannerInfo *root,
                          double *p_rows, int *p_width,
                          Cost *p_startup_cost, Cost *p_total_cost)
 {
-  *p_rows = baserel->rows;
+  CassFdwPlanState *fpinfo = (CassFdwPlanState *) baserel->fdw_private;
+  double rows = baserel->rows;
+  double npartitions = 0;
+
+  if (fpinfo->have_remote_estimate)
+    npartitions = cassCountKeyPartitions (baserel, fpinfo, join_conds);
+
+  if (npartitions > 0)
+    {
+      List *other_conds = NIL;
+      ListCell *lc;
+
+      /* Leave out the conditions that pick the partitions. */
+      foreach (lc, baserel->baserestrictinfo)
+      {
+        RestrictInfo *rinfo = (RestrictInfo *) lfirst (lc);
+        AttrNumber attnum;
+        Expr *value;
+
+        if (!cassIsKeyEqualityClause (baserel, fpinfo, rinfo->clause,
+                                      &attnum, &value) &&
+            !cassIsKeyListClause (baserel, fpinfo, rinfo->clause,
+                                  &attnum, &value))
+          other_conds = lappend (other_conds, rinfo);
+      }
+      foreach (lc, join_conds)
+      {
+        RestrictInfo *rinfo = (RestrictInfo *) lfirst (lc);
+
+        if (!cassIsKeyEqualityClause (baserel, fpinfo, rinfo->clause,
+                                      NULL, NULL))
+          other_conds = lappend (other_conds, rinfo);
+      }
+
+      rows = clamp_row_est (npartitions * fpinfo->rows_per_partition *
+                            clauselist_selectivity (root, other_conds,
+                                                    baserel->relid,
+                                                    JOIN_INNER,
+                                                    NULL));
+    }
+  else if (join_conds != NIL)
+    rows = clamp_row_est (rows * clauselist_selectivity (root, join_conds,
+                                                         baserel->relid,
+                                                         JOIN_INNER,
+                                                         NULL));
+
+  *p_rows = rows;
   *p_width = baserel->width;
 
   *p_startup_cost = DEFAULT_FDW_STARTUP_COST;
-  *p_total_cost = DEFAULT_FDW_TUPLE_COST * 100;
+  if (!fpinfo->have_remote_estimate)
+    *p_total_cost = *p_startup_cost +
+            (cpu_tuple_cost + DEFAULT_FDW_TUPLE_COST) * rows;
+  else if (npartitions > 0)
+    *p_total_cost = *p_startup_cost + random_page_cost * npartitions +
+            (cpu_tuple_cost + DEFAULT_FDW_TUPLE_COST) * rows;
+  else
+    *p_total_cost = *p_startup_cost + seq_page_cost * baserel->pages +
+            DEFAULT_FDW_TUPLE_COST * baserel->tuples +
+            cpu_tuple_cost * rows;
+}
+
+/*
+ * Estimate the number of partitions a scan reads, if it names them: 1 if
+ * every partition key column is compared for equality, by a constant
+ * restriction or one of join_conds, or the length of a list of values for
+ * the one remaining column.  Returns 0 for a scan of the whole table.
+ */
+static double
+cassCountKeyPartitions (RelOptInfo *baserel, CassFdwPlanState *fpinfo,
+                        List *join_conds)
+{
+  Bitmapset *bound = cassGetFixedKeyAttrs (baserel, fpinfo);
+  AttrNumber unbound = InvalidAttrNumber;
+  ListCell *lc;
+
+  if (fpinfo->partition_key_attrs == NIL)
+    return 0;
+
+  foreach (lc, join_conds)
+  {
+    RestrictInfo *rinfo = (RestrictInfo *) lfirst (lc);
+    AttrNumber attnum;
+
+    if (cassIsKeyEqualityClause (baserel, fpinfo, rinfo->clause,
+                                 &attnum, NULL))
+      bound = bms_add_member (bound, attnum);
+  }
+
+  foreach (lc, fpinfo->partition_key_attrs)
+  {
+    AttrNumber attnum = (AttrNumber) lfirst_int (lc);
+
+    if (bms_is_member (attnum, bound))
+      continue;
+    if (unbound != InvalidAttrNumber || attnum == InvalidAttrNumber)
+      return 0;
+    unbound = attnum;
+  }
+
+  if (unbound == InvalidAttrNumber)
+    return 1;
+
+  foreach (lc, baserel->baserestrictinfo)
+  {
+    RestrictInfo *rinfo = (RestrictInfo *) lfirst (lc);
+    AttrNumber attnum;
+    Expr *array;
+
+    if (!cassIsKeyListClause (baserel, fpinfo, rinfo->clause,
+                              &attnum, &array) ||
+        attnum != unbound)
+      continue;
+
+    if (IsA (array, Const) && !((Const *) array)->constisnull)
+      {
+        ArrayType *arr = DatumGetArrayTypeP (((Const *) array)->constvalue);
+
+        return Max (1, ArrayGetNItems (ARR_NDIM (arr), ARR_DIMS (arr)));
+      }
+    if (IsA (array, ArrayExpr))
+      return Max (1, list_length (((ArrayExpr *) array)->elements));
+    return CASS_KEY_LIST_GUESS;
+  }
+
+  return 0;
 }
 
 /*
@@ -588,7 +1756,7 @@ cassGetForeignPaths (PlannerInfo *root,
    * to estimate cost and size of this path.
    */
   path = create_foreignscan_path (root, baserel,
-                                  fpinfo->rows + baserel->rows,
+                                  fpinfo->rows,
                                   fpinfo->startup_cost,
                                   fpinfo->total_cost,
                                   NIL, /* no pathkeys */
@@ -596,448 +1764,2718 @@ cassGetForeignPaths (PlannerInfo *root,
                                   NIL); /* no fdw_private list */
   add_path (baserel, (Path *) path);
 
-  //TODO
-}
+  /*
+   * Within a partition, Cassandra returns rows in clustering order, or in
+   * reverse if asked to.  If the scan reads a single partition, and the
+   * query wants its rows in one of those orders, add a path that is
+   * sorted already, so that no local Sort is needed and a LIMIT can stop
+   * the scan early.
+   */
+  if (root->query_pathkeys != NIL &&
+      fpinfo->partition_key_attrs != NIL &&
+      fpinfo->clustering_attrs != NIL)
+    {
+      Bitmapset *fixed = cassGetFixedKeyAttrs (baserel, fpinfo);
+      bool single_partition = true;
+      bool reversed;
+      ListCell *lc;
 
-/*
- * cassGetForeignPlan
- *		Create ForeignScan plan node which implements selected best path
- */
-static ForeignScan *
-cassGetForeignPlan (PlannerInfo *root,
-                    RelOptInfo *baserel,
-                    Oid foreigntableid,
-                    ForeignPath *best_path,
-                    List *tlist,
-                    List *scan_clauses)
-{
-  CassFdwPlanState *fpinfo = (CassFdwPlanState *) baserel->fdw_private;
-  Index scan_relid = baserel->relid;
-  List *fdw_private;
-  List *local_exprs = NIL;
-  StringInfoData sql;
-  List *retrieved_attrs;
+      foreach (lc, fpinfo->partition_key_attrs)
+      {
+        if (!bms_is_member (lfirst_int (lc), fixed))
+          single_partition = false;
+      }
 
-  local_exprs = extract_actual_clauses (scan_clauses, false);
+      if (single_partition &&
+          cassMatchClusteringOrder (baserel, fpinfo, root->query_pathkeys,
+                                    &reversed))
+        {
+          path = create_foreignscan_path (root, baserel,
+                                          fpinfo->rows,
+                                          fpinfo->startup_cost,
+                                          fpinfo->total_cost,
+                                          root->query_pathkeys,
+                                          NULL, /* no outer rel either */
+                                          list_make1 (makeInteger (reversed)));
+          add_path (baserel, (Path *) path);
+        }
+    }
 
   /*
-   * Build the query string to be sent for execution, and identify
-   * expressions to be sent as parameters.
+   * Cassandra only finds rows cheaply by their partition key.  If join
+   * clauses can supply every partition key column that isn't already
+   * restricted to a constant, add a path parameterized by the outer
+   * relations supplying them: as the inner side of a nested loop, it turns
+   * into one partition lookup per outer row instead of a full scan whose
+   * rows are joined locally.
    */
-  initStringInfo (&sql);
-  deparseSelectSql (&sql, root, baserel, fpinfo->attrs_used,
-                    &retrieved_attrs);
+  if (fpinfo->partition_key_attrs != NIL)
+    {
+      List *join_clauses = NIL;
+      List *outer_relids = NIL;
+      Relids all_outer = NULL;
+      ListCell *lc;
 
-  /*
-   * Build the fdw_private list that will be available to the executor.
-   * Items in the list must match enum FdwScanPrivateIndex, above.
-   */
-  fdw_private = list_make2 (makeString (sql.data),
-                            retrieved_attrs);
+      /* Plain join clauses comparing a partition key column for equality. */
+      foreach (lc, baserel->joininfo)
+      {
+        RestrictInfo *rinfo = (RestrictInfo *) lfirst (lc);
 
-  /*
-   * Create the ForeignScan node from target list, local filtering
-   * expressions, remote parameter expressions, and FDW private information.
-   *
-   * Note that the remote parameter expressions are stored in the fdw_exprs
-   * field of the finished plan node; we can't keep them in private state
-   * because then they wouldn't be subject to later planner processing.
-   */
-  return make_foreignscan (tlist,
-                           local_exprs,
-                           scan_relid,
-                           NIL,
-                           fdw_private);
-}
+        if (join_clause_is_movable_to (rinfo, baserel->relid) &&
+            cassIsKeyEqualityClause (baserel, fpinfo, rinfo->clause,
+                                     NULL, NULL))
+          join_clauses = lappend (join_clauses, rinfo);
+      }
 
-/*
- * cassExplainForeignScan
- *		Produce extra output for EXPLAIN
- */
-static void
-cassExplainForeignScan (ForeignScanState *node, ExplainState *es)
-{
-  List *fdw_private;
-  char *sql;
-  if (es->verbose)
-    {
+      /* Equality clauses implied by equivalence classes. */
+      if (baserel->has_eclass_joins)
+        {
+          foreach (lc, fpinfo->partition_key_attrs)
+          {
+            AttrNumber attnum = (AttrNumber) lfirst_int (lc);
+            List *clauses;
+            ListCell *lc2;
+
+            if (attnum == InvalidAttrNumber)
+              continue;
+
+            clauses = generate_implied_equalities_for_column (root,
+                                                              baserel,
+                                                              ec_member_matches_key_column,
+                                                              (void *) &attnum,
+                                                              baserel->lateral_referencers);
+            foreach (lc2, clauses)
+            {
+              RestrictInfo *rinfo = (RestrictInfo *) lfirst (lc2);
 
-      //TODO
-      fdw_private = ((ForeignScan *) node->ss.ps.plan)->fdw_private;
-      sql = strVal (list_nth (fdw_private, CassFdwScanPrivateSelectSql));
-      ExplainPropertyText ("Remote SQL", sql, es);
+              if (join_clause_is_movable_to (rinfo, baserel->relid) &&
+                  cassIsKeyEqualityClause (baserel, fpinfo, rinfo->clause,
+                                           NULL, NULL))
+                join_clauses = lappend (join_clauses, rinfo);
+            }
+          }
+        }
+
+      /*
+       * Collect the distinct sets of outer relations the clauses need.  A
+       * multi-column partition key may take its columns from different
+       * relations, so try all of them together as well.
+       */
+      foreach (lc, join_clauses)
+      {
+        RestrictInfo *rinfo = (RestrictInfo *) lfirst (lc);
+        Relids required_outer;
+        ListCell *lc2;
+        bool found = false;
+
+        required_outer = bms_union (rinfo->clause_relids,
+                                    baserel->lateral_relids);
+        required_outer = bms_del_member (required_outer, baserel->relid);
+        if (bms_is_empty (required_outer))
+          continue;
+
+        foreach (lc2, outer_relids)
+        {
+          if (bms_equal (required_outer, (Relids) lfirst (lc2)))
+            {
+              found = true;
+              break;
+            }
+        }
+        if (!found)
+          {
+            outer_relids = lappend (outer_relids, required_outer);
+            all_outer = bms_union (all_outer, required_outer);
+          }
+      }
+      if (list_length (outer_relids) > 1)
+        outer_relids = lappend (outer_relids, all_outer);
+
+      foreach (lc, outer_relids)
+      {
+        Relids required_outer = (Relids) lfirst (lc);
+        ParamPathInfo *param_info;
+        double rows;
+        int width;
+        Cost startup_cost;
+        Cost total_cost;
+
+        param_info = get_baserel_parampathinfo (root, baserel, required_outer);
+
+        /* Without the whole partition key, it would be a full scan anyway. */
+        if (!cassKeyIsCovered (baserel, fpinfo, param_info->ppi_clauses))
+          continue;
+
+        estimate_path_cost_size (root, baserel, param_info->ppi_clauses,
+                                 &rows, &width,
+                                 &startup_cost, &total_cost);
+
+        path = create_foreignscan_path (root, baserel,
+                                        param_info->ppi_rows,
+                                        startup_cost,
+                                        total_cost,
+                                        NIL, /* no pathkeys */
+                                        required_outer,
+                                        NIL); /* no fdw_private list */
+        add_path (baserel, (Path *) path);
+      }
     }
 }
 
 /*
- * cassBeginForeignScan
- *		Initiate access to the database
+ * Check whether an expression is an equality between a partition key column
+ * of baserel and a value that can be bound to the remote query: one that
+ * doesn't depend on baserel, compared by the btree equality of the
+ * column type's default operator family.  The value may be of another type
+ * of the family, such as an integer compared with a bigint column, if
+ * cassIsKeyValueType says it converts.  If so, return the column's
+ * attribute number and the value's expression.
  */
-static void
-cassBeginForeignScan (ForeignScanState *node, int eflags)
+static bool
+cassIsKeyEqualityClause (RelOptInfo *baserel, CassFdwPlanState *fpinfo,
+                         Expr *clause, AttrNumber *attnum, Expr **value)
 {
-  ForeignScan *fsplan = (ForeignScan *) node->ss.ps.plan;
-  EState *estate = node->ss.ps.state;
-  CassFdwScanState *fsstate;
-  RangeTblEntry *rte;
-  Oid userid;
-  ForeignTable *table;
-  ForeignServer *server;
-  UserMapping *user;
+  OpExpr *op = (OpExpr *) clause;
+  Var *var;
+  Expr *other;
+  Oid opfamily;
 
-  /*
-   * Do nothing in EXPLAIN (no ANALYZE) case.  node->fdw_state stays NULL.
-   */
-  if (eflags & EXEC_FLAG_EXPLAIN_ONLY)
-    return;
+  if (!IsA (clause, OpExpr) || list_length (op->args) != 2)
+    return false;
 
-  /*
-   * We'll save private state in node->fdw_state.
-   */
-  fsstate = (CassFdwScanState *) palloc0 (sizeof (CassFdwScanState));
-  node->fdw_state = (void *) fsstate;
+  if (IsA (linitial (op->args), Var) &&
+      ((Var *) linitial (op->args))->varno == baserel->relid)
+    {
+      var = (Var *) linitial (op->args);
+      other = (Expr *) lsecond (op->args);
+    }
+  else if (IsA (lsecond (op->args), Var) &&
+           ((Var *) lsecond (op->args))->varno == baserel->relid)
+    {
+      var = (Var *) lsecond (op->args);
+      other = (Expr *) linitial (op->args);
+    }
+  else
+    return false;
+
+  if (var->varlevelsup != 0 ||
+      !list_member_int (fpinfo->partition_key_attrs, var->varattno) ||
+      var->varattno == InvalidAttrNumber)
+    return false;
+
+  opfamily = get_opclass_family (GetDefaultOpClass (var->vartype,
+                                                    BTREE_AM_OID));
+  if (!OidIsValid (opfamily) ||
+      get_op_opfamily_strategy (op->opno, opfamily) != BTEqualStrategyNumber)
+    return false;
+
+  if (!cassIsKeyValueType (exprType ((Node *) other), var->vartype) ||
+      bms_is_member (baserel->relid, pull_varnos ((Node *) other)) ||
+      contain_volatile_functions ((Node *) other))
+    return false;
+
+  if (attnum)
+    *attnum = var->varattno;
+  if (value)
+    *value = other;
+  return true;
+}
 
-  /*
-   * Identify which user to do the remote access as.  This should match what
-   * ExecCheckRTEPerms() does.
-   */
-  rte = rt_fetch (fsplan->scan.scanrelid, estate->es_range_table);
-  userid = rte->checkAsUser ? rte->checkAsUser : GetUserId ();
+/*
+ * Check whether a value of type valtype, compared for equality with a key
+ * column of type coltype, can be bound to a marker for the column and
+ * selects the same rows remotely.  Integers and floating point numbers
+ * convert to any width of their kind, and a date to the midnight of a
+ * timestamp; a timestamp with time zone compares with the others in local
+ * time, which a bound value doesn't.  An integer too wide for the column
+ * can't be bound, but can't equal any of its values either: the scan
+ * returns no rows for it, see cassValueFitsType.
+ */
+static bool
+cassIsKeyValueType (Oid valtype, Oid coltype)
+{
+  if (!pgcass_is_bindable_type (valtype) || !pgcass_is_bindable_type (coltype))
+    return false;
+  if (valtype == coltype)
+    return true;
 
-  /* Get info about foreign table. */
-  fsstate->rel = node->ss.ss_currentRelation;
-  table = GetForeignTable (RelationGetRelid (fsstate->rel));
-  server = GetForeignServer (table->serverid);
-  user = GetUserMapping (userid, server->serverid);
+  switch (coltype)
+    {
+    case INT2OID:
+    case INT4OID:
+    case INT8OID:
+      return valtype == INT2OID || valtype == INT4OID || valtype == INT8OID;
+    case FLOAT4OID:
+    case FLOAT8OID:
+      return valtype == FLOAT4OID || valtype == FLOAT8OID;
+    case TIMESTAMPOID:
+      return valtype == DATEOID;
+    default:
+      return false;
+    }
+}
 
-  /*
-   * Get connection to the foreign server.  Connection manager will
-   * establish new connection if necessary.
-   */
-  fsstate->cass_conn = pgcass_GetConnection (server, user, false);
-  fsstate->sql_sended = false;
+/*
+ * Check whether a value compared for equality with a column of type
+ * coltype is one the column can hold.  Only integers need checking; the
+ * other values cassIsKeyValueType accepts convert without loss of range.
+ */
+static bool
+cassValueFitsType (Datum value, Oid valtype, Oid coltype)
+{
+  int64 v;
 
-  {
-    char *query;
-    List *fdw_private;
+  switch (valtype)
+    {
+    case INT2OID:
+      v = DatumGetInt16 (value);
+      break;
+    case INT4OID:
+      v = DatumGetInt32 (value);
+      break;
+    case INT8OID:
+      v = DatumGetInt64 (value);
+      break;
+    default:
+      return true;
+    }
 
-    fdw_private = fsplan->fdw_private;
-    /* Get prepared query */
-    query = strVal (list_nth (fdw_private, CassFdwScanPrivateSelectSql));
+  switch (coltype)
+    {
+    case INT2OID:
+      return v >= SHRT_MIN && v <= SHRT_MAX;
+    case INT4OID:
+      return v >= INT_MIN && v <= INT_MAX;
+    default:
+      return true;
+    }
+}
 
-    ereport (WARNING,
-             (errcode (ERRCODE_WARNING),
-              errmsg ("Begin foreign scan with query: %s", query)));
+/*
+ * Check whether every partition key column is compared for equality, either
+ * with a constant in the pushed-down baserestrictinfo quals or by one of
+ * join_clauses.
+ */
+static bool
+cassKeyIsCovered (RelOptInfo *baserel, CassFdwPlanState *fpinfo,
+                  List *join_clauses)
+{
+  Bitmapset *bound = cassGetFixedKeyAttrs (baserel, fpinfo);
+  ListCell *lc;
 
-    elog (LOG, "Cass PUSDOWN Query = '%s'", query);
+  foreach (lc, join_clauses)
+  {
+    RestrictInfo *rinfo = (RestrictInfo *) lfirst (lc);
+    AttrNumber attnum;
 
-    fsstate->query = query;
+    if (cassIsKeyEqualityClause (baserel, fpinfo, rinfo->clause,
+                                 &attnum, NULL))
+      bound = bms_add_member (bound, attnum);
   }
 
-  /* Get private info created by planner functions. */
-  //	fsstate->query = strVal(list_nth(fsplan->fdw_private,
-  //									 CassFdwScanPrivateSelectSql));
-  fsstate->retrieved_attrs = (List *) list_nth (fsplan->fdw_private,
-                                                CassFdwScanPrivateRetrievedAttrs);
-
-  /* Create contexts for batches of tuples and per-tuple temp workspace. */
-  fsstate->batch_cxt = AllocSetContextCreate (estate->es_query_cxt,
-                                              "cassandra2_fdw tuple data",
-                                              ALLOCSET_DEFAULT_MINSIZE,
-                                              ALLOCSET_DEFAULT_INITSIZE,
-                                              ALLOCSET_DEFAULT_MAXSIZE);
-
-  fsstate->temp_cxt = AllocSetContextCreate (estate->es_query_cxt,
-                                             "cassandra2_fdw temporary data",
-                                             ALLOCSET_SMALL_MINSIZE,
-                                             ALLOCSET_SMALL_INITSIZE,
-                                             ALLOCSET_SMALL_MAXSIZE);
+  foreach (lc, fpinfo->partition_key_attrs)
+  {
+    if (!bms_is_member (lfirst_int (lc), bound))
+      return false;
+  }
 
-  /* Get info we'll need for input data conversion. */
-  fsstate->attinmeta = TupleDescGetAttInMetadata (RelationGetDescr (fsstate->rel));
+  return true;
 }
 
 /*
- * cassIterateForeignScan
- *		Read next record from the data file and store it into the
- *		ScanTupleSlot as a virtual tuple
+ * Return the partition key columns the pushed-down baserestrictinfo quals
+ * compare with a value that is constant for the scan.
  */
-static TupleTableSlot*
-cassIterateForeignScan (ForeignScanState *node)
+static Bitmapset *
+cassGetFixedKeyAttrs (RelOptInfo *baserel, CassFdwPlanState *fpinfo)
 {
-  CassFdwScanState *fsstate = (CassFdwScanState *) node->fdw_state;
-  TupleTableSlot *slot = node->ss.ss_ScanTupleSlot;
-
-  /*
-   * If this is the first call after Begin or ReScan, we need to create the
-   * cursor on the remote side.
-   */
-  if (!fsstate->sql_sended)
-    create_cursor (node);
-
-  /*
-   * Get some more tuples, if we've run out.
-   */
-  if (fsstate->next_tuple >= fsstate->num_tuples)
-    {
-      /* No point in another fetch if we already detected EOF, though. */
-      if (!fsstate->eof_reached)
-        fetch_more_data (node);
-      /* If we didn't get any tuples, must be end of data. */
-      if (fsstate->next_tuple >= fsstate->num_tuples)
-        return ExecClearTuple (slot);
-    }
+  Bitmapset *bound = NULL;
+  ListCell *lc;
 
-  /*
-   * Return the next tuple.
-   */
-  ExecStoreTuple (fsstate->tuples[fsstate->next_tuple++],
-                  slot,
-                  InvalidBuffer,
-                  false);
+  foreach (lc, baserel->baserestrictinfo)
+  {
+    RestrictInfo *rinfo = (RestrictInfo *) lfirst (lc);
+    AttrNumber attnum;
+    Expr *value;
+
+    if (cassIsKeyEqualityClause (baserel, fpinfo, rinfo->clause,
+                                 &attnum, &value) &&
+        cassIsRuntimeValue (value) &&
+        cassIsQueryableColumn (fpinfo, attnum))
+      bound = bms_add_member (bound, attnum);
+  }
 
-  return slot;
+  return bound;
 }
 
 /*
- * cassReScanForeignScan
- *		Rescan table, possibly with new parameters
+ * Return the columns the pushed-down baserestrictinfo quals compare with a
+ * value that is constant for the scan, for equality.
  */
-static void
-cassReScanForeignScan (ForeignScanState *node)
+static Bitmapset *
+cassGetFixedAttrs (RelOptInfo *baserel, CassFdwPlanState *fpinfo)
 {
-  CassFdwScanState *fsstate = (CassFdwScanState *) node->fdw_state;
-
-  /* If we haven't created the cursor yet, nothing to do. */
-  if (!fsstate->sql_sended)
-    return;
+  Bitmapset *fixed = NULL;
+  ListCell *lc;
 
+  foreach (lc, baserel->baserestrictinfo)
   {
-    /* Easy: just rescan what we already have in memory, if anything */
-    fsstate->next_tuple = 0;
-    return;
+    RestrictInfo *rinfo = (RestrictInfo *) lfirst (lc);
+    AttrNumber attnum;
+    const char *op;
+    Expr *value;
+
+    if (cassGetValueRestriction (rinfo->clause, baserel, &attnum, &op, &value) &&
+        strcmp (op, "=") == 0 &&
+        cassIsQueryableColumn (fpinfo, attnum))
+      fixed = bms_add_member (fixed, attnum);
   }
 
-  /* Now force a fresh FETCH. */
-  fsstate->tuples = NULL;
-  fsstate->num_tuples = 0;
-  fsstate->next_tuple = 0;
-  fsstate->fetch_ct_2 = 0;
-  fsstate->eof_reached = false;
+  return fixed;
 }
 
 /*
- * cassEndForeignScan
- *		Finish scanning foreign table and dispose objects used for this scan
+ * Check whether the rows of a single partition come back in the order of
+ * the given pathkeys, either in the table's clustering order or exactly
+ * reversed, which Cassandra can return just as cheaply.  Clustering
+ * columns fixed by = conditions don't affect the order, and can be
+ * skipped.  Returns the direction in *reversed.
  */
-static void
-cassEndForeignScan (ForeignScanState *node)
+static bool
+cassMatchClusteringOrder (RelOptInfo *baserel, CassFdwPlanState *fpinfo,
+                          List *pathkeys, bool *reversed)
 {
-  CassFdwScanState *fsstate = (CassFdwScanState *) node->fdw_state;
-
-  /* if fsstate is NULL, we are in EXPLAIN; nothing to do */
-  if (fsstate == NULL)
-    return;
+  Bitmapset *fixed = cassGetFixedAttrs (baserel, fpinfo);
+  ListCell *lc_attr = list_head (fpinfo->clustering_attrs);
+  ListCell *lc_desc = list_head (fpinfo->clustering_desc);
+  bool have_direction = false;
+  ListCell *lc;
 
-  /* Close the cursor if open, to prevent accumulation of cursors */
-  if (fsstate->sql_sended)
+  foreach (lc, pathkeys)
+  {
+    PathKey *pathkey = (PathKey *) lfirst (lc);
+    EquivalenceClass *ec = pathkey->pk_eclass;
+    Var *var = NULL;
+    TypeCacheEntry *typentry;
+    ListCell *lc2;
+    bool rev;
+
+    if (ec->ec_has_volatile)
+      return false;
+
+    /* Find the column of ours the pathkey sorts on. */
+    foreach (lc2, ec->ec_members)
     {
-      if (fsstate->statement)
-        cass_statement_free (fsstate->statement);
-    }
+      EquivalenceMember *em = (EquivalenceMember *) lfirst (lc2);
 
-  if (fsstate->query)
-    {
-      pfree (fsstate->query);
+      if (IsA (em->em_expr, Var) &&
+          ((Var *) em->em_expr)->varno == baserel->relid &&
+          ((Var *) em->em_expr)->varlevelsup == 0)
+        {
+          var = (Var *) em->em_expr;
+          break;
+        }
     }
+    if (var == NULL)
+      return false;
 
-  /* Release remote connection */
-  pgcass_ReleaseConnection (fsstate->cass_conn);
-  fsstate->cass_conn = NULL;
+    /* It has to be the next clustering column that isn't fixed. */
+    while (lc_attr != NULL &&
+           lfirst_int (lc_attr) != var->varattno &&
+           bms_is_member (lfirst_int (lc_attr), fixed))
+      {
+        lc_attr = lnext (lc_attr);
+        lc_desc = lnext (lc_desc);
+      }
+    if (lc_attr == NULL || lfirst_int (lc_attr) != var->varattno)
+      return false;
+
+    /* Sorted by the type's default ordering, which Cassandra shares. */
+    typentry = lookup_type_cache (var->vartype, TYPECACHE_BTREE_OPFAMILY);
+    if (!cassIsOrderedType (var->vartype) ||
+        pathkey->pk_opfamily != typentry->btree_opf)
+      return false;
+
+    rev = (pathkey->pk_strategy == BTGreaterStrategyNumber) !=
+            (lfirst_int (lc_desc) != 0);
+    if (have_direction && rev != *reversed)
+      return false;
+    *reversed = rev;
+    have_direction = true;
+
+    lc_attr = lnext (lc_attr);
+    lc_desc = lnext (lc_desc);
+  }
 
-  /* MemoryContexts will be deleted automatically. */
+  return have_direction;
 }
 
 /*
- * Create cursor for node's query with current parameter values.
+ * Check whether an expression is "key = ANY (array)" on a partition key
+ * column of baserel, with an array that doesn't depend on baserel and whose
+ * elements can be bound to the remote query.  If so, return the column's
+ * attribute number and the array's expression.
  */
-static void
-create_cursor (ForeignScanState *node)
+static bool
+cassIsKeyListClause (RelOptInfo *baserel, CassFdwPlanState *fpinfo,
+                     Expr *clause, AttrNumber *attnum, Expr **array)
 {
-  CassFdwScanState *fsstate = (CassFdwScanState *) node->fdw_state;
+  ScalarArrayOpExpr *saop = (ScalarArrayOpExpr *) clause;
+  Var *var;
+  Expr *other;
+  char *opname;
+
+  if (!IsA (clause, ScalarArrayOpExpr) || !saop->useOr ||
+      list_length (saop->args) != 2 ||
+      !IsA (linitial (saop->args), Var))
+    return false;
+
+  var = (Var *) linitial (saop->args);
+  other = (Expr *) lsecond (saop->args);
+
+  if (var->varno != baserel->relid || var->varlevelsup != 0 ||
+      var->varattno == InvalidAttrNumber ||
+      !list_member_int (fpinfo->partition_key_attrs, var->varattno))
+    return false;
+
+  opname = get_opname (saop->opno);
+  if (opname == NULL || strcmp (opname, "=") != 0)
+    return false;
+
+  if (exprType ((Node *) other) != get_array_type (var->vartype) ||
+      !pgcass_is_bindable_type (var->vartype) ||
+      bms_is_member (baserel->relid, pull_varnos ((Node *) other)) ||
+      contain_volatile_functions ((Node *) other))
+    return false;
+
+  *attnum = var->varattno;
+  *array = other;
+  return true;
+}
 
-  /* Build statement and execute query */
-  fsstate->statement = cass_statement_new (fsstate->query, 0);
+/*
+ * Callback for generate_implied_equalities_for_column: pick out the
+ * equivalence class member that is the given partition key column.
+ */
+static bool
+ec_member_matches_key_column (PlannerInfo *root, RelOptInfo *rel,
+                              EquivalenceClass *ec, EquivalenceMember *em,
+                              void *arg)
+{
+  Var *var = (Var *) em->em_expr;
 
-  /* Mark the cursor as created, and show no tuples have been retrieved */
-  fsstate->sql_sended = true;
-  fsstate->tuples = NULL;
-  fsstate->num_tuples = 0;
-  fsstate->next_tuple = 0;
-  fsstate->fetch_ct_2 = 0;
-  fsstate->eof_reached = false;
+  return IsA (var, Var) &&
+          var->varno == rel->relid &&
+          var->varlevelsup == 0 &&
+          var->varattno == *(AttrNumber *) arg;
 }
 
 /*
- * Fetch some more rows from the node's cursor.
+ * cassGetForeignPlan
+ *		Create ForeignScan plan node which implements selected best path
  */
-static void
-fetch_more_data (ForeignScanState *node)
+static ForeignScan *
+cassGetForeignPlan (PlannerInfo *root,
+                    RelOptInfo *baserel,
+                    Oid foreigntableid,
+                    ForeignPath *best_path,
+                    List *tlist,
+                    List *scan_clauses)
 {
-  CassFdwScanState *fsstate = (CassFdwScanState *) node->fdw_state;
-  //MemoryContext oldcontext;
+  CassFdwPlanState *fpinfo = (CassFdwPlanState *) baserel->fdw_private;
+  Index scan_relid = baserel->relid;
+  List *fdw_private;
+  List *local_exprs = NIL;
+  StringInfoData sql;
+  StringInfoData where;
+  StringInfoData key_conds;
+  List *retrieved_attrs;
+  List *params_list = NIL;
+  List *param_coltypes = NIL;
+  List *key_params = NIL;
+  List *key_coltypes = NIL;
+  bool has_where;
+  bool key_complete;
+  bool count_only;
+  int token_ranges = 0;
+  int parallel_workers = 0;
+  int key_list_param = -1;
+  int fetch_size = fpinfo->fetch_size;
+  List *remote_conds;
+  List *key_remote_conds = NIL;
+  List *local_conds = NIL;
+  Bitmapset *attrs_used;
+  Bitmapset *bound;
+  ListCell *lc;
+
   /*
-   * We'll store the tuples in the batch_cxt.  First, flush the previous
-   * batch.
+   * For a parameterized path, send the join clauses on partition key
+   * columns as well, with the outer values bound as parameters when the
+   * scan is (re)started.  A column can only be restricted once.
    */
-  fsstate->tuples = NULL;
-  MemoryContextReset (fsstate->batch_cxt);
-  //oldcontext = MemoryContextSwitchTo(fsstate->batch_cxt);
-  {
-    CassSession *conn = fsstate->cass_conn;
-
-    CassFuture* result_future = cass_session_execute (conn, fsstate->statement);
-    if (cass_future_error_code (result_future) == CASS_OK)
+  initStringInfo (&key_conds);
+  bound = cassGetFixedKeyAttrs (baserel, fpinfo);
+  if (best_path->path.param_info != NULL)
+    {
+      foreach (lc, scan_clauses)
       {
-        const CassResult* res;
-        int numrows;
-        CassIterator* rows;
-        int k;
-
-        /* Retrieve result set and iterate over the rows */
-        res = cass_future_get_result (result_future);
+        RestrictInfo *rinfo = (RestrictInfo *) lfirst (lc);
+        AttrNumber attnum;
+        Expr *value;
+
+        if (list_member_ptr (baserel->baserestrictinfo, rinfo))
+          continue;
+        if (!cassIsKeyEqualityClause (baserel, fpinfo, rinfo->clause,
+                                      &attnum, &value) ||
+            bms_is_member (attnum, bound))
+          continue;
+        bound = bms_add_member (bound, attnum);
+
+        if (key_conds.len > 0)
+          appendStringInfoString (&key_conds, " AND ");
+        deparseColumnRef (&key_conds, baserel->relid, attnum, root);
+        appendStringInfoString (&key_conds, " = ?");
+
+        key_params = lappend (key_params, value);
+        key_coltypes = lappend_oid (key_coltypes,
+                                    get_atttype (fpinfo->relid, attnum));
+        if (cassIsExactType (exprType ((Node *) value)))
+          key_remote_conds = lappend (key_remote_conds, rinfo);
+      }
+    }
 
-        /* Stash away the state info we have already */
-        fsstate->NumberOfColumns = cass_result_column_count (res);
+  /*
+   * If the rest of the partition key is fixed, a list of values for its
+   * last column names the partitions to read.  Rather than as one IN list,
+   * which a single coordinator would have to fan out, the partitions are
+   * read by concurrent queries, each routed to a node owning the data.
+   * The array is bound as a parameter; the executor sends one query per
+   * distinct element.
+   */
+  if (fpinfo->partition_key_attrs != NIL)
+    {
+      foreach (lc, baserel->baserestrictinfo)
+      {
+        RestrictInfo *rinfo = (RestrictInfo *) lfirst (lc);
+        AttrNumber attnum;
+        Expr *array;
+        ListCell *lc2;
+        bool fixed = true;
+
+        if (!cassIsKeyListClause (baserel, fpinfo, rinfo->clause,
+                                  &attnum, &array) ||
+            bms_is_member (attnum, bound))
+          continue;
+
+        foreach (lc2, fpinfo->partition_key_attrs)
+        {
+          if (lfirst_int (lc2) != attnum &&
+              !bms_is_member (lfirst_int (lc2), bound))
+            fixed = false;
+        }
+        if (!fixed)
+          continue;
+
+        if (key_conds.len > 0)
+          appendStringInfoString (&key_conds, " AND ");
+        deparseColumnRef (&key_conds, baserel->relid, attnum, root);
+        appendStringInfoString (&key_conds, " = ?");
+
+        key_params = lappend (key_params, array);
+        key_coltypes = lappend_oid (key_coltypes, InvalidOid);
+        key_list_param = list_length (key_params) - 1;
+        if (cassIsExactType (get_element_type (exprType ((Node *) array))))
+          key_remote_conds = lappend (key_remote_conds, rinfo);
+        break;
+      }
+    }
 
-        /* Convert the data into HeapTuples */
-        numrows = cass_result_row_count (res);
-        fsstate->tuples = (HeapTuple *) palloc0 (numrows * sizeof (HeapTuple));
-        fsstate->num_tuples = numrows;
-        fsstate->next_tuple = 0;
+  /*
+   * Build the other conditions to be sent for execution.  Whether the
+   * partition key is restricted as a whole decides which ones CQL accepts.
+   */
+  key_complete = fpinfo->partition_key_attrs != NIL;
+  foreach (lc, fpinfo->partition_key_attrs)
+  {
+    if (!bms_is_member (lfirst_int (lc), bound))
+      key_complete = false;
+  }
 
-        rows = cass_iterator_from_result (res);
-        k = 0;
-        while (cass_iterator_next (rows))
-          {
-            const CassRow* row = cass_iterator_get_row (rows);
+  initStringInfo (&where);
+  deparseWhereClause (&where, root, baserel, key_complete,
+                      &has_where, &remote_conds, &params_list,
+                      &param_coltypes);
+  if (key_conds.len > 0)
+    {
+      appendStringInfo (&where, "%s%s", has_where ? " AND " : " WHERE ",
+                        key_conds.data);
+      has_where = true;
+    }
+  remote_conds = list_concat (remote_conds, key_remote_conds);
+  if (key_list_param >= 0)
+    key_list_param += list_length (params_list);
+  params_list = list_concat (params_list, key_params);
+  param_coltypes = list_concat (param_coltypes, key_coltypes);
 
-            fsstate->tuples[k] = make_tuple_from_result_row (row,
-                                                             fsstate->NumberOfColumns,
-                                                             fsstate->rel,
-                                                             fsstate->attinmeta,
-                                                             fsstate->retrieved_attrs,
-                                                             fsstate->temp_cxt);
+  /*
+   * Only the conditions not enforced exactly by the remote query need to
+   * be checked locally, and the columns they reference must be fetched
+   * for that along with those the query returns.
+   */
+  foreach (lc, scan_clauses)
+  {
+    if (!list_member_ptr (remote_conds, lfirst (lc)))
+      local_conds = lappend (local_conds, lfirst (lc));
+  }
+  local_exprs = extract_actual_clauses (local_conds, false);
 
-            Assert (k < numrows);
-            k++;
-          }
+  attrs_used = bms_copy (fpinfo->attrs_used);
+  pull_varattnos ((Node *) local_exprs, baserel->relid, &attrs_used);
 
-        fsstate->eof_reached = true;
+  /*
+   * A full table scan can be split into token ranges, which are then
+   * queried concurrently so that every node in the cluster coordinates a
+   * share of the scan.  That needs the partition key to compute tokens of.
+   */
+  if (!has_where && fpinfo->scan_parallelism > 1 &&
+      fpinfo->partition_key != NIL)
+    token_ranges = fpinfo->scan_parallelism;
 
-        cass_result_free (res);
-        cass_iterator_free (rows);
-      }
-    else
-      {
-        /* Handle error */
-        const char* message;
-        size_t message_length;
-        cass_future_error_message (result_future, &message, &message_length);
-        elog (LOG, "Unable to run query: '%.*s'\n",
-              (int) message_length, message);
-        ereport (ERROR,
-                 (errcode (ERRCODE_SYNTAX_ERROR),
-                  errmsg ("Unable to run query: '%.*s'\n",
-                          (int) message_length, message)));
-        fsstate->eof_reached = true;
-      }
+  /*
+   * If no column is needed at all, as for count(*), have Cassandra count
+   * the rows rather than send them; the executor returns that many empty
+   * rows.  Under a LIMIT that could count far more rows than are needed,
+   * so fetch the (empty) rows then.  A count is a single request, which
+   * would time out on a large table: only the rows of given partitions,
+   * or of a token range, are counted that way.
+   */
+  count_only = bms_is_empty (attrs_used) &&
+          best_path->path.pathkeys == NIL &&
+          root->limit_tuples <= 0 &&
+          (key_complete || key_list_param >= 0 || token_ranges > 0);
 
-    cass_future_free (result_future);
-  }
-}
+  initStringInfo (&sql);
+  deparseSelectSql (&sql, root, baserel, attrs_used,
+                    &retrieved_attrs, count_only);
+  appendStringInfoString (&sql, where.data);
 
-static HeapTuple
-make_tuple_from_result_row (const CassRow* row,
-                            int ncolumn,
-                            Relation rel,
-                            AttInMetadata *attinmeta,
-                            List *retrieved_attrs,
-                            MemoryContext temp_context)
-{
-  HeapTuple tuple;
-  TupleDesc tupdesc = RelationGetDescr (rel);
-  Datum *values;
-  bool *nulls;
-  MemoryContext oldcontext;
-  ListCell *lc;
-  int j;
+  if (token_ranges > 0)
+    {
+      appendStringInfoString (&sql, " WHERE ");
+      deparseTokenRange (&sql, fpinfo->partition_key);
+
+      /*
+       * The ranges can also be read by background workers, each with its
+       * own session, so that decoding rows uses more than one core.
+       * Counts leave nothing to decode.
+       */
+      if (!count_only)
+        parallel_workers = Min (fpinfo->parallel_workers, token_ranges);
+    }
 
   /*
-   * Do the following work in a temp context that we reset after each tuple.
-   * This cleans up not only the data we have direct access to, but any
-   * cruft the I/O functions might leak.
+   * For a path sorted in clustering order, ask for that order.  Ordering
+   * by the first clustering column alone is valid CQL whatever the other
+   * restrictions are, and going against its declared direction reverses
+   * the order of all of them.
    */
-  oldcontext = MemoryContextSwitchTo (temp_context);
+  if (best_path->path.pathkeys != NIL)
+    {
+      bool reversed = intVal (linitial (best_path->fdw_private)) != 0;
+      bool desc = (linitial_int (fpinfo->clustering_desc) != 0) != reversed;
 
-  values = (Datum *) palloc0 (tupdesc->natts * sizeof (Datum));
-  nulls = (bool *) palloc (tupdesc->natts * sizeof (bool));
-  /* Initialize to nulls for any columns not present in result */
-  memset (nulls, true, tupdesc->natts * sizeof (bool));
+      appendStringInfo (&sql, " ORDER BY %s %s",
+                        quote_identifier (strVal (linitial (fpinfo->clustering_columns))),
+                        desc ? "DESC" : "ASC");
+    }
 
   /*
-   * i indexes columns in the relation, j indexes columns in the PGresult.
+   * If the scan returns exactly the rows the query's LIMIT is applied to,
+   * with no join, aggregation or set-returning function in between, and
+   * already in the order required, the remote query needs no more rows
+   * than the LIMIT (plus OFFSET) either.  That takes every condition to
+   * have been enforced remotely, or local filtering could leave too few.
+   * Then ask for all of them in a single page, too.
    */
-  j = 0;
+  if (root->limit_tuples > 0 &&
+      bms_membership (root->all_baserels) == BMS_SINGLETON &&
+      pathkeys_contained_in (root->query_pathkeys, best_path->path.pathkeys) &&
+      !expression_returns_set ((Node *) root->parse->targetList))
+    {
+      bool all_remote = true;
 
-  foreach (lc, retrieved_attrs)
-  {
-    int i = lfirst_int (lc);
+      foreach (lc, scan_clauses)
+      {
+        if (!list_member_ptr (remote_conds, lfirst (lc)))
+          all_remote = false;
+      }
+
+      if (all_remote)
+        {
+          int limit = root->limit_tuples >= INT_MAX ? INT_MAX :
+                  (int) ceil (root->limit_tuples);
+
+          appendStringInfo (&sql, " LIMIT %d", limit);
+          fetch_size = Min (fetch_size, limit);
+        }
+    }
+
+  /*
+   * Build the fdw_private list that will be available to the executor.
+   * Items in the list must match enum FdwScanPrivateIndex, above.
+   */
+  fdw_private = list_make4 (makeString (sql.data),
+                            retrieved_attrs,
+                            makeInteger (fetch_size),
+                            makeInteger (token_ranges));
+  fdw_private = lappend (fdw_private, makeInteger (parallel_workers));
+  fdw_private = lappend (fdw_private, makeInteger (key_list_param));
+  fdw_private = lappend (fdw_private, makeInteger (count_only));
+  fdw_private = lappend (fdw_private,
+                         makeInteger (best_path->path.param_info != NULL));
+  fdw_private = lappend (fdw_private, param_coltypes);
+
+  /*
+   * Create the ForeignScan node from target list, local filtering
+   * expressions, remote parameter expressions, and FDW private information.
+   *
+   * Note that the remote parameter expressions are stored in the fdw_exprs
+   * field of the finished plan node; we can't keep them in private state
+   * because then they wouldn't be subject to later planner processing.
+   */
+  return make_foreignscan (tlist,
+                           local_exprs,
+                           scan_relid,
+                           params_list,
+                           fdw_private);
+}
+
+/*
+ * cassExplainForeignScan
+ *		Produce extra output for EXPLAIN
+ */
+static void
+cassExplainForeignScan (ForeignScanState *node, ExplainState *es)
+{
+  List *fdw_private;
+  char *sql;
+  if (es->verbose)
+    {
+
+      //TODO
+      fdw_private = ((ForeignScan *) node->ss.ps.plan)->fdw_private;
+      sql = strVal (list_nth (fdw_private, CassFdwScanPrivateSelectSql));
+      ExplainPropertyText ("Remote SQL", sql, es);
+
+      if (intVal (list_nth (fdw_private, CassFdwScanPrivateTokenRanges)) > 0)
+        ExplainPropertyInteger ("Token Ranges",
+                                intVal (list_nth (fdw_private,
+                                                  CassFdwScanPrivateTokenRanges)),
+                                es);
+      if (intVal (list_nth (fdw_private, CassFdwScanPrivateParallelWorkers)) > 0)
+        ExplainPropertyInteger ("Background Workers",
+                                intVal (list_nth (fdw_private,
+                                                  CassFdwScanPrivateParallelWorkers)),
+                                es);
+    }
+}
+
+/*
+ * cassBeginForeignScan
+ *		Initiate access to the database
+ */
+static void
+cassBeginForeignScan (ForeignScanState *node, int eflags)
+{
+  ForeignScan *fsplan = (ForeignScan *) node->ss.ps.plan;
+  EState *estate = node->ss.ps.state;
+  CassFdwScanState *fsstate;
+  MemoryContext scan_cxt;
+  RangeTblEntry *rte;
+  Oid userid;
+  ForeignTable *table;
+  ForeignServer *server;
+  UserMapping *user;
+
+  /*
+   * Do nothing in EXPLAIN (no ANALYZE) case.  node->fdw_state stays NULL.
+   */
+  if (eflags & EXEC_FLAG_EXPLAIN_ONLY)
+    return;
+
+  /*
+   * We'll save private state in node->fdw_state.  It lives outside the
+   * query's memory, which an abort may free before the scan's driver
+   * objects are released; see cassReleaseScans.
+   */
+  scan_cxt = AllocSetContextCreate (TopMemoryContext,
+                                    "cassandra2_fdw scan",
+                                    ALLOCSET_SMALL_MINSIZE,
+                                    ALLOCSET_SMALL_INITSIZE,
+                                    ALLOCSET_DEFAULT_MAXSIZE);
+  fsstate = (CassFdwScanState *)
+          MemoryContextAllocZero (scan_cxt, sizeof (CassFdwScanState));
+  fsstate->scan_cxt = scan_cxt;
+  cassRegisterScan (fsstate);
+  node->fdw_state = (void *) fsstate;
+
+  /*
+   * Identify which user to do the remote access as.  This should match what
+   * ExecCheckRTEPerms() does.
+   */
+  rte = rt_fetch (fsplan->scan.scanrelid, estate->es_range_table);
+  userid = rte->checkAsUser ? rte->checkAsUser : GetUserId ();
+
+  /* Get info about foreign table. */
+  fsstate->rel = node->ss.ss_currentRelation;
+  table = GetForeignTable (RelationGetRelid (fsstate->rel));
+  server = GetForeignServer (table->serverid);
+  user = GetUserMapping (userid, server->serverid);
+  fsstate->userid = userid;
+  fsstate->sql_sended = false;
+
+  /*
+   * Get private info created by planner functions.  The query text belongs
+   * to the plan, which a cached plan outlives the scan with.
+   */
+  fsstate->query = strVal (list_nth (fsplan->fdw_private,
+                                     CassFdwScanPrivateSelectSql));
+  fsstate->retrieved_attrs = (List *) list_nth (fsplan->fdw_private,
+                                                CassFdwScanPrivateRetrievedAttrs);
+  fsstate->fetch_size = intVal (list_nth (fsplan->fdw_private,
+                                          CassFdwScanPrivateFetchSize));
+  fsstate->token_ranges = intVal (list_nth (fsplan->fdw_private,
+                                            CassFdwScanPrivateTokenRanges));
+  fsstate->parallel_workers = intVal (list_nth (fsplan->fdw_private,
+                                                CassFdwScanPrivateParallelWorkers));
+  fsstate->key_param = intVal (list_nth (fsplan->fdw_private,
+                                         CassFdwScanPrivateKeyListParam));
+  fsstate->has_key_list = fsstate->key_param >= 0;
+  fsstate->count_only = intVal (list_nth (fsplan->fdw_private,
+                                          CassFdwScanPrivateCountOnly)) != 0;
+
+  /*
+   * A plain query is run by a broker worker, if there is one to take it.
+   * Otherwise the connection to the foreign server is got when the query
+   * is first sent, so that a scan whose parameters can't match any rows
+   * doesn't need one.
+   */
+  if (!fsstate->has_key_list && fsstate->token_ranges == 0 &&
+      fsstate->parallel_workers == 0 && !fsstate->count_only)
+    fsstate->broker = pgcass_BrokerBeginScan (server, user, fsstate->rel,
+                                              fsstate->query,
+                                              fsstate->retrieved_attrs,
+                                              fsstate->fetch_size);
+  fsstate->server = server;
+  fsstate->user = user;
+
+  /*
+   * One stream per token range, or a single one for a plain query.  A scan
+   * of a partition key list gets one per key, once the list is known.
+   */
+  if (fsstate->has_key_list)
+    fsstate->key_cxt = AllocSetContextCreate (fsstate->scan_cxt,
+                                              "cassandra2_fdw key list",
+                                              ALLOCSET_DEFAULT_MINSIZE,
+                                              ALLOCSET_DEFAULT_INITSIZE,
+                                              ALLOCSET_DEFAULT_MAXSIZE);
+  else
+    {
+      fsstate->num_streams = fsstate->token_ranges > 0 ? fsstate->token_ranges : 1;
+      fsstate->streams = (CassScanStream *)
+              MemoryContextAllocZero (fsstate->scan_cxt,
+                                      fsstate->num_streams * sizeof (CassScanStream));
+    }
+
+  /* Create context for per-tuple temp workspace. */
+  fsstate->temp_cxt = AllocSetContextCreate (estate->es_query_cxt,
+                                             "cassandra2_fdw temporary data",
+                                             ALLOCSET_SMALL_MINSIZE,
+                                             ALLOCSET_SMALL_INITSIZE,
+                                             ALLOCSET_SMALL_MAXSIZE);
+
+  /* Get info we'll need for input data conversion. */
+  fsstate->attinmeta = TupleDescGetAttInMetadata (RelationGetDescr (fsstate->rel));
+  fsstate->decoders = (CassValueDecoder *)
+          palloc0 ((list_length (fsstate->retrieved_attrs) + 1) *
+                   sizeof (CassValueDecoder));
+
+  /* Prepare for evaluation of the values bound to the query's markers. */
+  fsstate->numParams = list_length (fsplan->fdw_exprs);
+  if (fsstate->numParams > 0)
+    {
+      ListCell *lc;
+      int i = 0;
+
+      fsstate->param_exprs = (List *)
+              ExecInitExpr ((Expr *) fsplan->fdw_exprs, (PlanState *) node);
+      fsstate->param_types = (Oid *) palloc (fsstate->numParams * sizeof (Oid));
+      fsstate->param_coltypes = (Oid *) palloc (fsstate->numParams * sizeof (Oid));
+      fsstate->param_values = (Datum *)
+              palloc0 (fsstate->numParams * sizeof (Datum));
+      fsstate->param_isnull = (bool *)
+              palloc0 (fsstate->numParams * sizeof (bool));
+      fsstate->param_typlen = (int16 *)
+              palloc (fsstate->numParams * sizeof (int16));
+      fsstate->param_typbyval = (bool *)
+              palloc (fsstate->numParams * sizeof (bool));
+
+      foreach (lc, fsplan->fdw_exprs)
+        {
+          fsstate->param_types[i] = exprType ((Node *) lfirst (lc));
+          fsstate->param_coltypes[i] =
+                  list_nth_oid ((List *) list_nth (fsplan->fdw_private,
+                                                   CassFdwScanPrivateParamColumnTypes),
+                                i);
+          get_typlenbyval (fsstate->param_types[i],
+                           &fsstate->param_typlen[i],
+                           &fsstate->param_typbyval[i]);
+          i++;
+        }
+
+      if (fsstate->has_key_list)
+        fsstate->key_type = get_element_type (fsstate->param_types[fsstate->key_param]);
+
+      /*
+       * The scan of a parameterized path is rerun for every outer row of a
+       * join, and outer rows often repeat their keys.  Remember the rows of
+       * recent lookups, so that a repeated key doesn't cost another round
+       * trip.  Other parameters, such as pushed down constants, don't
+       * change between rescans, so there is nothing to remember for them.
+       */
+      if (intVal (list_nth (fsplan->fdw_private,
+                            CassFdwScanPrivateParameterized)) != 0)
+        {
+          fsstate->lookup_cache = (CassLookupCacheEntry *)
+                  palloc0 (CASS_LOOKUP_CACHE_ENTRIES * sizeof (CassLookupCacheEntry));
+          fsstate->lookup_cxt = AllocSetContextCreate (estate->es_query_cxt,
+                                                       "cassandra2_fdw lookup cache",
+                                                       ALLOCSET_SMALL_MINSIZE,
+                                                       ALLOCSET_SMALL_INITSIZE,
+                                                       ALLOCSET_DEFAULT_MAXSIZE);
+          initStringInfo (&fsstate->lookup_key);
+        }
+    }
+}
+
+/*
+ * cassIterateForeignScan
+ *		Read next record from the current result page and store it into the
+ *		ScanTupleSlot as a virtual tuple
+ */
+static TupleTableSlot*
+cassIterateForeignScan (ForeignScanState *node)
+{
+  CassFdwScanState *fsstate = (CassFdwScanState *) node->fdw_state;
+  TupleTableSlot *slot = node->ss.ss_ScanTupleSlot;
+
+  /*
+   * If this is the first call after Begin or ReScan, we need to create the
+   * cursor on the remote side.
+   */
+  if (!fsstate->sql_sended)
+    create_cursor (node);
+
+  /* Replay the rows of a lookup done before with the same parameters. */
+  if (fsstate->replaying != NULL)
+    {
+      if (fsstate->replay_pos >= fsstate->replaying->ntuples)
+        return ExecClearTuple (slot);
+
+      return ExecStoreMinimalTuple (fsstate->replaying->tuples[fsstate->replay_pos++],
+                                    slot, false);
+    }
+
+  /*
+   * Return the next row, either read by a background worker or straight
+   * from the current page.
+   */
+  if (fsstate->nworkers_launched > 0)
+    {
+      if (!receive_worker_tuple (fsstate, slot))
+        return ExecClearTuple (slot);
+    }
+  else if (!next_result_row (fsstate, slot))
+    {
+      /* The lookup has returned all of its rows; keep them. */
+      if (fsstate->filling != NULL)
+        {
+          fsstate->filling->valid = true;
+          fsstate->filling = NULL;
+        }
+      return ExecClearTuple (slot);
+    }
+
+  if (fsstate->filling != NULL)
+    lookup_cache_add (fsstate, slot);
+
+  return slot;
+}
+
+/*
+ * Store the next row of the scan's result in the slot, moving on to the
+ * next page if we've run out of rows.  A page may legitimately come back
+ * empty while more pages remain, so keep going until EOF.  Returns false at
+ * the end of the result.
+ */
+static bool
+next_result_row (CassFdwScanState *fsstate, TupleTableSlot *slot)
+{
+  if (fsstate->count_only)
+    return next_counted_row (fsstate, slot);
+
+  if (fsstate->broker != NULL)
+    return !fsstate->eof_reached &&
+            pgcass_BrokerNextRow (fsstate->broker, slot, fsstate->attinmeta,
+                                  fsstate->temp_cxt);
+
+  while (fsstate->rows == NULL || !cass_iterator_next (fsstate->rows))
+    {
+      /* No point in another fetch if we already detected EOF, though. */
+      if (fsstate->eof_reached)
+        return false;
+      fetch_more_data (fsstate);
+    }
+
+  store_result_row_in_slot (cass_iterator_get_row (fsstate->rows),
+                            fsstate->NumberOfColumns,
+                            slot,
+                            fsstate->attinmeta,
+                            fsstate->decoders,
+                            fsstate->retrieved_attrs,
+                            fsstate->temp_cxt);
+  return true;
+}
+
+/*
+ * Store the next row of a scan that only counts rows in the slot.  Every
+ * stream returns the number of its rows; that many rows without any
+ * columns are returned for each.
+ */
+static bool
+next_counted_row (CassFdwScanState *fsstate, TupleTableSlot *slot)
+{
+  while (fsstate->pending_count <= 0)
+    {
+      cass_int64_t count;
+      const CassValue *value;
+
+      if (fsstate->rows == NULL || !cass_iterator_next (fsstate->rows))
+        {
+          if (fsstate->eof_reached)
+            return false;
+          fetch_more_data (fsstate);
+          continue;
+        }
+
+      value = cass_row_get_column (cass_iterator_get_row (fsstate->rows), 0);
+      if (value != NULL && !cass_value_is_null (value) &&
+          cass_value_get_int64 (value, &count) == CASS_OK)
+        fsstate->pending_count = count;
+    }
+
+  fsstate->pending_count--;
+
+  ExecClearTuple (slot);
+  memset (slot->tts_isnull, true,
+          slot->tts_tupleDescriptor->natts * sizeof (bool));
+  ExecStoreVirtualTuple (slot);
+  return true;
+}
+
+/*
+ * Serialize the current parameter values into lookup_key, and hash them.
+ * Varlena values stored in different forms merely miss the cache.
+ */
+static void
+lookup_cache_key (CassFdwScanState *fsstate)
+{
+  StringInfo key = &fsstate->lookup_key;
+  int i;
+
+  resetStringInfo (key);
+  for (i = 0; i < fsstate->numParams; i++)
+    {
+      int len;
+      char *data = pgcass_datum_bytes (&fsstate->param_values[i],
+                                       fsstate->param_typlen[i],
+                                       fsstate->param_typbyval[i],
+                                       &len);
+
+      appendBinaryStringInfo (key, (char *) &len, sizeof (len));
+      appendBinaryStringInfo (key, data, len);
+    }
+
+  fsstate->lookup_hash = DatumGetUInt32 (hash_any ((unsigned char *) key->data,
+                                                   key->len));
+}
+
+/*
+ * Return the cache entry holding the rows of a completed lookup with the
+ * current parameter values, or NULL.
+ */
+static CassLookupCacheEntry *
+lookup_cache_find (CassFdwScanState *fsstate)
+{
+  int i;
+
+  for (i = 0; i < CASS_LOOKUP_CACHE_ENTRIES; i++)
+    {
+      CassLookupCacheEntry *entry = &fsstate->lookup_cache[i];
+
+      if (entry->valid &&
+          entry->hash == fsstate->lookup_hash &&
+          entry->keylen == fsstate->lookup_key.len &&
+          memcmp (entry->key, fsstate->lookup_key.data, entry->keylen) == 0)
+        {
+          entry->last_used = ++fsstate->lookup_clock;
+          return entry;
+        }
+    }
+
+  return NULL;
+}
+
+/*
+ * Claim a cache entry, the least recently used one if none is free, for
+ * saving the rows of a lookup with the current parameter values.
+ */
+static CassLookupCacheEntry *
+lookup_cache_start (CassFdwScanState *fsstate)
+{
+  CassLookupCacheEntry *entry = NULL;
+  MemoryContext oldcontext;
+  int i;
+
+  for (i = 0; i < CASS_LOOKUP_CACHE_ENTRIES; i++)
+    {
+      CassLookupCacheEntry *e = &fsstate->lookup_cache[i];
+
+      if (e->cxt == NULL)
+        {
+          e->cxt = AllocSetContextCreate (fsstate->lookup_cxt,
+                                          "cassandra2_fdw lookup",
+                                          ALLOCSET_SMALL_MINSIZE,
+                                          ALLOCSET_SMALL_INITSIZE,
+                                          ALLOCSET_DEFAULT_MAXSIZE);
+          entry = e;
+          break;
+        }
+      if (entry == NULL || !e->valid ||
+          (entry->valid && e->last_used < entry->last_used))
+        entry = e;
+    }
+
+  MemoryContextReset (entry->cxt);
+  oldcontext = MemoryContextSwitchTo (entry->cxt);
+
+  entry->valid = false;
+  entry->hash = fsstate->lookup_hash;
+  entry->keylen = fsstate->lookup_key.len;
+  entry->key = (char *) palloc (entry->keylen);
+  memcpy (entry->key, fsstate->lookup_key.data, entry->keylen);
+  entry->tuples = (MinimalTuple *)
+          palloc (CASS_LOOKUP_CACHE_ROWS * sizeof (MinimalTuple));
+  entry->ntuples = 0;
+  entry->last_used = ++fsstate->lookup_clock;
+
+  MemoryContextSwitchTo (oldcontext);
+
+  return entry;
+}
+
+/*
+ * Save a row returned by the current lookup.  Lookups returning too many
+ * rows to be worth keeping aren't saved at all.
+ */
+static void
+lookup_cache_add (CassFdwScanState *fsstate, TupleTableSlot *slot)
+{
+  CassLookupCacheEntry *entry = fsstate->filling;
+  MemoryContext oldcontext;
+
+  if (entry->ntuples >= CASS_LOOKUP_CACHE_ROWS)
+    {
+      MemoryContextReset (entry->cxt);
+      entry->keylen = -1;
+      fsstate->filling = NULL;
+      return;
+    }
+
+  oldcontext = MemoryContextSwitchTo (entry->cxt);
+  entry->tuples[entry->ntuples++] = ExecCopySlotMinimalTuple (slot);
+  MemoryContextSwitchTo (oldcontext);
+}
+
+/*
+ * cassReScanForeignScan
+ *		Rescan table, possibly with new parameters
+ */
+static void
+cassReScanForeignScan (ForeignScanState *node)
+{
+  CassFdwScanState *fsstate = (CassFdwScanState *) node->fdw_state;
+
+  /* If we haven't created the cursor yet, nothing to do. */
+  if (!fsstate->sql_sended)
+    return;
+
+  /*
+   * Rows are not kept once they have been returned, so the only way to
+   * rescan is to run the query again, with the current parameter values.
+   */
+  close_cursor (fsstate);
+}
+
+/*
+ * cassEndForeignScan
+ *		Finish scanning foreign table and dispose objects used for this scan
+ */
+static void
+cassEndForeignScan (ForeignScanState *node)
+{
+  CassFdwScanState *fsstate = (CassFdwScanState *) node->fdw_state;
+
+  /* if fsstate is NULL, we are in EXPLAIN; nothing to do */
+  if (fsstate == NULL)
+    return;
+
+  /* Close the cursor if open, to prevent accumulation of cursors */
+  if (fsstate->sql_sended)
+    close_cursor (fsstate);
+
+  /* Release remote connection, or let the broker drop the scan */
+  if (fsstate->broker != NULL)
+    pgcass_BrokerEndScan (fsstate->broker);
+  else
+    pgcass_ReleaseConnection (fsstate->cass_conn);
+  fsstate->broker = NULL;
+  fsstate->cass_conn = NULL;
+
+  /* The other MemoryContexts will be deleted automatically. */
+  cassUnregisterScan (fsstate);
+  MemoryContextDelete (fsstate->scan_cxt);
+  node->fdw_state = NULL;
+}
+
+/*
+ * Remember a scan being begun under the current resource owner.
+ */
+static void
+cassRegisterScan (CassFdwScanState *fsstate)
+{
+  MemoryContext oldcontext;
+
+  if (!scan_callback_registered)
+    {
+      RegisterResourceReleaseCallback (cassReleaseScans, NULL);
+      scan_callback_registered = true;
+    }
+
+  fsstate->owner = CurrentResourceOwner;
+
+  oldcontext = MemoryContextSwitchTo (TopMemoryContext);
+  open_scans = lappend (open_scans, fsstate);
+  MemoryContextSwitchTo (oldcontext);
+}
+
+static void
+cassUnregisterScan (CassFdwScanState *fsstate)
+{
+  open_scans = list_delete_ptr (open_scans, fsstate);
+}
+
+/*
+ * Resource release callback: when a resource owner is released on abort,
+ * free the driver objects and state of the scans begun under it that an
+ * error cut short.  The query's memory, and with it the executor's
+ * pointers to the scans, are gone by now.
+ */
+static void
+cassReleaseScans (ResourceReleasePhase phase, bool isCommit,
+                  bool isTopLevel, void *arg)
+{
+  ListCell *lc;
+  ListCell *prev = NULL;
+  ListCell *next;
+
+  if (phase != RESOURCE_RELEASE_BEFORE_LOCKS || isCommit)
+    return;
+
+  for (lc = list_head (open_scans); lc != NULL; lc = next)
+    {
+      CassFdwScanState *fsstate = (CassFdwScanState *) lfirst (lc);
+
+      next = lnext (lc);
+      if (fsstate->owner != CurrentResourceOwner)
+        {
+          prev = lc;
+          continue;
+        }
+
+      open_scans = list_delete_cell (open_scans, lc, prev);
+      cassReleaseScanHandles (fsstate);
+      MemoryContextDelete (fsstate->scan_cxt);
+    }
+}
+
+/*
+ * cassAnalyzeForeignTable
+ *		Test whether analyzing this foreign table is supported
+ */
+static bool
+cassAnalyzeForeignTable (Relation relation,
+                         AcquireSampleRowsFunc *func,
+                         BlockNumber *totalpages)
+{
+  Oid relid = RelationGetRelid (relation);
+  double partitions;
+  double partition_size;
+
+  *func = cassAcquireSampleRows;
+
+  /* The size only serves as relpages; Cassandra's estimate will do. */
+  if (pgcass_GetSizeEstimates (relid, &partitions, &partition_size))
+    *totalpages = (BlockNumber) Min (Max (1, ceil (partitions *
+                                                    partition_size / BLCKSZ)),
+                                     (double) MaxBlockNumber);
+  else
+    *totalpages = 1;
+
+  return true;
+}
+
+/*
+ * Acquire a random sample of rows from a foreign table, for ANALYZE.
+ *
+ * Rather than reading the whole table, the token ring is split into as
+ * many ranges as it takes to fill the sample at CASS_SAMPLE_ROWS_PER_RANGE
+ * rows each, shifted by a random amount, and the first rows of each range
+ * are read with a LIMIT.  Partition keys are hashed into tokens, so these
+ * are rows of partitions picked at random.  A small table is read in full
+ * this way.  Each row also returns its token, which tells how much of a
+ * range that hit the limit was covered: up to the last partition read in
+ * full, as that of the last row may have more rows.  The table size is
+ * the number of rows of the partitions read in full, scaled up by the
+ * share of the ring covered.  If no range got through a whole partition,
+ * Cassandra's size estimates are used instead.
+ *
+ * Without a known partition key, the first targrows rows of the table are
+ * taken instead, if Cassandra's size estimates tell how many there are in
+ * all; otherwise the whole table is read.
+ */
+static int
+cassAcquireSampleRows (Relation relation, int elevel,
+                       HeapTuple *rows, int targrows,
+                       double *totalrows,
+                       double *totaldeadrows)
+{
+  Oid relid = RelationGetRelid (relation);
+  TupleDesc tupdesc = RelationGetDescr (relation);
+  ForeignTable *table = GetForeignTable (relid);
+  ForeignServer *server = GetForeignServer (table->serverid);
+  UserMapping *user = GetUserMapping (relation->rd_rel->relowner,
+                                      server->serverid);
+  char *partition_key_opt = cassGetTableOption (table, "partition_key");
+  List *partition_key = NIL;
+  CassFdwScanState *fsstate;
+  CassSampleBatch *sample;
+  TupleTableSlot *slot;
+  StringInfoData sql;
+  const CassPrepared *prepared;
+  int fetch_size = cassGetFetchSize (table, server);
+  double partitions;
+  double partition_size;
+  int nattrs = 0;
+  int nranges;
+  int per_range;
+  uint64 step;
+  uint64 offset;
+  double covered = 0;
+  double coveredrows = 0;
+  double samplerows = 0;
+  int numrows = 0;
+  int batch;
+  int i;
+
+  if (partition_key_opt)
+    partition_key = cassParseColumnList (partition_key_opt, "partition_key");
+  else
+    {
+      CassTableKeys *keys = pgcass_GetTableKeys (relid);
+
+      if (keys)
+        partition_key = keys->partition_key;
+    }
+
+  fsstate = (CassFdwScanState *) palloc0 (sizeof (CassFdwScanState));
+  fsstate->rel = relation;
+  fsstate->attinmeta = TupleDescGetAttInMetadata (tupdesc);
+  fsstate->temp_cxt = AllocSetContextCreate (CurrentMemoryContext,
+                                             "cassandra2_fdw temporary data",
+                                             ALLOCSET_SMALL_MINSIZE,
+                                             ALLOCSET_SMALL_INITSIZE,
+                                             ALLOCSET_SMALL_MAXSIZE);
+
+  /* Retrieve every column, and the token after them. */
+  initStringInfo (&sql);
+  appendStringInfoString (&sql, "SELECT ");
+  for (i = 1; i <= tupdesc->natts; i++)
+    {
+      if (tupdesc->attrs[i - 1]->attisdropped)
+        continue;
+      if (nattrs++ > 0)
+        appendStringInfoString (&sql, ", ");
+      appendStringInfoString (&sql,
+                              quote_identifier (cassGetColumnName (relid, i)));
+      fsstate->retrieved_attrs = lappend_int (fsstate->retrieved_attrs, i);
+    }
+  fsstate->decoders = (CassValueDecoder *)
+          palloc0 ((nattrs + 1) * sizeof (CassValueDecoder));
+
+  if (partition_key != NIL)
+    {
+      ListCell *lc;
+
+      appendStringInfoString (&sql, nattrs > 0 ? ", token(" : "token(");
+      foreach (lc, partition_key)
+      {
+        if (lc != list_head (partition_key))
+          appendStringInfoString (&sql, ", ");
+        appendStringInfoString (&sql, quote_identifier (strVal (lfirst (lc))));
+      }
+      appendStringInfoChar (&sql, ')');
+
+      nranges = Max (1, targrows / CASS_SAMPLE_ROWS_PER_RANGE);
+      per_range = CASS_SAMPLE_ROWS_PER_RANGE;
+    }
+  else
+    {
+      if (nattrs == 0)
+        appendStringInfoString (&sql, "NULL");
+      nranges = 1;
+      per_range = pgcass_GetSizeEstimates (relid, &partitions,
+                                           &partition_size) ? targrows : 0;
+    }
+
+  appendStringInfo (&sql, " FROM %s",
+                    pgcass_GetTableMetadata (relid)->table);
+  if (partition_key != NIL)
+    {
+      appendStringInfoString (&sql, " WHERE ");
+      deparseTokenRange (&sql, partition_key);
+    }
+  if (per_range > 0)
+    appendStringInfo (&sql, " LIMIT %d", per_range);
+  fsstate->query = sql.data;
+
+  fsstate->cass_conn = pgcass_GetConnection (server, user, false);
+  slot = MakeSingleTupleTableSlot (tupdesc);
+  sample = (CassSampleBatch *) palloc0 (sizeof (CassSampleBatch));
+
+  /*
+   * Range k covers tokens (lower, upper] of an even split of the ring,
+   * moved up by a random offset; the first range starts at the bottom of
+   * the ring and the last one ends at the top, so that all of it is
+   * covered.
+   */
+  step = (uint64) -1 / (uint64) nranges;
+  offset = (uint64) (anl_random_fract () * (double) step);
+
+  PG_TRY ();
+  {
+    prepared = pgcass_GetPrepared (fsstate->cass_conn, fsstate->query);
+
+    for (batch = 0; batch < nranges; batch += CASS_SAMPLE_CONCURRENCY)
+      {
+        int64 lowers[CASS_SAMPLE_CONCURRENCY];
+        int64 uppers[CASS_SAMPLE_CONCURRENCY];
+        int n = Min (CASS_SAMPLE_CONCURRENCY, nranges - batch);
+        int k;
+
+        vacuum_delay_point ();
+
+        for (k = 0; k < n; k++)
+          {
+            int range = batch + k;
+
+            sample->statements[k] = cass_prepared_bind (prepared);
+            lowers[k] = (range == 0) ? CASS_MIN_TOKEN :
+                    (int64) ((uint64) CASS_MIN_TOKEN + offset + step * range);
+            uppers[k] = (range == nranges - 1) ? CASS_MAX_TOKEN :
+                    (int64) ((uint64) CASS_MIN_TOKEN + offset + step * (range + 1));
+            if (partition_key != NIL)
+              {
+                pgcass_bind_param (sample->statements[k], prepared, 0,
+                                   Int64GetDatum (lowers[k]), INT8OID);
+                pgcass_bind_param (sample->statements[k], prepared, 1,
+                                   Int64GetDatum (uppers[k]), INT8OID);
+              }
+            cass_statement_set_paging_size (sample->statements[k],
+                                            fetch_size);
+            sample->futures[k] = cass_session_execute (fsstate->cass_conn,
+                                                       sample->statements[k]);
+          }
+
+        for (k = 0; k < n; k++)
+          {
+            int64 last_token = lowers[k];
+            int64 prev_token = lowers[k];
+            int last_rows = 0;
+            int nrows = 0;
+
+            /* A query without a LIMIT may take more than one page. */
+            for (;;)
+              {
+                bool more_pages;
+
+                if (cass_future_error_code (sample->futures[k]) != CASS_OK)
+                  {
+                    const char *message;
+                    size_t message_length;
+                    CassError rc = cass_future_error_code (sample->futures[k]);
+
+                    if (rc == CASS_ERROR_SERVER_UNPREPARED ||
+                        rc == CASS_ERROR_SERVER_INVALID_QUERY)
+                      pgcass_ForgetPrepared (fsstate->cass_conn, fsstate->query);
+
+                    cass_future_error_message (sample->futures[k], &message,
+                                               &message_length);
+                    ereport (ERROR,
+                             (errcode (ERRCODE_SYNTAX_ERROR),
+                              errmsg ("Unable to run query: '%.*s'\n",
+                                      (int) message_length, message)));
+                  }
+
+                sample->result = cass_future_get_result (sample->futures[k]);
+                cass_future_free (sample->futures[k]);
+                sample->futures[k] = NULL;
+                if (!fsstate->decoders_valid)
+                  pgcass_init_decoders (fsstate, sample->result);
+
+                sample->iterator = cass_iterator_from_result (sample->result);
+                while (cass_iterator_next (sample->iterator))
+                  {
+                    const CassRow *row = cass_iterator_get_row (sample->iterator);
+                    HeapTuple tuple;
+                    int pos;
+
+                    store_result_row_in_slot (row, nattrs, slot,
+                                              fsstate->attinmeta,
+                                              fsstate->decoders,
+                                              fsstate->retrieved_attrs,
+                                              fsstate->temp_cxt);
+                    if (partition_key != NIL)
+                      {
+                        int64 token;
+
+                        /* Rows come partition by partition, in token order. */
+                        cass_value_get_int64 (cass_row_get_column (row, nattrs),
+                                              &token);
+                        if (nrows == 0 || token != last_token)
+                          {
+                            prev_token = last_token;
+                            last_rows = 0;
+                          }
+                        last_token = token;
+                        last_rows++;
+                      }
+                    nrows++;
+
+                    /*
+                     * Keep the first targrows rows, then replace random
+                     * ones with decreasing probability, so that every row
+                     * read has the same chance of ending up in the sample.
+                     */
+                    if (numrows < targrows)
+                      pos = numrows++;
+                    else
+                      {
+                        pos = (int) (anl_random_fract () * (samplerows + 1));
+                        if (pos >= targrows)
+                          pos = -1;
+                        else
+                          heap_freetuple (rows[pos]);
+                      }
+                    if (pos >= 0)
+                      {
+                        tuple = ExecCopySlotTuple (slot);
+                        rows[pos] = tuple;
+                      }
+                    samplerows += 1;
+                  }
+                cass_iterator_free (sample->iterator);
+                sample->iterator = NULL;
+
+                more_pages = cass_result_has_more_pages (sample->result);
+                if (more_pages)
+                  cass_statement_set_paging_state (sample->statements[k],
+                                                   sample->result);
+                cass_result_free (sample->result);
+                sample->result = NULL;
+                if (!more_pages)
+                  break;
+
+                vacuum_delay_point ();
+                sample->futures[k] = cass_session_execute (fsstate->cass_conn,
+                                                           sample->statements[k]);
+              }
+            cass_statement_free (sample->statements[k]);
+            sample->statements[k] = NULL;
+
+            /*
+             * A range that hit the limit was only read up to its last row,
+             * whose partition may go on: it was covered up to the partition
+             * before, and only that one's rows count.
+             */
+            if (per_range == 0 || nrows < per_range)
+              {
+                covered += (double) ((uint64) uppers[k] - (uint64) lowers[k]);
+                coveredrows += nrows;
+              }
+            else
+              {
+                covered += (double) ((uint64) prev_token - (uint64) lowers[k]);
+                coveredrows += nrows - last_rows;
+              }
+          }
+      }
+  }
+  PG_CATCH ();
+  {
+    int k;
+
+    /* Drop the queries still in flight along with the connection. */
+    if (sample->iterator)
+      cass_iterator_free (sample->iterator);
+    if (sample->result)
+      cass_result_free (sample->result);
+    for (k = 0; k < CASS_SAMPLE_CONCURRENCY; k++)
+      {
+        if (sample->futures[k])
+          cass_future_free (sample->futures[k]);
+        if (sample->statements[k])
+          cass_statement_free (sample->statements[k]);
+      }
+    pgcass_ReleaseConnection (fsstate->cass_conn);
+    PG_RE_THROW ();
+  }
+  PG_END_TRY ();
+
+  ExecDropSingleTupleTableSlot (slot);
+  pgcass_ReleaseConnection (fsstate->cass_conn);
+
+  /*
+   * Scale the rows of the covered parts of the ranges up to the whole
+   * ring.  The first rows of a table whose partition key is unknown only
+   * tell how many there are if that was all of them, and ranges that
+   * didn't get past their first partition don't tell at all; otherwise
+   * Cassandra's estimate says more.
+   */
+  if (partition_key != NIL && covered > 0)
+    *totalrows = rint (coveredrows * 18446744073709551615.0 / covered);
+  else if (per_range > 0 && samplerows >= per_range &&
+           pgcass_GetSizeEstimates (relid, &partitions, &partition_size))
+    {
+      int32 row_size = get_relation_data_width (relid, NULL) +
+              CASS_ROW_OVERHEAD;
+
+      *totalrows = Max (samplerows,
+                        rint (partitions * Max (1, rint (partition_size /
+                                                         row_size))));
+    }
+  else
+    *totalrows = samplerows;
+  *totaldeadrows = 0;
+
+  ereport (elevel,
+           (errmsg ("\"%s\": table contains %.0f rows, %d rows in sample",
+                    RelationGetRelationName (relation),
+                    *totalrows, numrows)));
+
+  return numrows;
+}
+
+/*
+ * Create cursor for node's query with current parameter values.
+ */
+static void
+create_cursor (ForeignScanState *node)
+{
+  CassFdwScanState *fsstate = (CassFdwScanState *) node->fdw_state;
+  int k;
+
+  /* Mark the cursor as created, and show no rows have been retrieved */
+  fsstate->sql_sended = true;
+  fsstate->streams_started = 0;
+  fsstate->result = NULL;
+  fsstate->rows = NULL;
+  fsstate->fetch_ct_2 = 0;
+  fsstate->eof_reached = false;
+  fsstate->pending_count = 0;
+  fsstate->filling = NULL;
+  fsstate->replaying = NULL;
+
+  /*
+   * Compute the current values of the query's parameters: for the inner
+   * side of a nested loop, the outer row's join keys.  The values only
+   * have to last until they are bound below.
+   */
+  if (fsstate->numParams > 0)
+    {
+      ExprContext *econtext = node->ss.ps.ps_ExprContext;
+      MemoryContext oldcontext;
+      ListCell *lc;
+      int i = 0;
+
+      oldcontext = MemoryContextSwitchTo (econtext->ecxt_per_tuple_memory);
+      foreach (lc, fsstate->param_exprs)
+      {
+        ExprState *expr_state = (ExprState *) lfirst (lc);
+
+        fsstate->param_values[i] = ExecEvalExpr (expr_state, econtext,
+                                                 &fsstate->param_isnull[i],
+                                                 NULL);
+
+        /*
+         * A key never equals NULL, so there can't be any rows; nor can
+         * there be if the value is out of the range of the column's type.
+         */
+        if (fsstate->param_isnull[i] ||
+            (OidIsValid (fsstate->param_coltypes[i]) &&
+             !cassValueFitsType (fsstate->param_values[i],
+                                 fsstate->param_types[i],
+                                 fsstate->param_coltypes[i])))
+          {
+            MemoryContextSwitchTo (oldcontext);
+            fsstate->eof_reached = true;
+            return;
+          }
+        i++;
+      }
+
+      /*
+       * If we've looked these values up before, return the same rows
+       * again; otherwise save this lookup's rows for next time.
+       */
+      if (fsstate->lookup_cache != NULL)
+        {
+          lookup_cache_key (fsstate);
+          fsstate->replaying = lookup_cache_find (fsstate);
+          if (fsstate->replaying != NULL)
+            {
+              MemoryContextSwitchTo (oldcontext);
+              fsstate->replay_pos = 0;
+              return;
+            }
+          fsstate->filling = lookup_cache_start (fsstate);
+        }
+
+      MemoryContextSwitchTo (oldcontext);
+    }
+
+  /* A broker runs the query in a single request. */
+  if (fsstate->broker != NULL)
+    {
+      pgcass_BrokerExecute (fsstate->broker, fsstate->numParams,
+                            fsstate->param_values, fsstate->param_types,
+                            fsstate->param_typlen, fsstate->param_typbyval);
+      return;
+    }
+
+  /* A partition key list gets a stream for each distinct key. */
+  if (fsstate->has_key_list)
+    build_key_list (fsstate);
+  fsstate->cur_stream = fsstate->num_streams - 1;
+
+  /*
+   * Hand the token ranges to background workers if asked to.  If no worker
+   * could be started, read the ranges ourselves.
+   */
+  if (fsstate->parallel_workers > 0 && launch_scan_workers (fsstate))
+    return;
+
+  /*
+   * Get connection to the foreign server.  Connection manager will
+   * establish new connection if necessary.
+   */
+  if (fsstate->cass_conn == NULL && fsstate->num_streams > 0)
+    fsstate->cass_conn = pgcass_GetConnection (fsstate->server,
+                                               fsstate->user, false);
+
+  /*
+   * Send the first requests.  Of a long key list, only so many are sent at
+   * first; fetch_more_data starts another stream whenever one finishes.
+   */
+  for (k = 0; k < fsstate->num_streams; k++)
+    {
+      if (fsstate->has_key_list && k >= CASS_MAX_KEY_STREAMS)
+        break;
+      start_stream (fsstate, &fsstate->streams[k], k);
+      fsstate->streams_started++;
+    }
+
+  if (fsstate->num_streams == 0)
+    fsstate->eof_reached = true;
+}
+
+/*
+ * Collect the distinct non-null elements of the partition key list
+ * parameter into key_values, and set up a stream for each.  Duplicates
+ * must go, or their partition's rows would be returned more than once.
+ */
+static void
+build_key_list (CassFdwScanState *fsstate)
+{
+  MemoryContext oldcontext;
+  ArrayType *array;
+  int16 typlen;
+  bool typbyval;
+  char typalign;
+  Datum *elems;
+  bool *nulls;
+  int nelems;
+  CassKeyItem *items;
+  int nitems = 0;
+  int i;
+
+  MemoryContextReset (fsstate->key_cxt);
+  oldcontext = MemoryContextSwitchTo (fsstate->key_cxt);
+
+  array = DatumGetArrayTypeP (fsstate->param_values[fsstate->key_param]);
+  get_typlenbyvalalign (fsstate->key_type, &typlen, &typbyval, &typalign);
+  deconstruct_array (array, fsstate->key_type, typlen, typbyval, typalign,
+                     &elems, &nulls, &nelems);
+
+  items = (CassKeyItem *) palloc (Max (nelems, 1) * sizeof (CassKeyItem));
+  for (i = 0; i < nelems; i++)
+    {
+      CassKeyItem *item;
+      char *data;
+
+      /* A key never equals NULL. */
+      if (nulls[i])
+        continue;
+
+      /* Copy the bytes, as sorting moves the items around. */
+      item = &items[nitems++];
+      item->value = elems[i];
+      data = pgcass_datum_bytes (&elems[i], typlen, typbyval, &item->len);
+      item->data = (char *) palloc (Max (item->len, 1));
+      memcpy (item->data, data, item->len);
+      item->hash = DatumGetUInt32 (hash_any ((unsigned char *) item->data,
+                                             item->len));
+    }
+
+  qsort (items, nitems, sizeof (CassKeyItem), pgcass_key_cmp);
+
+  fsstate->key_values = (Datum *) palloc (Max (nitems, 1) * sizeof (Datum));
+  fsstate->num_streams = 0;
+  for (i = 0; i < nitems; i++)
+    {
+      if (i > 0 && pgcass_key_cmp (&items[i - 1], &items[i]) == 0)
+        continue;
+      fsstate->key_values[fsstate->num_streams++] = items[i].value;
+    }
+
+  fsstate->streams = (CassScanStream *)
+          palloc0 (Max (fsstate->num_streams, 1) * sizeof (CassScanStream));
+
+  MemoryContextSwitchTo (oldcontext);
+}
+
+/*
+ * Return the bytes a value is made of, which are the same for equal values
+ * of a type, except for varlena values stored in different forms.  *value
+ * must stay put as long as the result is used.
+ */
+static char *
+pgcass_datum_bytes (Datum *value, int16 typlen, bool typbyval, int *len)
+{
+  if (typbyval)
+    {
+      *len = sizeof (Datum);
+      return (char *) value;
+    }
+  else if (typlen > 0)
+    {
+      *len = typlen;
+      return DatumGetPointer (*value);
+    }
+  else
+    {
+      struct varlena *v = PG_DETOAST_DATUM_PACKED (*value);
+
+      *len = VARSIZE_ANY_EXHDR (v);
+      return VARDATA_ANY (v);
+    }
+}
+
+/*
+ * qsort comparator for the keys of build_key_list: orders by hash, then
+ * by bytes, which is all grouping equal keys needs.
+ */
+static int
+pgcass_key_cmp (const void *a, const void *b)
+{
+  const CassKeyItem *ka = (const CassKeyItem *) a;
+  const CassKeyItem *kb = (const CassKeyItem *) b;
+
+  if (ka->hash != kb->hash)
+    return ka->hash < kb->hash ? -1 : 1;
+  if (ka->len != kb->len)
+    return ka->len < kb->len ? -1 : 1;
+  return memcmp (ka->data, kb->data, ka->len);
+}
+
+/*
+ * Build the statement for a stream and send the request for its first
+ * page.  For a query split into token ranges, range selects the range the
+ * stream covers; for a partition key list, the key.
+ */
+static void
+start_stream (CassFdwScanState *fsstate, CassScanStream *stream, int range)
+{
+  const CassPrepared *prepared;
+  int k;
+
+  /*
+   * Build the statement from the query prepared on the connection.  Rows
+   * are retrieved one page at a time; the statement carries the paging
+   * state from one page to the next.  The parameters come first, the token
+   * range bounds, if any, last.
+   */
+  prepared = pgcass_GetPrepared (fsstate->cass_conn, fsstate->query);
+  stream->statement = cass_prepared_bind (prepared);
+
+  for (k = 0; k < fsstate->numParams; k++)
+    {
+      if (fsstate->has_key_list && k == fsstate->key_param)
+        pgcass_bind_param (stream->statement, prepared, k,
+                           fsstate->key_values[range], fsstate->key_type);
+      else
+        pgcass_bind_param (stream->statement, prepared, k,
+                           fsstate->param_values[k], fsstate->param_types[k]);
+    }
+
+  if (fsstate->token_ranges > 0)
+    {
+      /*
+       * Range k covers tokens (lower, upper] of an even split of the ring;
+       * the first range starts below the smallest token Murmur3Partitioner
+       * hands out and the last one ends at the largest.
+       */
+      uint64 step = (uint64) -1 / (uint64) fsstate->token_ranges;
+      int64 lower = (int64) ((uint64) CASS_MIN_TOKEN + step * range);
+      int64 upper = (range == fsstate->token_ranges - 1) ? CASS_MAX_TOKEN :
+              (int64) ((uint64) CASS_MIN_TOKEN + step * (range + 1));
+
+      pgcass_bind_param (stream->statement, prepared, fsstate->numParams,
+                         Int64GetDatum (lower), INT8OID);
+      pgcass_bind_param (stream->statement, prepared, fsstate->numParams + 1,
+                         Int64GetDatum (upper), INT8OID);
+    }
+
+  cass_statement_set_paging_size (stream->statement, fsstate->fetch_size);
+
+  /*
+   * Send the request for the first page right away; fetch_more_data waits
+   * for it only when the rows are actually needed.  All streams share the
+   * session, whose connections multiplex the requests.
+   */
+  stream->pending_future = cass_session_execute (fsstate->cass_conn,
+                                                 stream->statement);
+}
+
+/*
+ * Release everything create_cursor and fetch_more_data handed out, so that
+ * the next iteration starts the query from scratch.
+ */
+static void
+close_cursor (CassFdwScanState *fsstate)
+{
+  if (fsstate->pscan_seg != NULL)
+    shutdown_scan_workers (fsstate);
+
+  /* A lookup abandoned halfway is of no use to later ones. */
+  if (fsstate->filling != NULL)
+    {
+      MemoryContextReset (fsstate->filling->cxt);
+      fsstate->filling->keylen = -1;
+      fsstate->filling = NULL;
+    }
+  fsstate->replaying = NULL;
+
+  cassReleaseScanHandles (fsstate);
+
+  fsstate->sql_sended = false;
+}
+
+/*
+ * Free the driver objects of the scan's streams and current page.
+ */
+static void
+cassReleaseScanHandles (CassFdwScanState *fsstate)
+{
+  int k;
+
+  for (k = 0; k < fsstate->num_streams; k++)
+    {
+      CassScanStream *stream = &fsstate->streams[k];
+
+      /* Abandon a prefetch that nobody is going to consume */
+      if (stream->pending_future)
+        cass_future_free (stream->pending_future);
+      stream->pending_future = NULL;
+
+      if (stream->statement)
+        cass_statement_free (stream->statement);
+      stream->statement = NULL;
+    }
+
+  if (fsstate->rows)
+    cass_iterator_free (fsstate->rows);
+  fsstate->rows = NULL;
+
+  if (fsstate->result)
+    cass_result_free (fsstate->result);
+  fsstate->result = NULL;
+}
+
+/*
+ * Choose the stream to take the next page from: preferably one whose page
+ * has already arrived, taking streams in turn so that none of them stalls,
+ * otherwise the next one in turn that still has a request in flight.
+ * Returns -1 once every stream has been read to the end.
+ */
+static int
+next_ready_stream (CassFdwScanState *fsstate)
+{
+  int waiting = -1;
+  int n;
+
+  for (n = 1; n <= fsstate->num_streams; n++)
+    {
+      int k = (fsstate->cur_stream + n) % fsstate->num_streams;
+      CassFuture *future = fsstate->streams[k].pending_future;
+
+      if (future == NULL)
+        continue;
+      if (cass_future_ready (future))
+        return k;
+      if (waiting < 0)
+        waiting = k;
+    }
+
+  return waiting;
+}
+
+/*
+ * Fetch the next page of rows from the node's cursor.
+ *
+ * The page is taken from a request that is already in flight, and the
+ * request for the stream's following page is sent before this one is
+ * handed out, so that the round trip for page K+1 overlaps with the
+ * executor consuming page K.  Rows are decoded one at a time by
+ * cassIterateForeignScan.
+ */
+static void
+fetch_more_data (CassFdwScanState *fsstate)
+{
+  CassScanStream *stream;
+  int k;
+
+  /* Flush the previous page. */
+  if (fsstate->rows)
+    cass_iterator_free (fsstate->rows);
+  fsstate->rows = NULL;
+  if (fsstate->result)
+    cass_result_free (fsstate->result);
+  fsstate->result = NULL;
+
+  k = next_ready_stream (fsstate);
+  if (k < 0)
+    {
+      fsstate->eof_reached = true;
+      return;
+    }
+  fsstate->cur_stream = k;
+  stream = &fsstate->streams[k];
+
+  {
+    CassSession *conn = fsstate->cass_conn;
+    CassFuture* result_future = stream->pending_future;
+
+    Assert (result_future != NULL);
+    stream->pending_future = NULL;
+
+    if (cass_future_error_code (result_future) == CASS_OK)
+      {
+        const CassResult* res;
+
+        /* Retrieve result set */
+        res = cass_future_get_result (result_future);
+
+        /*
+         * Remember where this page ended and start fetching the next one
+         * while this one is consumed; the paging state is copied into the
+         * statement.
+         */
+        if (cass_result_has_more_pages (res))
+          {
+            cass_statement_set_paging_state (stream->statement, res);
+            stream->pending_future = cass_session_execute (conn,
+                                                           stream->statement);
+          }
+        else
+          {
+            /* This stream is done; put the next waiting one in flight. */
+            cass_statement_free (stream->statement);
+            stream->statement = NULL;
+
+            if (fsstate->streams_started < fsstate->num_streams)
+              {
+                start_stream (fsstate,
+                              &fsstate->streams[fsstate->streams_started],
+                              fsstate->streams_started);
+                fsstate->streams_started++;
+              }
+          }
+
+        /* Stash away the state info we have already */
+        fsstate->NumberOfColumns = cass_result_column_count (res);
+
+        /*
+         * Pick the per-column decoders the first time we see the result's
+         * column types; they stay the same for the rest of the scan.
+         */
+        if (!fsstate->decoders_valid)
+          pgcass_init_decoders (fsstate, res);
+
+        fsstate->result = res;
+        fsstate->rows = cass_iterator_from_result (res);
+
+        if (fsstate->fetch_ct_2 < 2)
+          fsstate->fetch_ct_2++;
+      }
+    else
+      {
+        /* Handle error */
+        const char* message;
+        size_t message_length;
+        CassError rc = cass_future_error_code (result_future);
+
+        /*
+         * The table may have changed since the statement was prepared;
+         * prepare it again next time.
+         */
+        if (rc == CASS_ERROR_SERVER_UNPREPARED ||
+            rc == CASS_ERROR_SERVER_INVALID_QUERY)
+          pgcass_ForgetPrepared (conn, fsstate->query);
+
+        cass_future_error_message (result_future, &message, &message_length);
+        message = pnstrdup (message, message_length);
+        cass_future_free (result_future);
+        ereport (ERROR,
+                 (errcode (ERRCODE_SYNTAX_ERROR),
+                  errmsg ("Unable to run query: '%s'\n", message)));
+      }
+
+    cass_future_free (result_future);
+  }
+}
+
+/*
+ * Decode a result row directly into the slot's tts_values/tts_isnull arrays
+ * and store it as a virtual tuple.  Pass-by-reference values live in
+ * temp_context, which is reset when the next row is stored, so no heap tuple
+ * and no per-row arrays are built.
+ */
+static void
+store_result_row_in_slot (const CassRow* row,
+                          int ncolumn,
+                          TupleTableSlot *slot,
+                          AttInMetadata *attinmeta,
+                          CassValueDecoder *decoders,
+                          List *retrieved_attrs,
+                          MemoryContext temp_context)
+{
+  TupleDesc tupdesc = slot->tts_tupleDescriptor;
+  Datum *values = slot->tts_values;
+  bool *nulls = slot->tts_isnull;
+  MemoryContext oldcontext;
+  ListCell *lc;
+  int j;
+
+  ExecClearTuple (slot);
+
+  /*
+   * Do the following work in a temp context that we reset for each tuple.
+   * This cleans up not only the data of the previous row, but any cruft the
+   * I/O functions might leak.
+   */
+  MemoryContextReset (temp_context);
+  oldcontext = MemoryContextSwitchTo (temp_context);
+
+  /* Initialize to nulls for any columns not present in result */
+  memset (values, 0, tupdesc->natts * sizeof (Datum));
+  memset (nulls, true, tupdesc->natts * sizeof (bool));
+
+  /*
+   * i indexes columns in the relation, j indexes columns in the result.
+   */
+  j = 0;
+
+  foreach (lc, retrieved_attrs)
+  {
+    int i = lfirst_int (lc);
     char buf[265];
     const char *valstr;
+    bool isnull;
+
+    const CassValue* cassVal = cass_row_get_column (row, j);
+    isnull = (cassVal == NULL || cass_value_is_null (cassVal));
+
+    if (i > 0)
+      {
+        /* ordinary column */
+        Assert (i <= tupdesc->natts);
+        nulls[i - 1] = isnull;
+
+        if (!isnull && decoders[j] != NULL)
+          {
+            /* Convert the value straight into a Datum */
+            values[i - 1] = decoders[j](cassVal);
+          }
+        else
+          {
+            valstr = isnull ? NULL : pgcass_transferValue (buf, cassVal);
+
+            /* Apply the input function even to nulls, to support domains */
+            values[i - 1] = InputFunctionCall (&attinmeta->attinfuncs[i - 1],
+                                               (char *) valstr,
+                                               attinmeta->attioparams[i - 1],
+                                               attinmeta->atttypmods[i - 1]);
+          }
+      }
+
+    j++;
+  }
+
+  /*
+   * Check we got the expected number of columns.
+   */
+  if (j > 0 && j != ncolumn)
+    elog (ERROR, "remote query result does not match the foreign table");
+
+  MemoryContextSwitchTo (oldcontext);
+
+  ExecStoreVirtualTuple (slot);
+}
+
+/*
+ * Set up a dynamic shared memory segment describing the scan, with one tuple
+ * queue per worker, and start background workers that claim the scan's
+ * token ranges from it.  Returns false, leaving the scan to read the ranges
+ * itself, if no worker could be registered.
+ */
+static bool
+launch_scan_workers (CassFdwScanState *fsstate)
+{
+  MemoryContext oldcontext;
+  shm_toc_estimator e;
+  shm_toc *toc;
+  dsm_segment *seg;
+  CassParallelScan *pscan;
+  char *query;
+  char *queues;
+  Size shared_size;
+  Size segsize;
+  ListCell *lc;
+  int nworkers = fsstate->parallel_workers;
+  int i;
+
+  /* We're called in per-tuple memory; this has to last for the scan. */
+  oldcontext = MemoryContextSwitchTo (GetMemoryChunkContext (fsstate));
+
+  shared_size = offsetof (CassParallelScan, attrs) +
+          list_length (fsstate->retrieved_attrs) * sizeof (int);
+
+  shm_toc_initialize_estimator (&e);
+  shm_toc_estimate_chunk (&e, shared_size);
+  shm_toc_estimate_chunk (&e, strlen (fsstate->query) + 1);
+  shm_toc_estimate_chunk (&e, (Size) nworkers * CASS_PSCAN_QUEUE_SIZE);
+  shm_toc_estimate_keys (&e, 3);
+  segsize = shm_toc_estimate (&e);
+
+  seg = dsm_create (segsize);
+  toc = shm_toc_create (CASS_PSCAN_MAGIC, dsm_segment_address (seg), segsize);
+
+  /* Describe the scan. */
+  pscan = (CassParallelScan *) shm_toc_allocate (toc, shared_size);
+  SpinLockInit (&pscan->mutex);
+  pscan->next_range = 0;
+  pscan->ranges_done = 0;
+  pscan->next_queue = 0;
+  pscan->num_ranges = fsstate->token_ranges;
+  pscan->num_queues = nworkers;
+  pscan->fetch_size = fsstate->fetch_size;
+  pscan->relid = RelationGetRelid (fsstate->rel);
+  pscan->userid = fsstate->userid;
+  strlcpy (pscan->dbname, get_database_name (MyDatabaseId), NAMEDATALEN);
+  strlcpy (pscan->username, GetUserNameFromId (GetSessionUserId ()),
+           NAMEDATALEN);
+  pscan->nattrs = 0;
+  foreach (lc, fsstate->retrieved_attrs)
+    pscan->attrs[pscan->nattrs++] = lfirst_int (lc);
+  shm_toc_insert (toc, CASS_PSCAN_KEY_SHARED, pscan);
+
+  query = (char *) shm_toc_allocate (toc, strlen (fsstate->query) + 1);
+  strcpy (query, fsstate->query);
+  shm_toc_insert (toc, CASS_PSCAN_KEY_QUERY, query);
+
+  /* Create the tuple queues, with us as the receiver of each. */
+  queues = (char *) shm_toc_allocate (toc,
+                                      (Size) nworkers * CASS_PSCAN_QUEUE_SIZE);
+  shm_toc_insert (toc, CASS_PSCAN_KEY_QUEUES, queues);
+
+  fsstate->worker_queues = (shm_mq_handle **)
+          palloc0 (nworkers * sizeof (shm_mq_handle *));
+  fsstate->worker_handles = (BackgroundWorkerHandle **)
+          palloc0 (nworkers * sizeof (BackgroundWorkerHandle *));
+
+  for (i = 0; i < nworkers; i++)
+    {
+      shm_mq *mq = shm_mq_create (queues + (Size) i * CASS_PSCAN_QUEUE_SIZE,
+                                  CASS_PSCAN_QUEUE_SIZE);
+
+      shm_mq_set_receiver (mq, MyProc);
+      fsstate->worker_queues[i] = shm_mq_attach (mq, seg, NULL);
+    }
+
+  /*
+   * Start the workers.  Workers claim queues in the order they start, so
+   * the first nworkers_launched queues are the ones that get used.  The
+   * number of queues is set above, before any worker can look at it.
+   */
+  fsstate->nworkers_launched = 0;
+  for (i = 0; i < nworkers; i++)
+    {
+      BackgroundWorker worker;
+
+      memset (&worker, 0, sizeof (worker));
+      snprintf (worker.bgw_name, BGW_MAXLEN, "cassandra2_fdw scan worker");
+      worker.bgw_flags = BGWORKER_SHMEM_ACCESS |
+              BGWORKER_BACKEND_DATABASE_CONNECTION;
+      worker.bgw_start_time = BgWorkerStart_ConsistentState;
+      worker.bgw_restart_time = BGW_NEVER_RESTART;
+      worker.bgw_main = NULL;
+      snprintf (worker.bgw_library_name, BGW_MAXLEN, "cassandra2_fdw");
+      snprintf (worker.bgw_function_name, BGW_MAXLEN,
+                "cassandra2_fdw_scan_worker_main");
+      worker.bgw_main_arg = UInt32GetDatum (dsm_segment_handle (seg));
+      worker.bgw_notify_pid = MyProcPid;
+
+      if (!RegisterDynamicBackgroundWorker (&worker,
+                                            &fsstate->worker_handles[i]))
+        break;
+      fsstate->nworkers_launched++;
+    }
+
+  /* Nobody is going to send on the queues of workers that didn't start. */
+  for (i = fsstate->nworkers_launched; i < nworkers; i++)
+    {
+      shm_mq_detach (shm_mq_get_queue (fsstate->worker_queues[i]));
+      fsstate->worker_queues[i] = NULL;
+    }
+
+  MemoryContextSwitchTo (oldcontext);
+
+  if (fsstate->nworkers_launched == 0)
+    {
+      elog (DEBUG1, "cassandra2_fdw could not start any scan worker");
+      dsm_detach (seg);
+      return false;
+    }
+
+  fsstate->pscan_seg = seg;
+  fsstate->pscan = pscan;
+  fsstate->next_queue = 0;
+
+  return true;
+}
+
+/*
+ * Store the next tuple sent by any of the scan's background workers in the
+ * slot, waiting for one if none is available yet.  Returns false once every
+ * worker has finished.
+ */
+static bool
+receive_worker_tuple (CassFdwScanState *fsstate, TupleTableSlot *slot)
+{
+  int n;
+
+  for (;;)
+    {
+      bool all_stopped = true;
+      int nbusy = 0;
+
+      /*
+       * Find out first whether any worker is still around, so that a queue
+       * found empty below can't belong to a worker that has yet to send.
+       */
+      for (n = 0; n < fsstate->nworkers_launched; n++)
+        {
+          pid_t pid;
+
+          if (GetBackgroundWorkerPid (fsstate->worker_handles[n], &pid) !=
+              BGWH_STOPPED)
+            all_stopped = false;
+        }
+
+      for (n = 0; n < fsstate->nworkers_launched; n++)
+        {
+          int i = (fsstate->next_queue + n) % fsstate->nworkers_launched;
+          shm_mq_result res;
+          Size nbytes;
+          void *data;
+
+          if (fsstate->worker_queues[i] == NULL)
+            continue;
+
+          res = shm_mq_receive (fsstate->worker_queues[i], &nbytes, &data,
+                                true);
+
+          if (res == SHM_MQ_SUCCESS)
+            {
+              HeapTupleData htup;
+              MemoryContext oldcontext;
+
+              /* Take the next tuple from the following queue. */
+              fsstate->next_queue = (i + 1) % fsstate->nworkers_launched;
+
+              /*
+               * The message is only valid until the next receive, and need
+               * not be aligned; copy it into per-tuple memory.
+               */
+              ExecClearTuple (slot);
+              MemoryContextReset (fsstate->temp_cxt);
+              oldcontext = MemoryContextSwitchTo (fsstate->temp_cxt);
+
+              htup.t_len = nbytes;
+              ItemPointerSetInvalid (&htup.t_self);
+              htup.t_tableOid = InvalidOid;
+              htup.t_data = (HeapTupleHeader) data;
+
+              ExecStoreTuple (heap_copytuple (&htup), slot, InvalidBuffer,
+                              false);
+              MemoryContextSwitchTo (oldcontext);
+
+              return true;
+            }
+
+          /*
+           * A detached queue has been drained: its worker is done.  So is
+           * a queue no worker attached to, once all workers have exited.
+           */
+          if (res == SHM_MQ_DETACHED || all_stopped)
+            {
+              fsstate->worker_queues[i] = NULL;
+              continue;
+            }
+
+          nbusy++;
+        }
+
+      if (nbusy == 0)
+        break;
+
+      /* Wait for a worker to send something or to exit. */
+      WaitLatch (&MyProc->procLatch, WL_LATCH_SET | WL_TIMEOUT, 1000L);
+      ResetLatch (&MyProc->procLatch);
+      CHECK_FOR_INTERRUPTS ();
+    }
+
+  /*
+   * Workers report each token range once all of its rows have been sent.
+   * If one exited early, we'd silently return a partial result otherwise.
+   */
+  SpinLockAcquire (&fsstate->pscan->mutex);
+  n = fsstate->pscan->ranges_done;
+  SpinLockRelease (&fsstate->pscan->mutex);
+
+  if (n != fsstate->pscan->num_ranges)
+    ereport (ERROR,
+             (errcode (ERRCODE_FDW_ERROR),
+              errmsg ("cassandra2_fdw scan worker exited before reading all token ranges"),
+              errhint ("See the server log for the worker's error.")));
+
+  return false;
+}
+
+/*
+ * Stop the scan's background workers and release the shared memory.
+ * Workers still sending notice the detached queues and exit on their own.
+ */
+static void
+shutdown_scan_workers (CassFdwScanState *fsstate)
+{
+  int i;
+
+  for (i = 0; i < fsstate->nworkers_launched; i++)
+    TerminateBackgroundWorker (fsstate->worker_handles[i]);
+
+  dsm_detach (fsstate->pscan_seg);
+
+  fsstate->pscan_seg = NULL;
+  fsstate->pscan = NULL;
+  fsstate->worker_queues = NULL;
+  fsstate->worker_handles = NULL;
+  fsstate->nworkers_launched = 0;
+}
+
+/*
+ * Main function of a background worker reading token ranges for a scan.
+ *
+ * The worker claims a tuple queue, opens its own session to the foreign
+ * server, and then keeps claiming token ranges until none are left,
+ * sending every row of each range to the scan as a heap tuple.
+ */
+void
+cassandra2_fdw_scan_worker_main (Datum main_arg)
+{
+  dsm_segment *seg;
+  shm_toc *toc;
+  CassParallelScan *pscan;
+  char *queues;
+  shm_mq *mq;
+  shm_mq_handle *mqh;
+  int queue;
+  int num_queues;
+  Relation rel;
+  ForeignTable *table;
+  ForeignServer *server;
+  UserMapping *user;
+  CassFdwScanState *fsstate;
+  TupleTableSlot *slot;
+  int i;
+
+  /* Establish signal handlers; once that's done, unblock signals. */
+  pqsignal (SIGTERM, die);
+  BackgroundWorkerUnblockSignals ();
+
+  /* Map the scan's shared memory. */
+  CurrentResourceOwner = ResourceOwnerCreate (NULL, "cassandra2_fdw scan worker");
+  seg = dsm_attach (DatumGetUInt32 (main_arg));
+  if (seg == NULL)
+    ereport (ERROR,
+             (errcode (ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+              errmsg ("could not map dynamic shared memory segment")));
+  toc = shm_toc_attach (CASS_PSCAN_MAGIC, dsm_segment_address (seg));
+  if (toc == NULL)
+    ereport (ERROR,
+             (errcode (ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+              errmsg ("bad magic number in dynamic shared memory segment")));
+  pscan = (CassParallelScan *) shm_toc_lookup (toc, CASS_PSCAN_KEY_SHARED);
+  queues = (char *) shm_toc_lookup (toc, CASS_PSCAN_KEY_QUEUES);
+
+  /* Claim a tuple queue and attach to it as the sender. */
+  SpinLockAcquire (&pscan->mutex);
+  queue = pscan->next_queue++;
+  num_queues = pscan->num_queues;
+  SpinLockRelease (&pscan->mutex);
+
+  /* Only as many workers start as there are queues; just in case. */
+  if (queue >= num_queues)
+    proc_exit (0);
+
+  mq = (shm_mq *) (queues + (Size) queue * CASS_PSCAN_QUEUE_SIZE);
+  shm_mq_set_sender (mq, MyProc);
+  mqh = shm_mq_attach (mq, seg, NULL);
+
+  /* Connect to the scan's database, and look up the foreign table. */
+  BackgroundWorkerInitializeConnection (pscan->dbname, pscan->username);
+
+  StartTransactionCommand ();
+
+  rel = heap_open (pscan->relid, AccessShareLock);
+  table = GetForeignTable (pscan->relid);
+  server = GetForeignServer (table->serverid);
+  user = GetUserMapping (pscan->userid, server->serverid);
+
+  /* Set up the same scan state the leader would use for a single stream. */
+  fsstate = (CassFdwScanState *) palloc0 (sizeof (CassFdwScanState));
+  fsstate->rel = rel;
+  fsstate->query = (char *) shm_toc_lookup (toc, CASS_PSCAN_KEY_QUERY);
+  for (i = 0; i < pscan->nattrs; i++)
+    fsstate->retrieved_attrs = lappend_int (fsstate->retrieved_attrs,
+                                            pscan->attrs[i]);
+  fsstate->fetch_size = pscan->fetch_size;
+  fsstate->token_ranges = pscan->num_ranges;
+  fsstate->num_streams = 1;
+  fsstate->streams = (CassScanStream *) palloc0 (sizeof (CassScanStream));
+  fsstate->cass_conn = pgcass_GetConnection (server, user, false);
+  fsstate->temp_cxt = AllocSetContextCreate (CurrentMemoryContext,
+                                             "cassandra2_fdw temporary data",
+                                             ALLOCSET_SMALL_MINSIZE,
+                                             ALLOCSET_SMALL_INITSIZE,
+                                             ALLOCSET_SMALL_MAXSIZE);
+  fsstate->attinmeta = TupleDescGetAttInMetadata (RelationGetDescr (rel));
+  fsstate->decoders = (CassValueDecoder *)
+          palloc0 ((pscan->nattrs + 1) * sizeof (CassValueDecoder));
 
-    const CassValue* cassVal = cass_row_get_column (row, i - 1);
-    if (cass_true == cass_value_is_null (cassVal))
-      valstr = NULL;
-    else
-      valstr = pgcass_transferValue (buf, cassVal);
+  slot = MakeSingleTupleTableSlot (RelationGetDescr (rel));
 
-    if (i > 0)
-      {
-        /* ordinary column */
-        Assert (i <= tupdesc->natts);
-        nulls[i - 1] = (valstr == NULL);
-        /* Apply the input function even to nulls, to support domains */
-        values[i - 1] = InputFunctionCall (&attinmeta->attinfuncs[i - 1],
-                                           (char *) valstr,
-                                           attinmeta->attioparams[i - 1],
-                                           attinmeta->atttypmods[i - 1]);
-      }
+  for (;;)
+    {
+      int range;
 
-    j++;
-  }
+      SpinLockAcquire (&pscan->mutex);
+      range = pscan->next_range++;
+      SpinLockRelease (&pscan->mutex);
 
-  /*
-   * Check we got the expected number of columns.  Note: j == 0 and
-   * PQnfields == 1 is expected, since deparse emits a NULL if no columns.
-   */
-  if (j > 0 && j != ncolumn)
-    elog (ERROR, "remote query result does not match the foreign table");
+      if (range >= pscan->num_ranges)
+        break;
 
-  /*
-   * Build the result tuple in caller's memory context.
-   */
-  MemoryContextSwitchTo (oldcontext);
+      start_stream (fsstate, &fsstate->streams[0], range);
+      fsstate->streams_started = 1;
+      fsstate->sql_sended = true;
+      fsstate->cur_stream = 0;
+      fsstate->eof_reached = false;
 
-  tuple = heap_form_tuple (tupdesc, values, nulls);
+      while (next_result_row (fsstate, slot))
+        {
+          HeapTuple tuple;
+          MemoryContext oldcontext;
 
-  /* Clean up */
-  MemoryContextReset (temp_context);
+          CHECK_FOR_INTERRUPTS ();
 
-  return tuple;
+          /* The tuple goes away with the row's temp data. */
+          oldcontext = MemoryContextSwitchTo (fsstate->temp_cxt);
+          tuple = ExecCopySlotTuple (slot);
+          MemoryContextSwitchTo (oldcontext);
+
+          /* If the scan has gone away, there's nobody left to read rows. */
+          if (shm_mq_send (mqh, tuple->t_len, tuple->t_data, false) !=
+              SHM_MQ_SUCCESS)
+            proc_exit (0);
+        }
+
+      close_cursor (fsstate);
+
+      SpinLockAcquire (&pscan->mutex);
+      pscan->ranges_done++;
+      SpinLockRelease (&pscan->mutex);
+    }
+
+  ExecDropSingleTupleTableSlot (slot);
+  heap_close (rel, AccessShareLock);
+  CommitTransactionCommand ();
+
+  proc_exit (0);
 }
 
-static const char *
+const char *
 pgcass_transferValue (char* buf, const CassValue* value)
 {
   const char* result = NULL;
@@ -1063,49 +4501,589 @@ pgcass_transferValue (char* buf, const CassValue* value)
       }
     case CASS_VALUE_TYPE_BOOLEAN:
       {
-        cass_bool_t b;
-        cass_value_get_bool (value, &b);
-        result = b ? "true" : "false";
-        break;
+        cass_bool_t b;
+        cass_value_get_bool (value, &b);
+        result = b ? "true" : "false";
+        break;
+      }
+    case CASS_VALUE_TYPE_DOUBLE:
+      {
+        cass_double_t d;
+        cass_value_get_double (value, &d);
+        sprintf (buf, "%f", d);
+        result = buf;
+        break;
+      }
+
+    case CASS_VALUE_TYPE_TEXT:
+    case CASS_VALUE_TYPE_ASCII:
+    case CASS_VALUE_TYPE_VARCHAR:
+      {
+        const char* s;
+        size_t s_length;
+        cass_value_get_string (value, &s, &s_length);
+        /* the driver's string is not null-terminated */
+        result = pnstrdup (s, s_length);
+        break;
+      }
+    case CASS_VALUE_TYPE_UUID:
+      {
+        CassUuid u;
+
+        cass_value_get_uuid (value, &u);
+        cass_uuid_string (u, buf);
+        result = buf;
+        break;
+      }
+    case CASS_VALUE_TYPE_LIST:
+    case CASS_VALUE_TYPE_MAP:
+    default:
+      result = "<unhandled type>";
+      break;
+    }
+
+  return result;
+}
+
+/*
+ * Choose a decoder for every column of the scan's result, based on the
+ * Cassandra type reported in the result metadata and the type of the
+ * foreign table column it is stored into.  Columns without a suitable
+ * decoder go through pgcass_transferValue and the type's input function.
+ */
+static void
+pgcass_init_decoders (CassFdwScanState *fsstate,
+                      const CassResult *res)
+{
+  TupleDesc tupdesc = RelationGetDescr (fsstate->rel);
+  ListCell *lc;
+  int j;
+
+  j = 0;
+  foreach (lc, fsstate->retrieved_attrs)
+  {
+    int i = lfirst_int (lc);
+
+    if (i > 0 && j < cass_result_column_count (res))
+      {
+        Form_pg_attribute attr = tupdesc->attrs[i - 1];
+
+        fsstate->decoders[j] =
+                pgcass_get_decoder (cass_result_column_type (res, j),
+                                    attr->atttypid, attr->atttypmod);
+      }
+    j++;
+  }
+
+  fsstate->decoders_valid = true;
+}
+
+static Datum
+pgcass_decode_int2 (const CassValue *value)
+{
+  cass_int16_t i;
+
+  cass_value_get_int16 (value, &i);
+  return Int16GetDatum (i);
+}
+
+static Datum
+pgcass_decode_int4 (const CassValue *value)
+{
+  cass_int32_t i;
+
+  cass_value_get_int32 (value, &i);
+  return Int32GetDatum (i);
+}
+
+static Datum
+pgcass_decode_int4_as_int8 (const CassValue *value)
+{
+  cass_int32_t i;
+
+  cass_value_get_int32 (value, &i);
+  return Int64GetDatum ((int64) i);
+}
+
+static Datum
+pgcass_decode_int8 (const CassValue *value)
+{
+  cass_int64_t i;
+
+  cass_value_get_int64 (value, &i);
+  return Int64GetDatum ((int64) i);
+}
+
+static Datum
+pgcass_decode_float4 (const CassValue *value)
+{
+  cass_float_t f;
+
+  cass_value_get_float (value, &f);
+  return Float4GetDatum (f);
+}
+
+static Datum
+pgcass_decode_float4_as_float8 (const CassValue *value)
+{
+  cass_float_t f;
+
+  cass_value_get_float (value, &f);
+  return Float8GetDatum ((float8) f);
+}
+
+static Datum
+pgcass_decode_float8 (const CassValue *value)
+{
+  cass_double_t d;
+
+  cass_value_get_double (value, &d);
+  return Float8GetDatum (d);
+}
+
+static Datum
+pgcass_decode_bool (const CassValue *value)
+{
+  cass_bool_t b;
+
+  cass_value_get_bool (value, &b);
+  return BoolGetDatum (b == cass_true);
+}
+
+static Datum
+pgcass_decode_text (const CassValue *value)
+{
+  const char *s;
+  size_t s_length;
+
+  cass_value_get_string (value, &s, &s_length);
+  return PointerGetDatum (cstring_to_text_with_len (s, (int) s_length));
+}
+
+static Datum
+pgcass_decode_bytea (const CassValue *value)
+{
+  const cass_byte_t *bytes;
+  size_t length;
+  bytea *result;
+
+  cass_value_get_bytes (value, &bytes, &length);
+  result = (bytea *) palloc (length + VARHDRSZ);
+  SET_VARSIZE (result, length + VARHDRSZ);
+  memcpy (VARDATA (result), bytes, length);
+
+  return PointerGetDatum (result);
+}
+
+/*
+ * CassUuid keeps the UUID as two integers; lay them out in the RFC 4122
+ * byte order that PostgreSQL's uuid type uses.
+ */
+static Datum
+pgcass_decode_uuid (const CassValue *value)
+{
+  CassUuid u;
+  unsigned char *data = (unsigned char *) palloc (UUID_LEN);
+  int k;
+
+  cass_value_get_uuid (value, &u);
+
+  /* time_low */
+  data[0] = (unsigned char) (u.time_and_version >> 24);
+  data[1] = (unsigned char) (u.time_and_version >> 16);
+  data[2] = (unsigned char) (u.time_and_version >> 8);
+  data[3] = (unsigned char) (u.time_and_version);
+  /* time_mid */
+  data[4] = (unsigned char) (u.time_and_version >> 40);
+  data[5] = (unsigned char) (u.time_and_version >> 32);
+  /* time_hi_and_version */
+  data[6] = (unsigned char) (u.time_and_version >> 56);
+  data[7] = (unsigned char) (u.time_and_version >> 48);
+  /* clock_seq and node */
+  for (k = 0; k < 8; k++)
+    data[8 + k] = (unsigned char) (u.clock_seq_and_node >> (56 - 8 * k));
+
+  return PointerGetDatum (data);
+}
+
+#ifdef HAVE_INT64_TIMESTAMP
+/*
+ * Cassandra timestamps are milliseconds since the Unix epoch, in UTC.
+ */
+static Datum
+pgcass_decode_timestamp (const CassValue *value)
+{
+  cass_int64_t ms;
+
+  cass_value_get_int64 (value, &ms);
+  return TimestampGetDatum ((Timestamp) ms * INT64CONST (1000) -
+                            (Timestamp) (POSTGRES_EPOCH_JDATE - UNIX_EPOCH_JDATE) *
+                            USECS_PER_DAY);
+}
+#endif
+
+/*
+ * Cassandra dates are days since the Unix epoch, biased by 2^31.
+ */
+static Datum
+pgcass_decode_date (const CassValue *value)
+{
+  cass_uint32_t d;
+  int64 days;
+
+  cass_value_get_uint32 (value, &d);
+  days = (int64) d - (INT64CONST (1) << 31);
+
+  return DateADTGetDatum ((DateADT) (days -
+                                     (POSTGRES_EPOCH_JDATE - UNIX_EPOCH_JDATE)));
+}
+
+/*
+ * Return the binary decoder for a (Cassandra type, PostgreSQL type) pair,
+ * or NULL if values of that pair have to be converted through text.
+ * Domains and types with a typmod that would need enforcing are left to the
+ * input function.
+ */
+CassValueDecoder
+pgcass_get_decoder (CassValueType cass_type, Oid pgtype, int32 pgtypmod)
+{
+  switch (cass_type)
+    {
+    case CASS_VALUE_TYPE_SMALL_INT:
+      if (pgtype == INT2OID)
+        return pgcass_decode_int2;
+      break;
+    case CASS_VALUE_TYPE_INT:
+      if (pgtype == INT4OID)
+        return pgcass_decode_int4;
+      if (pgtype == INT8OID)
+        return pgcass_decode_int4_as_int8;
+      break;
+    case CASS_VALUE_TYPE_BIGINT:
+    case CASS_VALUE_TYPE_COUNTER:
+      if (pgtype == INT8OID)
+        return pgcass_decode_int8;
+      break;
+    case CASS_VALUE_TYPE_FLOAT:
+      if (pgtype == FLOAT4OID)
+        return pgcass_decode_float4;
+      if (pgtype == FLOAT8OID)
+        return pgcass_decode_float4_as_float8;
+      break;
+    case CASS_VALUE_TYPE_DOUBLE:
+      if (pgtype == FLOAT8OID)
+        return pgcass_decode_float8;
+      break;
+    case CASS_VALUE_TYPE_BOOLEAN:
+      if (pgtype == BOOLOID)
+        return pgcass_decode_bool;
+      break;
+    case CASS_VALUE_TYPE_TEXT:
+    case CASS_VALUE_TYPE_ASCII:
+    case CASS_VALUE_TYPE_VARCHAR:
+      if (pgtype == TEXTOID || (pgtype == VARCHAROID && pgtypmod < 0))
+        return pgcass_decode_text;
+      break;
+    case CASS_VALUE_TYPE_BLOB:
+      if (pgtype == BYTEAOID)
+        return pgcass_decode_bytea;
+      break;
+    case CASS_VALUE_TYPE_UUID:
+    case CASS_VALUE_TYPE_TIMEUUID:
+      if (pgtype == UUIDOID)
+        return pgcass_decode_uuid;
+      break;
+#ifdef HAVE_INT64_TIMESTAMP
+    case CASS_VALUE_TYPE_TIMESTAMP:
+      if ((pgtype == TIMESTAMPOID || pgtype == TIMESTAMPTZOID) && pgtypmod < 0)
+        return pgcass_decode_timestamp;
+      break;
+#endif
+    case CASS_VALUE_TYPE_DATE:
+      if (pgtype == DATEOID)
+        return pgcass_decode_date;
+      break;
+    default:
+      break;
+    }
+
+  return NULL;
+}
+
+/*
+ * Check whether values of a PostgreSQL type can be bound to a query marker
+ * by pgcass_bind_param.
+ */
+static bool
+pgcass_is_bindable_type (Oid pgtype)
+{
+  switch (pgtype)
+    {
+    case INT2OID:
+    case INT4OID:
+    case INT8OID:
+    case FLOAT4OID:
+    case FLOAT8OID:
+    case BOOLOID:
+    case TEXTOID:
+    case VARCHAROID:
+    case BYTEAOID:
+    case UUIDOID:
+    case DATEOID:
+#ifdef HAVE_INT64_TIMESTAMP
+    case TIMESTAMPOID:
+    case TIMESTAMPTZOID:
+#endif
+      return true;
+    default:
+      return false;
+    }
+}
+
+/*
+ * Bind a non-null value to a query marker of a prepared statement,
+ * converting it to the Cassandra type of the marker.  That needn't be the
+ * type the value's PostgreSQL type stands for: a bigint column may well be
+ * compared with an integer.  A value the marker's type can't hold, or
+ * can't be converted to, is an error, as is anything else the driver
+ * refuses.
+ *
+ * Broker workers call this too, and they have no catalog access: nothing
+ * here may look anything up, not even to word an error message.
+ */
+void
+pgcass_bind_param (CassStatement *statement, const CassPrepared *prepared,
+                   size_t index, Datum value, Oid pgtype)
+{
+  const CassDataType *data_type;
+  CassValueType cass_type = CASS_VALUE_TYPE_UNKNOWN;
+  CassError rc;
+
+  data_type = cass_prepared_parameter_data_type (prepared, index);
+  if (data_type != NULL)
+    cass_type = cass_data_type_type (data_type);
+
+  /* Without the marker's type, bind the value as its own. */
+  if (cass_type == CASS_VALUE_TYPE_UNKNOWN)
+    rc = pgcass_bind_native (statement, index, value, pgtype);
+  else
+    rc = pgcass_bind_as (statement, index, value, pgtype, cass_type);
+
+  if (rc != CASS_OK)
+    ereport (ERROR,
+             (errcode (ERRCODE_FDW_INVALID_DATA_TYPE),
+              errmsg ("could not bind a value of type %u to query marker %d",
+                      pgtype, (int) index + 1),
+              errdetail_internal ("%s", cass_error_desc (rc))));
+}
+
+/*
+ * Read an integer value of any width; false if pgtype isn't an integer.
+ */
+static bool
+pgcass_get_int64 (Datum value, Oid pgtype, int64 *result)
+{
+  switch (pgtype)
+    {
+    case INT2OID:
+      *result = DatumGetInt16 (value);
+      return true;
+    case INT4OID:
+      *result = DatumGetInt32 (value);
+      return true;
+    case INT8OID:
+      *result = DatumGetInt64 (value);
+      return true;
+    default:
+      return false;
+    }
+}
+
+/*
+ * Report an integer value that doesn't fit the marker it is bound to.
+ */
+static void
+pgcass_int_out_of_range (int64 v, size_t index)
+{
+  ereport (ERROR,
+           (errcode (ERRCODE_NUMERIC_VALUE_OUT_OF_RANGE),
+            errmsg ("value " INT64_FORMAT " is out of range for the Cassandra type of query marker %d",
+                    v, (int) index + 1)));
+}
+
+/*
+ * Convert a value to the Cassandra type of the marker it is bound to.
+ * Returns CASS_ERROR_LIB_INVALID_VALUE_TYPE if the types don't go
+ * together.
+ */
+static CassError
+pgcass_bind_as (CassStatement *statement, size_t index, Datum value,
+                Oid pgtype, CassValueType cass_type)
+{
+  int64 v;
+
+  switch (cass_type)
+    {
+    case CASS_VALUE_TYPE_TINY_INT:
+      if (!pgcass_get_int64 (value, pgtype, &v))
+        break;
+      if (v < SCHAR_MIN || v > SCHAR_MAX)
+        pgcass_int_out_of_range (v, index);
+      return cass_statement_bind_int8 (statement, index, (cass_int8_t) v);
+    case CASS_VALUE_TYPE_SMALL_INT:
+      if (!pgcass_get_int64 (value, pgtype, &v))
+        break;
+      if (v < SHRT_MIN || v > SHRT_MAX)
+        pgcass_int_out_of_range (v, index);
+      return cass_statement_bind_int16 (statement, index, (cass_int16_t) v);
+    case CASS_VALUE_TYPE_INT:
+      if (!pgcass_get_int64 (value, pgtype, &v))
+        break;
+      if (v < INT_MIN || v > INT_MAX)
+        pgcass_int_out_of_range (v, index);
+      return cass_statement_bind_int32 (statement, index, (cass_int32_t) v);
+    case CASS_VALUE_TYPE_BIGINT:
+    case CASS_VALUE_TYPE_COUNTER:
+      if (!pgcass_get_int64 (value, pgtype, &v))
+        break;
+      return cass_statement_bind_int64 (statement, index, v);
+    case CASS_VALUE_TYPE_FLOAT:
+      if (pgtype == FLOAT4OID)
+        return cass_statement_bind_float (statement, index,
+                                          DatumGetFloat4 (value));
+      if (pgtype == FLOAT8OID)
+        return cass_statement_bind_float (statement, index,
+                                          (float) DatumGetFloat8 (value));
+      if (!pgcass_get_int64 (value, pgtype, &v))
+        break;
+      return cass_statement_bind_float (statement, index, (float) v);
+    case CASS_VALUE_TYPE_DOUBLE:
+      if (pgtype == FLOAT4OID)
+        return cass_statement_bind_double (statement, index,
+                                           DatumGetFloat4 (value));
+      if (pgtype == FLOAT8OID)
+        return cass_statement_bind_double (statement, index,
+                                           DatumGetFloat8 (value));
+      if (!pgcass_get_int64 (value, pgtype, &v))
+        break;
+      return cass_statement_bind_double (statement, index, (double) v);
+    case CASS_VALUE_TYPE_BOOLEAN:
+      if (pgtype != BOOLOID)
+        break;
+      return pgcass_bind_native (statement, index, value, pgtype);
+    case CASS_VALUE_TYPE_ASCII:
+    case CASS_VALUE_TYPE_TEXT:
+    case CASS_VALUE_TYPE_VARCHAR:
+      if (pgtype != TEXTOID && pgtype != VARCHAROID)
+        break;
+      return pgcass_bind_native (statement, index, value, pgtype);
+    case CASS_VALUE_TYPE_BLOB:
+      if (pgtype != BYTEAOID)
+        break;
+      return pgcass_bind_native (statement, index, value, pgtype);
+    case CASS_VALUE_TYPE_UUID:
+    case CASS_VALUE_TYPE_TIMEUUID:
+      if (pgtype != UUIDOID)
+        break;
+      return pgcass_bind_native (statement, index, value, pgtype);
+    case CASS_VALUE_TYPE_DATE:
+      if (pgtype != DATEOID)
+        break;
+      return pgcass_bind_native (statement, index, value, pgtype);
+#ifdef HAVE_INT64_TIMESTAMP
+    case CASS_VALUE_TYPE_TIMESTAMP:
+      if (pgtype == TIMESTAMPOID || pgtype == TIMESTAMPTZOID)
+        return pgcass_bind_native (statement, index, value, pgtype);
+      if (pgtype != DATEOID)
+        break;
+      /* Midnight UTC of the date, in milliseconds. */
+      return cass_statement_bind_int64 (statement, index,
+                                        ((int64) DatumGetDateADT (value) +
+                                         (POSTGRES_EPOCH_JDATE - UNIX_EPOCH_JDATE)) *
+                                        SECS_PER_DAY * INT64CONST (1000));
+#endif
+    default:
+      break;
+    }
+
+  return CASS_ERROR_LIB_INVALID_VALUE_TYPE;
+}
+
+/*
+ * Bind a value as the binary representation of the Cassandra type its
+ * PostgreSQL type stands for; the inverse of the decoders above.
+ */
+static CassError
+pgcass_bind_native (CassStatement *statement, size_t index,
+                    Datum value, Oid pgtype)
+{
+  switch (pgtype)
+    {
+    case INT2OID:
+      return cass_statement_bind_int16 (statement, index, DatumGetInt16 (value));
+    case INT4OID:
+      return cass_statement_bind_int32 (statement, index, DatumGetInt32 (value));
+    case INT8OID:
+      return cass_statement_bind_int64 (statement, index, DatumGetInt64 (value));
+    case FLOAT4OID:
+      return cass_statement_bind_float (statement, index, DatumGetFloat4 (value));
+    case FLOAT8OID:
+      return cass_statement_bind_double (statement, index, DatumGetFloat8 (value));
+    case BOOLOID:
+      return cass_statement_bind_bool (statement, index,
+                                       DatumGetBool (value) ? cass_true : cass_false);
+    case TEXTOID:
+    case VARCHAROID:
+      {
+        text *t = DatumGetTextPP (value);
+
+        return cass_statement_bind_string_n (statement, index, VARDATA_ANY (t),
+                                             VARSIZE_ANY_EXHDR (t));
       }
-    case CASS_VALUE_TYPE_DOUBLE:
+    case BYTEAOID:
       {
-        cass_double_t d;
-        cass_value_get_double (value, &d);
-        sprintf (buf, "%f", d);
-        result = buf;
-        break;
-      }
+        bytea *b = DatumGetByteaPP (value);
 
-    case CASS_VALUE_TYPE_TEXT:
-    case CASS_VALUE_TYPE_ASCII:
-    case CASS_VALUE_TYPE_VARCHAR:
-      {
-        const char* s;
-        size_t s_length;
-        cass_value_get_string (value, &s, &s_length);
-        //		sprintf(buf, "\"%.*s\"", (int)s_length, s);
-        result = s;
-        break;
+        return cass_statement_bind_bytes (statement, index,
+                                          (const cass_byte_t *) VARDATA_ANY (b),
+                                          VARSIZE_ANY_EXHDR (b));
       }
-    case CASS_VALUE_TYPE_UUID:
+    case UUIDOID:
       {
+        const unsigned char *data = DatumGetUUIDP (value)->data;
         CassUuid u;
-        char us[CASS_UUID_STRING_LENGTH];
+        int k;
 
-        cass_value_get_uuid (value, &u);
-        cass_uuid_string (u, us);
-        result = us;
-        break;
+        u.time_and_version = ((cass_uint64_t) data[6] << 56) |
+                ((cass_uint64_t) data[7] << 48) |
+                ((cass_uint64_t) data[4] << 40) |
+                ((cass_uint64_t) data[5] << 32) |
+                ((cass_uint64_t) data[0] << 24) |
+                ((cass_uint64_t) data[1] << 16) |
+                ((cass_uint64_t) data[2] << 8) |
+                (cass_uint64_t) data[3];
+        u.clock_seq_and_node = 0;
+        for (k = 0; k < 8; k++)
+          u.clock_seq_and_node = (u.clock_seq_and_node << 8) | data[8 + k];
+
+        return cass_statement_bind_uuid (statement, index, u);
       }
-    case CASS_VALUE_TYPE_LIST:
-    case CASS_VALUE_TYPE_MAP:
+    case DATEOID:
+      return cass_statement_bind_uint32 (statement, index,
+                                         (cass_uint32_t) ((int64) DatumGetDateADT (value) +
+                                                          (POSTGRES_EPOCH_JDATE - UNIX_EPOCH_JDATE) +
+                                                          (INT64CONST (1) << 31)));
+#ifdef HAVE_INT64_TIMESTAMP
+    case TIMESTAMPOID:
+    case TIMESTAMPTZOID:
+      return cass_statement_bind_int64 (statement, index,
+                                        (DatumGetTimestamp (value) +
+                                         (Timestamp) (POSTGRES_EPOCH_JDATE - UNIX_EPOCH_JDATE) *
+                                         USECS_PER_DAY) / INT64CONST (1000));
+#endif
     default:
-      result = "<unhandled type>";
-      break;
+      return CASS_ERROR_LIB_INVALID_VALUE_TYPE;
     }
-
-  return result;
 }
 
 /*
@@ -1114,28 +5092,20 @@ pgcass_transferValue (char* buf, const CassValue* value)
  * contains just "SELECT ... FROM tablename".
  *
  * We also create an integer List of the columns being retrieved, which is
- * returned to *retrieved_attrs.
+ * returned to *retrieved_attrs.  With count_only, no columns are retrieved
+ * and the statement selects the number of rows instead.
  */
 void
 deparseSelectSql (StringInfo buf,
                   PlannerInfo *root,
                   RelOptInfo *baserel,
                   Bitmapset *attrs_used,
-                  List **retrieved_attrs)
+                  List **retrieved_attrs,
+                  bool count_only)
 {
   RangeTblEntry *rte = planner_rt_fetch (baserel->relid, root);
   Relation rel;
-  char *opername, *leftvalue, *rightvalue;
-  Expr* expr, *left, *right;
-  OpExpr *oper;
-  HeapTuple tuple;
-  Oid rightargtype, leftargtype;
-  List *conditions;
-  ListCell *cell;
-  char ** columns;
-  int queryable_columns_count;
 
-  bool first_col;
   /*
    * Core code already has some lock on each rel being planned, so we can
    * use NoLock here.
@@ -1146,56 +5116,104 @@ deparseSelectSql (StringInfo buf,
    * Construct SELECT list
    */
   appendStringInfoString (buf, "SELECT ");
-  deparseTargetList (buf, root, baserel->relid, rel, attrs_used,
-                     retrieved_attrs);
+  if (count_only)
+    {
+      appendStringInfoString (buf, "count(*)");
+      *retrieved_attrs = NIL;
+    }
+  else
+    deparseTargetList (buf, root, baserel->relid, rel, attrs_used,
+                       retrieved_attrs);
 
   /*
    * Construct FROM clause
    */
   appendStringInfoString (buf, " FROM ");
 
-  {
-    char *svr_url = NULL;
-    char *svr_username = NULL;
-    char *svr_password = NULL;
-    char *svr_queryableColumns = NULL;
-    char *svr_table = NULL;
-    int svr_querytimeout = 0;
-    int svr_portNumber = 0;
-    char *tmp_string;
-    const char delim = ',';
-    /* Fetch options  */
-    //TODO get only table name and querable columns
-    cassGetOptions (rte->relid,
-                    &svr_url, &svr_querytimeout, &svr_portNumber,
-                    &svr_username, &svr_password,
-                    &svr_queryableColumns, &svr_table);
-
-    tmp_string = (char*) malloc (sizeof (char) *(strlen (svr_queryableColumns) + 1));
-    strcpy (tmp_string, svr_queryableColumns);
-
-    for (queryable_columns_count = 0;
-            tmp_string[queryable_columns_count];
-            tmp_string[queryable_columns_count] == delim ? queryable_columns_count++ : *tmp_string++);
-
-    columns = (char**) malloc (sizeof (char*)*queryable_columns_count);
-
-    char *token = strtok (svr_queryableColumns, ",");
-    int i = 0;
-    while (token)
-      {
+  appendStringInfoString (buf, pgcass_GetTableMetadata (rte->relid)->table);
 
-        columns[i++] = token;
-        token = strtok (NULL, ",");
-      }
+  heap_close (rel, NoLock);
+}
+
+/*
+ * Append a WHERE clause made of the restriction clauses of the foreign
+ * table that can be sent to Cassandra, if there are any, to "buf".
+ * key_complete tells whether the whole partition key will be restricted
+ * by equality, counting conditions the caller adds.
+ *
+ * Those clauses that are exactly enforced remotely, so that they needn't
+ * be checked locally too, are returned in *remote_conds.  Whether a WHERE
+ * clause was emitted is reported in *has_where.  Constants are sent as
+ * query markers; the values to bind to them are appended to *params, in
+ * order.  For each, *param_coltypes gets the type of the column the value
+ * must equal, or InvalidOid if it isn't compared for equality.
+ */
+static void
+deparseWhereClause (StringInfo buf,
+                    PlannerInfo *root,
+                    RelOptInfo *baserel,
+                    bool key_complete,
+                    bool *has_where,
+                    List **remote_conds,
+                    List **params,
+                    List **param_coltypes)
+{
+  CassFdwPlanState *fpinfo = (CassFdwPlanState *) baserel->fdw_private;
+  char *opername, *leftvalue, *rightvalue;
+  Expr* expr, *left, *right;
+  OpExpr *oper;
+  HeapTuple tuple;
+  Oid rightargtype, leftargtype;
+  List *conditions;
+  List *columns;
+  ListCell *cell;
+  Bitmapset *eq_attrs = NULL;
+  AttrNumber slice_attnum;
+  AttrNumber in_attnum = InvalidAttrNumber;
+  bool have_in = false;
 
+  bool first_col;
 
-    appendStringInfoString (buf, svr_table);
-  }
+  *remote_conds = NIL;
 
   /*
-   * Construct WHERE clause
+   * Equalities on key columns are only sent where Cassandra accepts them
+   * without ALLOW FILTERING: on the partition key if all of it is
+   * restricted, and then on the clustering columns up to the first one
+   * that isn't.  Those on columns in queryable_columns, such as indexed
+   * ones, are always sent.  Cassandra 2.x only takes IN on the last
+   * restricted column of the primary key: IN lists on the partition key
+   * are read partition by partition by cassGetForeignPlan, and one on
+   * that first clustering column not restricted by = may be sent.
    */
+  columns = list_copy (fpinfo->queryable_columns);
+  if (key_complete)
+    {
+      Bitmapset *fixed = cassGetFixedAttrs (baserel, fpinfo);
+
+      foreach (cell, fpinfo->partition_key_attrs)
+      {
+        columns = lappend (columns,
+                           makeString (cassGetColumnName (fpinfo->relid,
+                                                          lfirst_int (cell))));
+      }
+      foreach (cell, fpinfo->clustering_attrs)
+      {
+        AttrNumber attnum = (AttrNumber) lfirst_int (cell);
+
+        if (attnum == InvalidAttrNumber)
+          break;
+        if (!bms_is_member (attnum, fixed))
+          {
+            in_attnum = attnum;
+            break;
+          }
+        columns = lappend (columns,
+                           makeString (cassGetColumnName (fpinfo->relid,
+                                                          attnum)));
+      }
+    }
+
   conditions = baserel->baserestrictinfo;
   //TODO add where with clustering and or primary key
   first_col = true;
@@ -1224,14 +5242,32 @@ deparseSelectSql (StringInfo buf,
 
             if (strcmp (opername, "=") == 0)
               {
+                List *clause_params = NIL;
+
+                /* One side must be a column, the other a value. */
+                if (IsA (linitial (oper->args), Var) ==
+                    IsA (lsecond (oper->args), Var))
+                  continue;
+
                 left = (Expr *) linitial (oper->args);
-                leftvalue = processWhereClause (left, baserel, root, columns, queryable_columns_count);
+                leftvalue = processWhereClause (left, baserel, root, columns,
+                                                &clause_params);
 
                 right = (Expr *) lsecond (oper->args);
-                rightvalue = processWhereClause (right, baserel, root, columns, queryable_columns_count);
+                rightvalue = processWhereClause (right, baserel, root, columns,
+                                                 &clause_params);
 
                 if (rightvalue != NULL && leftvalue != NULL)
                   {
+                    Oid coltype = exprType (IsA (left, Var) ?
+                                            (Node *) left : (Node *) right);
+                    ListCell *lc;
+
+                    while (list_length (*param_coltypes) < list_length (*params))
+                      *param_coltypes = lappend_oid (*param_coltypes, InvalidOid);
+                    foreach (lc, clause_params)
+                      *param_coltypes = lappend_oid (*param_coltypes, coltype);
+                    *params = list_concat (*params, clause_params);
                     if (first_col)
                       {
                         first_col = false;
@@ -1249,17 +5285,490 @@ deparseSelectSql (StringInfo buf,
                     appendStringInfoString (buf, rightvalue);
                     //  (*pushdown_clauses)[++clause_count] = true;
 
+                    /* Remember the columns fixed to a single value. */
+                    {
+                      AttrNumber attnum;
+                      const char *op;
+                      Expr *value;
+
+                      if (cassGetValueRestriction (expr, baserel,
+                                                   &attnum, &op, &value))
+                        {
+                          eq_attrs = bms_add_member (eq_attrs, attnum);
+                          if (cassIsExactType (exprType ((Node *) value)))
+                            *remote_conds = lappend (*remote_conds,
+                                                     lfirst (cell));
+                        }
+                    }
                   }
                 //  (*pushdown_clauses)[++clause_count] = false;
               }
           }
       }
+    else if (expr->type == T_ScalarArrayOpExpr)
+      {
+        ScalarArrayOpExpr *saop = (ScalarArrayOpExpr *) expr;
+        char *inlist;
+
+        /* A column can only be restricted by one IN list. */
+        if (have_in)
+          continue;
+        inlist = processInList (saop, baserel, root, in_attnum, params);
+        if (inlist != NULL)
+          {
+            have_in = true;
+            appendStringInfoString (buf, first_col ? " WHERE " : " AND ");
+            first_col = false;
+            appendStringInfoString (buf, inlist);
+            if (cassIsExactType (get_element_type (exprType (lsecond (saop->args)))))
+              *remote_conds = lappend (*remote_conds, lfirst (cell));
+          }
+      }
   }
-  heap_close (rel, NoLock);
+
+  /*
+   * Send range conditions on the clustering column that CQL lets us slice
+   * a partition on, so that only the slice we need is returned.  Each
+   * bound can only be given once; any others are left to the local filter.
+   * Nor can a column restricted by IN be sliced as well.
+   */
+  slice_attnum = cassGetSliceColumn (fpinfo, eq_attrs);
+  if (slice_attnum != InvalidAttrNumber &&
+      !(have_in && slice_attnum == in_attnum))
+    {
+      bool have_lower = false;
+      bool have_upper = false;
+
+      foreach (cell, conditions)
+      {
+        AttrNumber attnum;
+        const char *op;
+        Expr *value;
+        Oid type;
+        bool upper;
+
+        expr = ((RestrictInfo *) lfirst (cell))->clause;
+        if (!cassGetValueRestriction (expr, baserel, &attnum, &op, &value) ||
+            attnum != slice_attnum)
+          continue;
+        type = exprType ((Node *) value);
+        if (type != get_atttype (fpinfo->relid, attnum))
+          continue;
+
+        /*
+         * Cassandra has no infinite dates or timestamps, and keeps the
+         * latter in milliseconds.  Values only known when the scan starts
+         * can't be checked or rounded, so only integer ones are sent.
+         */
+        if (IsA (value, Const))
+          {
+            Const *c = (Const *) value;
+
+            if (type == DATEOID &&
+                DATE_NOT_FINITE (DatumGetDateADT (c->constvalue)))
+              continue;
+            if ((type == TIMESTAMPOID || type == TIMESTAMPTZOID) &&
+                TIMESTAMP_NOT_FINITE (DatumGetTimestamp (c->constvalue)))
+              continue;
+          }
+        else if (type != INT2OID && type != INT4OID && type != INT8OID)
+          continue;
+
+        if (strcmp (op, ">") == 0 || strcmp (op, ">=") == 0)
+          {
+            if (have_lower)
+              continue;
+            have_lower = true;
+            upper = false;
+          }
+        else if (strcmp (op, "<") == 0 || strcmp (op, "<=") == 0)
+          {
+            if (have_upper)
+              continue;
+            have_upper = true;
+            upper = true;
+          }
+        else
+          continue;
+
+        appendStringInfoString (buf, first_col ? " WHERE " : " AND ");
+        first_col = false;
+        deparseColumnRef (buf, baserel->relid, attnum, root);
+        appendStringInfo (buf, " %s ", op);
+        if (deparseRangeBound (buf, value, upper, params))
+          *remote_conds = lappend (*remote_conds, lfirst (cell));
+      }
+    }
+
+  while (list_length (*param_coltypes) < list_length (*params))
+    *param_coltypes = lappend_oid (*param_coltypes, InvalidOid);
+
+  *has_where = !first_col;
+}
+
+/*
+ * Emit a condition restricting the partition key's token to a range whose
+ * bounds are bound as the statement's two parameters.
+ */
+static void
+deparseTokenRange (StringInfo buf, List *partition_key)
+{
+  StringInfoData token;
+  ListCell *lc;
+
+  initStringInfo (&token);
+  appendStringInfoString (&token, "token(");
+  foreach (lc, partition_key)
+  {
+    if (lc != list_head (partition_key))
+      appendStringInfoString (&token, ", ");
+    appendStringInfoString (&token, quote_identifier (strVal (lfirst (lc))));
+  }
+  appendStringInfoChar (&token, ')');
+
+  appendStringInfo (buf, "%s > ? AND %s <= ?", token.data, token.data);
+}
+
+/*
+ * Deparse "col = ANY (constant array)" as an IN list, if col is in_attnum,
+ * the only column Cassandra lets it restrict; see deparseWhereClause.
+ * Returns NULL if the condition can't be sent.  Elements of types that can
+ * be bound are sent as query markers, with their values appended to
+ * *params.
+ */
+static char *
+processInList (ScalarArrayOpExpr *saop, RelOptInfo *baserel,
+               PlannerInfo *root, AttrNumber in_attnum, List **params)
+{
+  StringInfoData result;
+  Var *var;
+  Const *c;
+  char *opname;
+  ArrayType *array;
+  Oid elemtype;
+  int16 typlen;
+  bool typbyval;
+  char typalign;
+  Datum *elems;
+  bool *nulls;
+  int nelems;
+  int i;
+  bool first = true;
+  List *elem_params = NIL;
+
+  if (!saop->useOr || list_length (saop->args) != 2 ||
+      !IsA (linitial (saop->args), Var) || !IsA (lsecond (saop->args), Const))
+    return NULL;
+
+  var = (Var *) linitial (saop->args);
+  c = (Const *) lsecond (saop->args);
+  if (in_attnum == InvalidAttrNumber ||
+      var->varno != baserel->relid || var->varlevelsup != 0 ||
+      var->varattno != in_attnum || c->constisnull)
+    return NULL;
+
+  opname = get_opname (saop->opno);
+  if (opname == NULL || strcmp (opname, "=") != 0)
+    return NULL;
+
+  array = DatumGetArrayTypeP (c->constvalue);
+  elemtype = ARR_ELEMTYPE (array);
+  get_typlenbyvalalign (elemtype, &typlen, &typbyval, &typalign);
+  deconstruct_array (array, elemtype, typlen, typbyval, typalign,
+                     &elems, &nulls, &nelems);
+
+  initStringInfo (&result);
+  deparseColumnRef (&result, baserel->relid, var->varattno, root);
+  appendStringInfoString (&result, " IN (");
+  for (i = 0; i < nelems; i++)
+    {
+      /*
+       * NULL elements never match, nor do integers the column can't hold;
+       * leave them out.
+       */
+      if (nulls[i] ||
+          !cassValueFitsType (elems[i], elemtype, var->vartype))
+        continue;
+
+      if (!first)
+        appendStringInfoString (&result, ", ");
+      first = false;
+      if (pgcass_is_bindable_type (elemtype))
+        {
+          appendStringInfoChar (&result, '?');
+          elem_params = lappend (elem_params,
+                                 makeConst (elemtype, -1, c->constcollid,
+                                            typlen, elems[i], false,
+                                            typbyval));
+        }
+      else
+        appendStringInfoString (&result, datumToString (elems[i], elemtype));
+    }
+  appendStringInfoChar (&result, ')');
+
+  /* With nothing left to match, leave it to the local filter. */
+  if (first)
+    return NULL;
+
+  *params = list_concat (*params, elem_params);
+  return result.data;
+}
+
+/*
+ * Check whether an expression has a single value for a whole execution of
+ * the scan: a non-null constant, or an expression of parameters and stable
+ * functions of a type that can be bound, which is evaluated when the scan
+ * starts.
+ */
+static bool
+cassIsRuntimeValue (Expr *expr)
+{
+  if (IsA (expr, Const))
+    return !((Const *) expr)->constisnull;
+
+  return pgcass_is_bindable_type (exprType ((Node *) expr)) &&
+          !contain_var_clause ((Node *) expr) &&
+          !contain_volatile_functions ((Node *) expr) &&
+          !contain_subplans ((Node *) expr);
+}
+
+/*
+ * Check whether a restriction compares a column of baserel with a value
+ * that is constant for the scan, as of cassIsRuntimeValue.  If so, return
+ * the column's attribute number, the value, and the operator's name as if
+ * the column were on its left.
+ */
+static bool
+cassGetValueRestriction (Expr *clause, RelOptInfo *baserel,
+                         AttrNumber *attnum, const char **opname,
+                         Expr **value)
+{
+  OpExpr *op = (OpExpr *) clause;
+  Var *var;
+  Expr *other;
+  char *name;
+  bool commuted;
+
+  if (!IsA (clause, OpExpr) || list_length (op->args) != 2)
+    return false;
+
+  if (IsA (linitial (op->args), Var) && !IsA (lsecond (op->args), Var))
+    {
+      var = (Var *) linitial (op->args);
+      other = (Expr *) lsecond (op->args);
+      commuted = false;
+    }
+  else if (!IsA (linitial (op->args), Var) && IsA (lsecond (op->args), Var))
+    {
+      var = (Var *) lsecond (op->args);
+      other = (Expr *) linitial (op->args);
+      commuted = true;
+    }
+  else
+    return false;
+
+  if (var->varno != baserel->relid || var->varlevelsup != 0 ||
+      var->varattno < 1 || !cassIsRuntimeValue (other))
+    return false;
+
+  name = get_opname (op->opno);
+  if (name == NULL)
+    return false;
+
+  if (strcmp (name, "=") == 0)
+    *opname = "=";
+  else if (strcmp (name, "<") == 0)
+    *opname = commuted ? ">" : "<";
+  else if (strcmp (name, "<=") == 0)
+    *opname = commuted ? ">=" : "<=";
+  else if (strcmp (name, ">") == 0)
+    *opname = commuted ? "<" : ">";
+  else if (strcmp (name, ">=") == 0)
+    *opname = commuted ? "<=" : ">=";
+  else
+    return false;
+
+  *attnum = var->varattno;
+  *value = other;
+  return true;
+}
+
+/*
+ * Return the clustering column range conditions may be sent on, given the
+ * columns restricted by equality, or InvalidAttrNumber if there is none.
+ * CQL only slices a single partition, so the whole partition key must be
+ * fixed, and then only on the first clustering column not fixed, after
+ * all the ones before it.  The column's type must also order values the
+ * way Cassandra does, or the slice could leave out rows we need.
+ */
+static AttrNumber
+cassGetSliceColumn (CassFdwPlanState *fpinfo, Bitmapset *eq_attrs)
+{
+  ListCell *lc;
+
+  if (fpinfo->partition_key_attrs == NIL)
+    return InvalidAttrNumber;
+
+  foreach (lc, fpinfo->partition_key_attrs)
+  {
+    if (!bms_is_member (lfirst_int (lc), eq_attrs))
+      return InvalidAttrNumber;
+  }
+
+  foreach (lc, fpinfo->clustering_attrs)
+  {
+    AttrNumber attnum = (AttrNumber) lfirst_int (lc);
+
+    if (attnum == InvalidAttrNumber)
+      return InvalidAttrNumber;
+    if (!bms_is_member (attnum, eq_attrs))
+      return cassIsOrderedType (get_atttype (fpinfo->relid, attnum)) ?
+              attnum : InvalidAttrNumber;
+  }
+
+  return InvalidAttrNumber;
+}
+
+/*
+ * Check whether PostgreSQL orders values of a type the way Cassandra orders
+ * the values of the column type it stands for.
+ */
+static bool
+cassIsOrderedType (Oid type)
+{
+  switch (type)
+    {
+    case INT2OID:
+    case INT4OID:
+    case INT8OID:
+    case FLOAT4OID:
+    case FLOAT8OID:
+    case DATEOID:
+#ifdef HAVE_INT64_TIMESTAMP
+    case TIMESTAMPOID:
+    case TIMESTAMPTZOID:
+#endif
+      return true;
+    default:
+      return false;
+    }
+}
+
+/*
+ * Check whether = conditions on a column may be sent: it is a key column,
+ * or is listed in the queryable_columns option.  Key columns are only
+ * restricted as far as CQL allows; see deparseWhereClause.
+ */
+static bool
+cassIsQueryableColumn (CassFdwPlanState *fpinfo, AttrNumber attnum)
+{
+  char *colname;
+  ListCell *lc;
+
+  if (attnum > 0 &&
+      (list_member_int (fpinfo->partition_key_attrs, attnum) ||
+       list_member_int (fpinfo->clustering_attrs, attnum)))
+    return true;
+
+  colname = cassGetColumnName (fpinfo->relid, attnum);
+
+  foreach (lc, fpinfo->queryable_columns)
+  {
+    if (strcmp (strVal (lfirst (lc)), colname) == 0)
+      return true;
+  }
+
+  return false;
+}
+
+/*
+ * Emit a value bounding a range condition, as a query marker whose value
+ * is appended to *params if its type can be bound.  Cassandra keeps
+ * timestamps in milliseconds, so those are sent rounded outwards: the
+ * remote condition may then let through a few rows too many, which the
+ * local filter drops, but never too few.  Returns true if the remote
+ * condition is exactly the local one.
+ */
+static bool
+deparseRangeBound (StringInfo buf, Expr *expr, bool upper, List **params)
+{
+  Const *value;
+
+  /* Values only known when the scan starts are bound as they are. */
+  if (!IsA (expr, Const))
+    {
+      appendStringInfoChar (buf, '?');
+      *params = lappend (*params, expr);
+      return cassIsExactType (exprType ((Node *) expr));
+    }
+  value = (Const *) expr;
+
+#ifdef HAVE_INT64_TIMESTAMP
+  if (value->consttype == TIMESTAMPOID || value->consttype == TIMESTAMPTZOID)
+    {
+      int64 epoch = (int64) (POSTGRES_EPOCH_JDATE - UNIX_EPOCH_JDATE) * USECS_PER_DAY;
+      int64 us = DatumGetTimestamp (value->constvalue) + epoch;
+      int64 ms = us / 1000;
+
+      /* Division truncates towards zero; round to the outer millisecond. */
+      if (us % 1000 != 0 && (upper ? us > 0 : us < 0))
+        ms += upper ? 1 : -1;
+
+      appendStringInfoChar (buf, '?');
+      *params = lappend (*params,
+                         makeConst (value->consttype, -1, InvalidOid,
+                                    sizeof (Timestamp),
+                                    TimestampGetDatum (ms * 1000 - epoch),
+                                    false, FLOAT8PASSBYVAL));
+      return us % 1000 == 0;
+    }
+#endif
+
+  if (pgcass_is_bindable_type (value->consttype))
+    {
+      appendStringInfoChar (buf, '?');
+      *params = lappend (*params, value);
+    }
+  else
+    appendStringInfoString (buf, datumToString (value->constvalue,
+                                                value->consttype));
+  return cassIsExactType (value->consttype);
+}
+
+/*
+ * Check whether Cassandra compares values of a type sent from PostgreSQL
+ * exactly the way PostgreSQL does, so that a condition on them selects the
+ * same rows on both sides.  Floating point values may not survive the
+ * trip through text, and padded or timestamp text may be read differently.
+ */
+static bool
+cassIsExactType (Oid type)
+{
+  switch (type)
+    {
+    case INT2OID:
+    case INT4OID:
+    case INT8OID:
+    case BOOLOID:
+    case TEXTOID:
+    case VARCHAROID:
+    case UUIDOID:
+    case DATEOID:
+      return true;
+    default:
+      return false;
+    }
 }
 
+/*
+ * Deparse one side of a condition: a column among columns, or a constant.
+ * Non-null constants of types that can be bound are sent as query markers,
+ * with their values appended to *params.  Returns NULL if the expression
+ * can't be sent.
+ */
 static char*
-processWhereClause (Expr *expr, RelOptInfo *baserel, PlannerInfo *root, char ** columns, int columns_count)
+processWhereClause (Expr *expr, RelOptInfo *baserel, PlannerInfo *root, List *columns,
+                    List **params)
 {
   StringInfoData result;
   Var *variable;
@@ -1273,6 +5782,12 @@ processWhereClause (Expr *expr, RelOptInfo *baserel, PlannerInfo *root, char **
           initStringInfo (&result);
           appendStringInfo (&result, "NULL");
         }
+      else if (params != NULL && pgcass_is_bindable_type (constant->consttype))
+        {
+          initStringInfo (&result);
+          appendStringInfoChar (&result, '?');
+          *params = lappend (*params, constant);
+        }
       else
         {
           /* get a string representation of the value */
@@ -1289,25 +5804,39 @@ processWhereClause (Expr *expr, RelOptInfo *baserel, PlannerInfo *root, char **
             }
         }
     }
+  else if (expr->type != T_Var)
+    {
+      /*
+       * Parameters and stable functions are evaluated when the scan starts,
+       * and the result bound.
+       */
+      if (params == NULL || !cassIsRuntimeValue (expr))
+        return NULL;
+      initStringInfo (&result);
+      appendStringInfoChar (&result, '?');
+      *params = lappend (*params, expr);
+    }
   else if (expr->type == T_Var)
     {
-      int i;
+      ListCell *lc;
+      char *colname;
       variable = (Var *) expr;
       /* System columns not supported */
-      if (variable->varattno < 1)
+      if (variable->varattno < 1 || variable->varno != baserel->relid)
         {
           return NULL;
         }
-      initStringInfo (&result);
-      deparseColumnRef (&result, baserel->relid, variable->varattno, root);
-      for (i = 0; i < columns_count; i++)
-        {
-          if (strcmp (columns[i], result.data) == 0)
-            {
-
-              return result.data;
-            }
-        }
+      colname = cassGetColumnName (planner_rt_fetch (baserel->relid, root)->relid,
+                                   variable->varattno);
+      foreach (lc, columns)
+      {
+        if (strcmp (strVal (lfirst (lc)), colname) == 0)
+          {
+            initStringInfo (&result);
+            deparseColumnRef (&result, baserel->relid, variable->varattno, root);
+            return result.data;
+          }
+      }
 
       return NULL;
     }
@@ -1438,9 +5967,6 @@ deparseColumnRef (StringInfo buf, int varno, int varattno, PlannerInfo * root)
 {
 
   RangeTblEntry *rte;
-  char *colname = NULL;
-  List *options;
-  ListCell *lc;
 
   /* varno must not be any of OUTER_VAR, INNER_VAR and INDEX_VAR. */
   Assert (!IS_SPECIAL_VARNO (varno));
@@ -1448,29 +5974,24 @@ deparseColumnRef (StringInfo buf, int varno, int varattno, PlannerInfo * root)
   /* Get RangeTblEntry from array in PlannerInfo. */
   rte = planner_rt_fetch (varno, root);
 
-  /*
-   * If it's a column of a foreign table, and it has the column_name FDW
-   * option, use that value.
-   */
-  options = GetForeignColumnOptions (rte->relid, varattno);
-
-  foreach (lc, options)
-  {
-    DefElem *def = (DefElem *) lfirst (lc);
+  appendStringInfoString (buf,
+                          quote_identifier (cassGetColumnName (rte->relid,
+                                                               varattno)));
+}
 
-    if (strcmp (def->defname, "column_name") == 0)
-      {
-        colname = defGetString (def);
-        break;
-      }
-  }
+/*
+ * Return the Cassandra name of a foreign table column: its column_name FDW
+ * option if it has one, its attribute name otherwise.  These are cached
+ * per table, as they are looked up for every column reference.
+ */
+static char *
+cassGetColumnName (Oid relid, int attnum)
+{
+  CassTableMetadata *metadata = pgcass_GetTableMetadata (relid);
 
-  /*
-   * If it's a column of a regular table or it doesn't have column_name FDW
-   * option, use attribute name.
-   */
-  if (colname == NULL)
-    colname = get_relid_attribute_name (rte->relid, varattno);
+  if (attnum < 1 || attnum > metadata->natts)
+    elog (ERROR, "invalid attribute number %d for foreign table %u",
+          attnum, relid);
 
-  appendStringInfoString (buf, quote_identifier (colname));
+  return pstrdup (metadata->column_names[attnum - 1]);
 }
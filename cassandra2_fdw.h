@@ -19,14 +19,94 @@
 
 #include <cassandra.h>
 
+#include "executor/tuptable.h"
 #include "foreign/foreign.h"
+#include "funcapi.h"
 #include "lib/stringinfo.h"
 #include "nodes/relation.h"
 #include "utils/rel.h"
 
+/*
+ * Names a foreign table's data is known by in Cassandra.
+ */
+typedef struct CassTableMetadata
+{
+  char *table; /* value of the table option, or NULL */
+  int natts; /* # of entries in column_names */
+  char **column_names; /* Cassandra name of each column, by attnum - 1 */
+} CassTableMetadata;
+
+/*
+ * Key columns of a Cassandra table, as recorded in the cluster's schema.
+ * Columns are given by their Cassandra names.
+ */
+typedef struct CassTableKeys
+{
+  List *partition_key; /* partition key columns, in key order */
+  List *clustering_columns; /* clustering columns, in clustering order */
+  List *clustering_desc; /* int list, nonzero for DESC clustering columns */
+} CassTableKeys;
+
+/*
+ * Converts a non-null Cassandra value directly into a Datum of a particular
+ * PostgreSQL type, without going through the type's text input function.
+ */
+typedef Datum (*CassValueDecoder) (const CassValue *value);
+
+/*
+ * A scan whose query is run by a broker worker; see cass_broker.c.
+ */
+typedef struct CassBrokerScan CassBrokerScan;
+
+/* in cassandra2_fdw.c */
+extern const char *pgcass_transferValue (char *buf, const CassValue *value);
+extern CassValueDecoder pgcass_get_decoder (CassValueType cass_type,
+                                            Oid pgtype, int32 pgtypmod);
+extern void pgcass_bind_param (CassStatement *statement,
+                               const CassPrepared *prepared, size_t index,
+                               Datum value, Oid pgtype);
+
 /* in cass_connection.c */
 extern CassSession *pgcass_GetConnection (ForeignServer *server, UserMapping *user,
                                           bool will_prep_stmt);
+extern CassSession *pgcass_GetConnectionInDatabase (Oid dbid,
+                                                    ForeignServer *server,
+                                                    UserMapping *user);
+extern CassSession *pgcass_GetConnectionNoWait (Oid dbid, ForeignServer *server,
+                                                UserMapping *user,
+                                                CassFutureCallback callback,
+                                                void *data);
 extern void pgcass_ReleaseConnection (CassSession *session);
+extern const CassPrepared *pgcass_GetPrepared (CassSession *session,
+                                               const char *query);
+extern const CassPrepared *pgcass_FindPrepared (CassSession *session,
+                                                const char *query);
+extern const CassPrepared *pgcass_AddPrepared (CassSession *session,
+                                               const char *query,
+                                               CassFuture *prepare_future);
+extern void pgcass_ForgetPrepared (CassSession *session, const char *query);
+
+/* in cass_metadata.c */
+extern CassTableMetadata *pgcass_GetTableMetadata (Oid relid);
+extern CassTableKeys *pgcass_GetTableKeys (Oid relid);
+extern bool pgcass_GetSizeEstimates (Oid relid, double *partitions,
+                                     double *partition_size);
+
+/* in cass_broker.c */
+extern void pgcass_InitBroker (void);
+extern bool pgcass_BrokerAvailable (void);
+extern CassBrokerScan *pgcass_BrokerBeginScan (ForeignServer *server,
+                                               UserMapping *user,
+                                               Relation rel,
+                                               const char *query,
+                                               List *retrieved_attrs,
+                                               int fetch_size);
+extern void pgcass_BrokerExecute (CassBrokerScan *scan, int nparams,
+                                  Datum *values, Oid *types,
+                                  int16 *typlens, bool *typbyvals);
+extern bool pgcass_BrokerNextRow (CassBrokerScan *scan, TupleTableSlot *slot,
+                                  AttInMetadata *attinmeta,
+                                  MemoryContext temp_context);
+extern void pgcass_BrokerEndScan (CassBrokerScan *scan);
 
 #endif /* CASSANDRA2_FDW_H_ */
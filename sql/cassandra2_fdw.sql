@@ -0,0 +1,81 @@
+CREATE EXTENSION cassandra2_fdw;
+CREATE SERVER cass_serv FOREIGN DATA WRAPPER cassandra2_fdw
+    OPTIONS (url 'localhost');
+CREATE USER MAPPING FOR public SERVER cass_serv
+    OPTIONS (username 'test', password 'test');
+
+-- The key columns are given, so that planning needs no connection.
+CREATE FOREIGN TABLE kv (id int, ck bigint, val text) SERVER cass_serv
+    OPTIONS (table 'ks.kv', partition_key 'id', clustering_columns 'ck');
+
+-- Values compared with key columns are bound to query markers.
+EXPLAIN (VERBOSE, COSTS OFF) SELECT * FROM kv WHERE id = 1;
+EXPLAIN (VERBOSE, COSTS OFF) SELECT * FROM kv WHERE id = 1 AND ck = 5;
+
+-- A list of partition keys is read one partition at a time.
+EXPLAIN (VERBOSE, COSTS OFF) SELECT * FROM kv WHERE id IN (1, 2, 3);
+
+-- IN is only sent on the first clustering column not fixed by =.
+EXPLAIN (VERBOSE, COSTS OFF) SELECT * FROM kv WHERE id = 1 AND ck IN (1, 2);
+EXPLAIN (VERBOSE, COSTS OFF) SELECT * FROM kv WHERE id = 1 AND val IN ('a', 'b');
+
+-- Range bounds of the column's own type slice the partition.
+EXPLAIN (VERBOSE, COSTS OFF) SELECT * FROM kv WHERE id = 1 AND ck >= 10::bigint;
+
+-- Without the partition key, conditions on key columns are checked locally.
+EXPLAIN (VERBOSE, COSTS OFF) SELECT * FROM kv WHERE ck = 5;
+
+-- Key columns may be compared with integers of another width.
+CREATE FOREIGN TABLE kb (id bigint, val text) SERVER cass_serv
+    OPTIONS (table 'ks.kb', partition_key 'id', clustering_columns '');
+EXPLAIN (VERBOSE, COSTS OFF) SELECT * FROM kb WHERE id = 1;
+
+-- An integer the key column can't hold matches no rows, and is never sent.
+EXPLAIN (VERBOSE, COSTS OFF) SELECT * FROM kv WHERE id = 5000000000;
+SELECT * FROM kv WHERE id = 5000000000;
+
+-- A LIMIT is sent when the scan returns exactly the rows it applies to.
+EXPLAIN (VERBOSE, COSTS OFF) SELECT * FROM kv WHERE id = 1 LIMIT 3;
+EXPLAIN (VERBOSE, COSTS OFF) SELECT * FROM kv WHERE id = 1 AND val = 'x' LIMIT 3;
+EXPLAIN (VERBOSE, COSTS OFF) SELECT * FROM kv WHERE id = 1 ORDER BY val LIMIT 3;
+SET enable_hashjoin = off;
+SET enable_mergejoin = off;
+SET enable_material = off;
+EXPLAIN (VERBOSE, COSTS OFF)
+SELECT * FROM kv a, kv b WHERE a.id = 1 AND b.id IN (1, 2, 3) LIMIT 3;
+RESET enable_hashjoin;
+RESET enable_mergejoin;
+RESET enable_material;
+
+-- A partition is read in clustering order, or in reverse, without a Sort.
+EXPLAIN (VERBOSE, COSTS OFF) SELECT * FROM kv WHERE id = 1 ORDER BY ck LIMIT 5;
+EXPLAIN (VERBOSE, COSTS OFF) SELECT * FROM kv WHERE id = 1 ORDER BY ck DESC LIMIT 5;
+CREATE FOREIGN TABLE kd (id int, ck bigint, val text) SERVER cass_serv
+    OPTIONS (table 'ks.kd', partition_key 'id', clustering_columns 'ck',
+             clustering_order 'DESC');
+EXPLAIN (VERBOSE, COSTS OFF) SELECT * FROM kd WHERE id = 1 ORDER BY ck LIMIT 5;
+
+-- Rows are counted remotely when the scan names its partitions, or is split
+-- into token ranges.
+EXPLAIN (VERBOSE, COSTS OFF) SELECT count(*) FROM kv WHERE id = 1;
+CREATE FOREIGN TABLE kp (id int, ck bigint, val text) SERVER cass_serv
+    OPTIONS (table 'ks.kv', partition_key 'id', clustering_columns 'ck',
+             scan_parallelism '4');
+EXPLAIN (VERBOSE, COSTS OFF) SELECT count(*) FROM kp;
+
+-- Parameters of a generic plan are bound like constants.  The value is out
+-- of range, so that executing needs no connection.
+PREPARE q(bigint, text) AS SELECT * FROM kv WHERE id = $1 AND val = $2;
+EXECUTE q(5000000000, 'x');
+EXECUTE q(5000000000, 'x');
+EXECUTE q(5000000000, 'x');
+EXECUTE q(5000000000, 'x');
+EXECUTE q(5000000000, 'x');
+EXPLAIN (VERBOSE, COSTS OFF) EXECUTE q(5000000000, 'x');
+DEALLOCATE q;
+
+-- Server options
+CREATE SERVER cass_bad FOREIGN DATA WRAPPER cassandra2_fdw
+    OPTIONS (url 'localhost', querytimeout '1000', request_timeout '2000');
+ALTER SERVER cass_serv OPTIONS (ADD tcp_keepalive '0');
+ALTER SERVER cass_serv OPTIONS (SET tcp_keepalive '-1');